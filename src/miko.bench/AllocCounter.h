@@ -0,0 +1,79 @@
+//
+// Global allocation counter for the benchmarks.
+//
+// Replaces the global operator new/delete, so include it from exactly one
+// translation unit of a benchmark program.
+//
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace bench {
+inline std::atomic<uint64_t> allocations{0};
+inline std::atomic<uint64_t> allocated_bytes{0};
+
+inline void* counted_alloc(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+// aligned_alloc wants a size that is a nonzero multiple of the alignment.
+inline void* counted_alloc(std::size_t size, std::align_val_t alignment) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    const auto align = static_cast<std::size_t>(alignment);
+    return std::aligned_alloc(align, (size ? size + align - 1 : align) / align * align);
+}
+
+// Out of line so GCC, having inlined a delete into its caller, does not see
+// free() take a pointer from operator new and warn of a mismatch.
+[[gnu::noinline]] inline void release(void* p) noexcept { std::free(p); }
+} // namespace bench
+
+// Every replaceable form, so each allocation is counted and each is freed
+// by a matching delete.
+void* operator new(std::size_t size) {
+    if (void* p = bench::counted_alloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t size) {
+    if (void* p = bench::counted_alloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    if (void* p = bench::counted_alloc(size, alignment))
+        return p;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    if (void* p = bench::counted_alloc(size, alignment))
+        return p;
+    throw std::bad_alloc();
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return bench::counted_alloc(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return bench::counted_alloc(size); }
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return bench::counted_alloc(size, alignment);
+}
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return bench::counted_alloc(size, alignment);
+}
+
+void operator delete(void* p) noexcept { bench::release(p); }
+void operator delete[](void* p) noexcept { bench::release(p); }
+void operator delete(void* p, std::size_t) noexcept { bench::release(p); }
+void operator delete[](void* p, std::size_t) noexcept { bench::release(p); }
+void operator delete(void* p, std::align_val_t) noexcept { bench::release(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { bench::release(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { bench::release(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { bench::release(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { bench::release(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { bench::release(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { bench::release(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { bench::release(p); }
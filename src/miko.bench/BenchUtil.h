@@ -0,0 +1,48 @@
+//
+// Small helpers shared by the miko benchmarks.
+//
+
+#pragma once
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "Logger.hpp"
+
+namespace bench {
+
+using clock = std::chrono::steady_clock;
+
+inline double elapsed_us(clock::time_point start, clock::time_point end) {
+    return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+// Silences std::cout and the server's Info lines for its lifetime; the
+// server logs every room and join.
+class QuietStdout {
+public:
+    QuietStdout() : saved_(std::cout.rdbuf(nullptr)), saved_level_(Logger::instance().level()) {
+        Logger::instance().set_level(LogLevel::Warn);
+    }
+    ~QuietStdout() {
+        Logger::instance().set_level(saved_level_);
+        std::cout.rdbuf(saved_);
+        std::cout.clear();
+    }
+
+private:
+    std::streambuf* saved_;
+    LogLevel saved_level_;
+};
+
+// Reads an integer "--name value" argument, falling back to 'def'.
+inline long arg_or(int argc, char* argv[], const std::string& name, long def) {
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (name == argv[i]) {
+            return std::strtol(argv[i + 1], nullptr, 10);
+        }
+    }
+    return def;
+}
+
+} // namespace bench
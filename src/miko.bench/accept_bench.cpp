@@ -0,0 +1,169 @@
+//
+// Connect rate: a reconnect storm against one acceptor and SO_REUSEPORT.
+//
+// For each count in --threads (default "1,2,4") starts an in-process
+// MikoServer on loopback twice: once with one acceptor on an io_context
+// shared by the worker threads, and once with an SO_REUSEPORT acceptor per
+// worker, each on its own io_context. --client-threads threads then keep
+// --inflight connection attempts each going until --connections WebSocket
+// handshakes have completed. Connections stay open until the row ends, as
+// clients coming back after a deploy would. Every row reports handshakes
+// per second and the p50/p99/max time from connect() to a completed
+// handshake.
+//
+
+#include "BenchUtil.h"
+#include "Metrics.hpp"
+#include "MikoServer.hpp"
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket.hpp>
+#include <atomic>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace net = boost::asio;
+namespace beast = boost::beast;
+namespace websocket = beast::websocket;
+using tcp = net::ip::tcp;
+
+namespace {
+
+using ws_stream = websocket::stream<tcp::socket>;
+
+struct RunState {
+    std::atomic<long> started{0};
+    std::atomic<long> connected{0};
+    std::atomic<long> failed{0};
+    LatencyHistogram handshake_ns;
+    std::mutex open_mutex;
+    std::vector<std::unique_ptr<ws_stream>> open; // held until the row ends
+};
+
+// One chain of connection attempts: connect, handshake, keep the stream,
+// start the next, until 'total' attempts have been started.
+void connect_next(net::io_context& ioc, const tcp::endpoint& endpoint, RunState& state, long total) {
+    if (state.started.fetch_add(1) >= total)
+        return;
+    auto ws = std::make_shared<std::unique_ptr<ws_stream>>(std::make_unique<ws_stream>(ioc));
+    const auto start = bench::clock::now();
+    (*ws)->next_layer().async_connect(endpoint, [&ioc, &endpoint, &state, total, ws, start](beast::error_code ec) {
+        if (ec) {
+            state.failed.fetch_add(1);
+            return connect_next(ioc, endpoint, state, total);
+        }
+        (*ws)->async_handshake("127.0.0.1", "/", [&ioc, &endpoint, &state, total, ws, start](beast::error_code ec) {
+            if (ec) {
+                state.failed.fetch_add(1);
+            } else {
+                state.handshake_ns.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                              bench::clock::now() - start).count());
+                state.connected.fetch_add(1);
+                std::lock_guard<std::mutex> lock(state.open_mutex);
+                state.open.push_back(std::move(*ws));
+            }
+            connect_next(ioc, endpoint, state, total);
+        });
+    });
+}
+
+void run_row(const char* name, int threads, bool reuse_port, long connections, long client_threads, long inflight) {
+    std::vector<std::unique_ptr<net::io_context>> contexts;
+    std::shared_ptr<MikoServer> server;
+    const tcp::endpoint any{net::ip::make_address("127.0.0.1"), 0};
+    if (reuse_port) {
+        std::vector<net::io_context*> pointers;
+        for (int i = 0; i < threads; ++i) {
+            contexts.push_back(std::make_unique<net::io_context>(1));
+            pointers.push_back(contexts.back().get());
+        }
+        server = std::make_shared<MikoServer>(pointers, any, ServerConfig{});
+    } else {
+        contexts.push_back(std::make_unique<net::io_context>(threads));
+        server = std::make_shared<MikoServer>(*contexts.front(), any, ServerConfig{});
+    }
+    server->run();
+    const tcp::endpoint endpoint = server->local_endpoint();
+
+    RunState state;
+    double seconds = 0;
+    {
+        bench::QuietStdout quiet;
+        std::vector<std::thread> server_threads;
+        for (int i = 0; i < threads; ++i) {
+            auto& ioc = *contexts[reuse_port ? i : 0];
+            server_threads.emplace_back([&ioc] { ioc.run(); });
+        }
+
+        std::vector<std::unique_ptr<net::io_context>> client_contexts;
+        for (long i = 0; i < client_threads; ++i)
+            client_contexts.push_back(std::make_unique<net::io_context>(1));
+        const auto start = bench::clock::now();
+        std::vector<std::thread> client_pool;
+        for (auto& ioc : client_contexts) {
+            client_pool.emplace_back([&ioc, &endpoint, &state, connections, inflight] {
+                for (long i = 0; i < inflight; ++i)
+                    connect_next(*ioc, endpoint, state, connections);
+                ioc->run();
+            });
+        }
+        for (auto& t : client_pool)
+            t.join();
+        seconds = bench::elapsed_us(start, bench::clock::now()) / 1e6;
+
+        // Drop the connections before the server, then stop it.
+        {
+            std::lock_guard<std::mutex> lock(state.open_mutex);
+            for (auto& ws : state.open) {
+                beast::error_code ignored;
+                ws->next_layer().close(ignored);
+            }
+            state.open.clear();
+        }
+        for (auto& ioc : contexts)
+            ioc->stop();
+        for (auto& t : server_threads)
+            t.join();
+    }
+
+    const LatencyHistogram& h = state.handshake_ns;
+    std::cout << std::setw(12) << name << std::setw(9) << threads << std::setw(10) << state.connected.load()
+              << std::fixed << std::setprecision(0) << std::setw(12) << state.connected.load() / seconds
+              << std::setw(10) << h.percentile(0.50) / 1000 << std::setw(10) << h.percentile(0.99) / 1000
+              << std::setw(10) << h.max() / 1000 << (state.failed ? "  (connection failures)" : "") << std::endl;
+}
+
+std::vector<int> parse_threads(int argc, char* argv[]) {
+    std::string spec = "1,2,4";
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string(argv[i]) == "--threads") spec = argv[i + 1];
+    }
+    std::vector<int> counts;
+    std::istringstream iss(spec);
+    std::string item;
+    while (std::getline(iss, item, ','))
+        counts.push_back(std::stoi(item));
+    return counts;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const long connections = bench::arg_or(argc, argv, "--connections", 5000);
+    const long client_threads = bench::arg_or(argc, argv, "--client-threads", 2);
+    const long inflight = bench::arg_or(argc, argv, "--inflight", 64);
+
+    std::cout << "connections=" << connections << " client-threads=" << client_threads
+              << " inflight/thread=" << inflight << std::endl;
+    std::cout << std::setw(12) << "acceptors" << std::setw(9) << "threads" << std::setw(10) << "connected"
+              << std::setw(12) << "conn/s" << std::setw(10) << "p50_us" << std::setw(10) << "p99_us"
+              << std::setw(10) << "max_us" << std::endl;
+    for (int threads : parse_threads(argc, argv)) {
+        run_row("shared", threads, false, connections, client_threads, inflight);
+        run_row("reuseport", threads, true, connections, client_threads, inflight);
+    }
+    return EXIT_SUCCESS;
+}
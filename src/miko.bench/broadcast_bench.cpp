@@ -0,0 +1,74 @@
+//
+// Broadcast fan-out cost as the number of unrelated sessions grows.
+//
+// A fixed room of --members sessions receives --iterations broadcasts while
+// the server holds an increasing number of idle sessions in other rooms. With
+// the per-room membership index the cost per broadcast should stay flat.
+//
+
+#include "BenchUtil.h"
+#include "MikoServer.hpp"
+#include "Session.hpp"
+#include <boost/asio.hpp>
+#include <iomanip>
+#include <vector>
+
+namespace net = boost::asio;
+using tcp = net::ip::tcp;
+
+static std::shared_ptr<Session> make_member(net::io_context& ioc, const std::shared_ptr<MikoServer>& server,
+                                            const std::string& room_id, const std::string& nick) {
+    auto session = std::make_shared<Session>(Session::socket_type(net::make_strand(ioc)), server);
+    server->add_session(session);
+    const Room* room = server->get_room(room_id);
+    server->join_room(room_id, room->get_key(), session, nick);
+    return session;
+}
+
+int main(int argc, char* argv[]) {
+    const long members = bench::arg_or(argc, argv, "--members", 16);
+    const long iterations = bench::arg_or(argc, argv, "--iterations", 2000);
+    const long other_rooms = bench::arg_or(argc, argv, "--other-rooms", 100);
+    const std::vector<long> unrelated_counts = {0, 1000, 10000, 50000};
+
+    std::cout << "members=" << members << " iterations=" << iterations
+              << " other_rooms=" << other_rooms << std::endl;
+    std::cout << std::setw(12) << "unrelated" << std::setw(16) << "us/broadcast" << std::endl;
+
+    for (long unrelated : unrelated_counts) {
+        // Sessions are never started, so no I/O happens; queued writes are
+        // discarded with the io_context.
+        net::io_context ioc;
+        auto server = std::make_shared<MikoServer>(ioc, tcp::endpoint{net::ip::make_address("127.0.0.1"), 0});
+        std::vector<std::shared_ptr<Session>> sessions;
+        std::string target;
+        {
+            bench::QuietStdout quiet;
+            target = server->create_room("bench");
+            std::vector<std::string> rooms;
+            for (long i = 0; i < other_rooms; ++i) {
+                rooms.push_back(server->create_room());
+            }
+            for (long i = 0; i < unrelated; ++i) {
+                sessions.push_back(make_member(ioc, server, rooms[i % rooms.size()], "idle"));
+            }
+            for (long i = 0; i < members; ++i) {
+                sessions.push_back(make_member(ioc, server, target, "member"));
+            }
+        }
+
+        const std::string payload(64, 'x');
+        auto start = bench::clock::now();
+        for (long i = 0; i < iterations; ++i) {
+            server->send_room_message(target, "bench", payload);
+        }
+        auto end = bench::clock::now();
+        std::cout << std::setw(12) << unrelated << std::setw(16) << std::fixed << std::setprecision(2)
+                  << bench::elapsed_us(start, end) / iterations << std::endl;
+
+        for (auto& session : sessions) {
+            server->remove_session(session);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+//
+// Control message cost: text "/CMD" commands against binary control frames.
+//
+// Each row runs --iterations times and reports ns and heap allocations per
+// message. "parse" rows decode a client command the way Session does: the
+// text rows tokenize with std::istringstream as process_command does, the
+// binary rows read the fields in place with ControlReader. "reply" rows build
+// a join-success reply: by string concatenation as before, and with
+// ControlWriter in either form.
+//
+
+#include "AllocCounter.h"
+#include "BenchUtil.h"
+#include "ControlFrame.hpp"
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+namespace {
+
+const std::string kRoomId = "Rz7O6TEj";
+const std::string kRoomKey = "a5JQ1nQk0Pzq8v2W";
+const std::string kNick = "alice";
+const std::string kName = "general";
+
+size_t sink = 0; // keeps results observable
+
+template <typename Fn>
+void row(const char* name, long iterations, Fn&& fn) {
+    fn(); // warm up
+    const uint64_t allocs_before = bench::allocations.load();
+    auto start = bench::clock::now();
+    for (long i = 0; i < iterations; ++i)
+        fn();
+    const double ns = bench::elapsed_us(start, bench::clock::now()) * 1000.0 / iterations;
+    const double allocs = static_cast<double>(bench::allocations.load() - allocs_before) / iterations;
+    std::cout << std::setw(26) << name << std::fixed << std::setprecision(1) << std::setw(10) << ns
+              << std::setw(10) << allocs << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const long iterations = bench::arg_or(argc, argv, "--iterations", 200000);
+
+    const std::string join_text = "/CMD join-room " + kRoomId + " " + kRoomKey + " " + kNick + " --since 12345";
+    const std::string create_text = "/CMD create-room --cipher aes-256-gcm " + kName;
+    const std::string nick_text = "/CMD nick " + kNick;
+    ControlWriter join_writer(ControlOp::JoinRoom, true);
+    join_writer.add(kRoomId).add(kRoomKey).add(kNick).add("since").add("count", uint64_t{12345});
+    const std::string join_frame = join_writer.take();
+    ControlWriter create_writer(ControlOp::CreateRoom, true);
+    create_writer.add(kName).add("aes-256-gcm");
+    const std::string create_frame = create_writer.take();
+    ControlWriter nick_writer(ControlOp::Nick, true);
+    nick_writer.add(kNick);
+    const std::string nick_frame = nick_writer.take();
+
+    std::cout << "iterations=" << iterations << std::endl;
+    std::cout << std::setw(26) << "message" << std::setw(10) << "ns" << std::setw(10) << "allocs" << std::endl;
+
+    row("parse join-room text", iterations, [&] {
+        std::istringstream iss(join_text);
+        std::string prefix, subcmd, room_id, room_key, nick, option;
+        uint64_t value = 0;
+        iss >> prefix >> subcmd >> room_id >> room_key >> nick >> option >> value;
+        sink += room_id.size() + room_key.size() + nick.size() + option.size() + value;
+    });
+    row("parse join-room binary", iterations, [&] {
+        ControlReader reader(join_frame);
+        std::string_view room_id = reader.text(), room_key = reader.text(), nick = reader.text();
+        std::string_view option = reader.text();
+        uint64_t value = reader.number();
+        sink += room_id.size() + room_key.size() + nick.size() + option.size() + value;
+    });
+    row("parse create-room text", iterations, [&] {
+        std::istringstream iss(create_text);
+        std::string prefix, subcmd, rest, cipher, name;
+        iss >> prefix >> subcmd;
+        std::getline(iss, rest);
+        std::istringstream flags(rest.substr(rest.find("--cipher ") + 9));
+        flags >> cipher;
+        std::getline(flags, name);
+        sink += cipher.size() + name.size();
+    });
+    row("parse create-room binary", iterations, [&] {
+        ControlReader reader(create_frame);
+        std::string_view name = reader.text(), cipher = reader.text();
+        sink += cipher.size() + name.size();
+    });
+    row("parse nick text", iterations, [&] {
+        std::istringstream iss(nick_text);
+        std::string prefix, subcmd, nick;
+        iss >> prefix >> subcmd >> nick;
+        sink += nick.size();
+    });
+    row("parse nick binary", iterations, [&] {
+        ControlReader reader(nick_frame);
+        sink += reader.text().size();
+    });
+
+    const uint64_t seq = 123456, replay = 123356;
+    row("reply join-success concat", iterations, [&] {
+        std::string reply = "/CMD join-success " + kRoomId + " " + kName + " cipher=" + "aes-256-gcm" +
+                            " seq=" + std::to_string(seq) + " replay=" + std::to_string(replay);
+        sink += reply.size();
+    });
+    row("reply join-success text", iterations, [&] {
+        ControlWriter reply(ControlOp::JoinSuccess, false);
+        reply.add(kRoomId).add(kName).add("cipher", "aes-256-gcm").add("seq", seq).add("replay", replay);
+        sink += reply.take().size();
+    });
+    row("reply join-success binary", iterations, [&] {
+        ControlWriter reply(ControlOp::JoinSuccess, true);
+        reply.add(kRoomId).add(kName).add("cipher", "aes-256-gcm").add("seq", seq).add("replay", replay);
+        sink += reply.take().size();
+    });
+
+    return sink == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+//
+// Room-message crypto throughput on one core.
+//
+// Each iteration encrypts a payload and decrypts it again, as a sender and a
+// decrypting server would. "legacy" is the previous AESHelper: a fresh
+// EVP_CIPHER_CTX, scratch vector and result string per call, and a helper
+// built per message. The other rows use the current AESHelper.
+//
+
+#include "BenchUtil.h"
+#include "aes_encryption.h"
+#include <iomanip>
+#include <vector>
+
+namespace {
+
+// The previous implementation, kept here as the baseline.
+class LegacyAESHelper {
+public:
+    static constexpr size_t BLOCK_SIZE = 16;
+
+    explicit LegacyAESHelper(const std::string& key) : m_key(key.begin(), key.end()) {}
+
+    std::string encrypt(const std::string& plaintext) {
+        unsigned char iv[BLOCK_SIZE];
+        RAND_bytes(iv, BLOCK_SIZE);
+        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+        EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), nullptr, m_key.data(), iv);
+        std::vector<unsigned char> ciphertext(plaintext.size() + BLOCK_SIZE);
+        int len = 0;
+        EVP_EncryptUpdate(ctx, ciphertext.data(), &len, reinterpret_cast<const unsigned char*>(plaintext.data()),
+                          plaintext.size());
+        int ciphertext_len = len;
+        EVP_EncryptFinal_ex(ctx, ciphertext.data() + len, &len);
+        ciphertext_len += len;
+        EVP_CIPHER_CTX_free(ctx);
+        std::string result(reinterpret_cast<char*>(iv), BLOCK_SIZE);
+        result.append(reinterpret_cast<char*>(ciphertext.data()), ciphertext_len);
+        return result;
+    }
+
+    std::string decrypt(const std::string& cipher_with_iv) {
+        const auto* iv = reinterpret_cast<const unsigned char*>(cipher_with_iv.data());
+        const auto* ciphertext = iv + BLOCK_SIZE;
+        int ciphertext_len = cipher_with_iv.size() - BLOCK_SIZE;
+        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+        EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), nullptr, m_key.data(), iv);
+        std::vector<unsigned char> plaintext(ciphertext_len + BLOCK_SIZE);
+        int len = 0;
+        EVP_DecryptUpdate(ctx, plaintext.data(), &len, ciphertext, ciphertext_len);
+        int plaintext_len = len;
+        EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &len);
+        plaintext_len += len;
+        EVP_CIPHER_CTX_free(ctx);
+        return std::string(reinterpret_cast<char*>(plaintext.data()), plaintext_len);
+    }
+
+private:
+    std::vector<unsigned char> m_key;
+};
+
+template <typename Fn>
+double messages_per_second(long iterations, Fn&& fn) {
+    auto start = bench::clock::now();
+    for (long i = 0; i < iterations; ++i)
+        fn();
+    return iterations / (bench::elapsed_us(start, bench::clock::now()) / 1e6);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const long iterations = bench::arg_or(argc, argv, "--iterations", 200000);
+    const std::string key16(16, 'k');
+    const std::string key32(32, 'k');
+
+    std::cout << "iterations=" << iterations << " (encrypt + decrypt per message)" << std::endl;
+    std::cout << std::setw(8) << "payload" << std::setw(14) << "legacy-cbc" << std::setw(14) << "cbc"
+              << std::setw(14) << "cbc-buffers" << std::setw(14) << "gcm-128" << std::setw(14) << "gcm-256"
+              << "   msgs/s" << std::endl;
+
+    for (size_t size : {64, 512, 4096}) {
+        const std::string payload(size, 'p');
+        std::string sealed, opened;
+        double legacy = messages_per_second(iterations, [&] {
+            LegacyAESHelper sender(key16);
+            LegacyAESHelper receiver(key16);
+            opened = receiver.decrypt(sender.encrypt(payload));
+        });
+        double cbc = messages_per_second(iterations, [&] {
+            AESHelper sender(key16);
+            AESHelper receiver(key16);
+            opened = receiver.decrypt(sender.encrypt(payload));
+        });
+        auto buffered = [&](const std::string& key, CipherMode mode) {
+            return messages_per_second(iterations, [&] {
+                AESHelper aes(key, mode);
+                aes.encrypt(payload, sealed);
+                aes.decrypt(sealed, opened);
+            });
+        };
+        double cbc_buffers = buffered(key16, CipherMode::AES_128_CBC);
+        double gcm128 = buffered(key16, CipherMode::AES_128_GCM);
+        double gcm256 = buffered(key32, CipherMode::AES_256_GCM);
+        if (opened != payload) {
+            std::cerr << "round trip mismatch" << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << std::setw(8) << size << std::fixed << std::setprecision(0) << std::setw(14) << legacy
+                  << std::setw(14) << cbc << std::setw(14) << cbc_buffers << std::setw(14) << gcm128
+                  << std::setw(14) << gcm256 << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,211 @@
+//
+// Compression bandwidth and CPU over a chat corpus.
+//
+// The corpus is one message per line from --corpus FILE, or a synthetic one
+// of --messages lines: short chat with the odd pasted log line. Lines read
+// "nick: text". Every row sends the whole corpus through one simulated
+// connection and reports the bytes on the wire against the uncompressed
+// messages (frame headers included), and the compression time per message.
+//
+// "pmd" rows model permessage-deflate as Beast runs it: one compressor per
+// connection, kept across messages (context takeover), a sync flush per
+// message with the trailing 00 00 ff ff dropped, and messages under the
+// threshold sent as they are. They sweep the window bits and memory level,
+// with the per-connection state those cost, over the chat lines a
+// decrypting server sends ("[nick]: text").
+//
+// The relay rows compare the frames a relaying server forwards: deflating
+// the ciphertext with permessage-deflate, against rooms created with
+// --compress, where the client runs compress_payload before encrypting.
+//
+
+#include "BenchUtil.h"
+#include "PayloadCompression.hpp"
+#include "RoomFrame.hpp"
+#include "aes_encryption.h"
+#include <boost/beast/zlib/deflate_stream.hpp>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+namespace zlib = boost::beast::zlib;
+
+std::vector<std::string> synthetic_corpus(size_t count) {
+    static const char* const nicks[] = {"alice", "bob", "carol", "dave", "erin", "frank"};
+    static const char* const words[] = {
+        "the", "a", "to", "and", "is", "it", "that", "for", "on", "you", "this", "with", "be", "are", "have",
+        "was", "not", "just", "so", "but", "what", "we", "can", "do", "if", "about", "think", "now", "build",
+        "server", "room", "message", "deploy", "test", "fixed", "broken", "looks", "good", "lgtm", "merge",
+        "branch", "tomorrow", "meeting", "lunch", "anyone", "know", "why", "the", "config", "latency",
+        "ok", "thanks", "sure", "yeah", "nope", "maybe", "later", "right", "cool", "see", "logs", "error",
+    };
+    static const char* const paste =
+        "2025-03-23T10:41:07Z WARN session 0x7f3a2c00 send queue above high-water mark "
+        "(depth=412 bytes=4194816); closing connection from 10.0.3.17:51234 after 3 retries";
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<size_t> nick(0, std::size(nicks) - 1);
+    std::uniform_int_distribution<size_t> word(0, std::size(words) - 1);
+    std::uniform_int_distribution<int> length(2, 24);
+    std::vector<std::string> corpus;
+    corpus.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        std::string line = std::string(nicks[nick(rng)]) + ": ";
+        if (i % 25 == 24) {
+            line += paste;
+        } else {
+            const int n = length(rng);
+            for (int w = 0; w < n; ++w)
+                line.append(w ? " " : "").append(words[word(rng)]);
+        }
+        corpus.push_back(std::move(line));
+    }
+    return corpus;
+}
+
+// WebSocket frame header for a server-to-client payload of 'size' bytes.
+size_t frame_header(size_t size) {
+    return size < 126 ? 2 : size < 65536 ? 4 : 10;
+}
+
+struct Result {
+    size_t raw = 0;
+    size_t wire = 0;
+    double ns_per_message = 0;
+};
+
+// Sends 'messages' through one permessage-deflate connection.
+Result permessage_deflate(const std::vector<std::string>& messages, int window_bits, int mem_level,
+                          size_t threshold) {
+    zlib::deflate_stream deflater;
+    deflater.reset(6, window_bits, mem_level, zlib::Strategy::normal);
+    std::string out;
+    Result result;
+    auto start = bench::clock::now();
+    for (const std::string& message : messages) {
+        result.raw += frame_header(message.size()) + message.size();
+        if (message.size() < threshold) {
+            result.wire += frame_header(message.size()) + message.size();
+            continue;
+        }
+        out.resize(deflater.upper_bound(message.size()) + 16);
+        zlib::z_params zs;
+        zs.next_in = message.data();
+        zs.avail_in = message.size();
+        zs.next_out = &out[0];
+        zs.avail_out = out.size();
+        boost::beast::error_code ec;
+        deflater.write(zs, zlib::Flush::sync, ec);
+        const size_t size = zs.total_out - 4; // drop 00 00 ff ff
+        result.wire += frame_header(size) + size;
+    }
+    result.ns_per_message = bench::elapsed_us(start, bench::clock::now()) * 1000.0 / messages.size();
+    return result;
+}
+
+// Compressor and window state per connection, as zlib documents it.
+size_t state_bytes(int window_bits, int mem_level) {
+    return (size_t{1} << (window_bits + 2)) + (size_t{1} << (mem_level + 9));
+}
+
+void print_row(const std::string& name, const Result& r, size_t state) {
+    std::cout << std::setw(28) << name << std::setw(12) << r.raw << std::setw(12) << r.wire << std::fixed
+              << std::setprecision(3) << std::setw(8) << static_cast<double>(r.wire) / r.raw
+              << std::setprecision(0) << std::setw(10) << r.ns_per_message << std::setw(10) << state
+              << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const long count = bench::arg_or(argc, argv, "--messages", 20000);
+    std::string corpus_path;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string(argv[i]) == "--corpus")
+            corpus_path = argv[i + 1];
+    }
+    std::vector<std::string> corpus;
+    if (!corpus_path.empty()) {
+        std::ifstream in(corpus_path);
+        for (std::string line; std::getline(in, line);) {
+            if (!line.empty())
+                corpus.push_back(line);
+        }
+    } else {
+        corpus = synthetic_corpus(static_cast<size_t>(count));
+    }
+    if (corpus.empty()) {
+        std::cerr << "Empty corpus" << std::endl;
+        return EXIT_FAILURE;
+    }
+    size_t corpus_bytes = 0;
+    for (const std::string& line : corpus)
+        corpus_bytes += line.size();
+    std::cout << "messages=" << corpus.size() << " avg_bytes=" << corpus_bytes / corpus.size() << std::endl;
+    std::cout << std::setw(28) << "row" << std::setw(12) << "raw" << std::setw(12) << "wire" << std::setw(8)
+              << "ratio" << std::setw(10) << "ns/msg" << std::setw(10) << "state" << std::endl;
+
+    // Decrypting server: chat lines, "[nick]: text".
+    std::vector<std::string> chat;
+    chat.reserve(corpus.size());
+    for (const std::string& line : corpus) {
+        const size_t colon = line.find(": ");
+        chat.push_back(colon == std::string::npos ? line
+                                                  : "[" + line.substr(0, colon) + "]: " + line.substr(colon + 2));
+    }
+    print_row("chat uncompressed", permessage_deflate(chat, 15, 8, SIZE_MAX), 0);
+    for (int bits : {9, 12, 15}) {
+        for (int level : {1, 4, 8}) {
+            const std::string name = "chat pmd w" + std::to_string(bits) + " m" + std::to_string(level);
+            print_row(name, permessage_deflate(chat, bits, level, 0), state_bytes(bits, level));
+        }
+    }
+    for (size_t threshold : {32, 64, 128}) {
+        print_row("chat pmd w15 m4 min" + std::to_string(threshold), permessage_deflate(chat, 15, 4, threshold),
+                  state_bytes(15, 4));
+    }
+
+    // Relaying server: room frames with the payload encrypted on the client.
+    const std::string room_id = "Rz7O6TEj";
+    const std::string key(16, 'k');
+    AESHelper aes(key, CipherMode::AES_128_GCM);
+    std::vector<std::string> relay, relay_compressed;
+    relay.reserve(corpus.size());
+    relay_compressed.reserve(corpus.size());
+    std::string payload, ciphertext;
+    auto start = bench::clock::now();
+    for (const std::string& line : corpus) {
+        compress_payload(line, payload);
+        aes.encrypt(payload, ciphertext);
+        std::string frame;
+        pack_view(frame, room_id);
+        pack_view(frame, line.substr(0, line.find(':')));
+        pack_view(frame, ciphertext);
+        relay_compressed.push_back(std::move(frame));
+    }
+    const double compress_ns = bench::elapsed_us(start, bench::clock::now()) * 1000.0 / corpus.size();
+    start = bench::clock::now();
+    for (const std::string& line : corpus) {
+        aes.encrypt(line, ciphertext);
+        std::string frame;
+        pack_view(frame, room_id);
+        pack_view(frame, line.substr(0, line.find(':')));
+        pack_view(frame, ciphertext);
+        relay.push_back(std::move(frame));
+    }
+    const double plain_ns = bench::elapsed_us(start, bench::clock::now()) * 1000.0 / corpus.size();
+
+    const Result relay_raw = permessage_deflate(relay, 15, 8, SIZE_MAX);
+    print_row("relay uncompressed", relay_raw, 0);
+    print_row("relay pmd w15 m4", permessage_deflate(relay, 15, 4, 0), state_bytes(15, 4));
+    // Ratios against the uncompressed relay frames; the time is the extra
+    // client cost of compress_payload over encrypting alone.
+    Result before = permessage_deflate(relay_compressed, 15, 8, SIZE_MAX);
+    before.raw = relay_raw.raw;
+    before.ns_per_message = compress_ns - plain_ns;
+    print_row("relay compress-then-encrypt", before, 0);
+    return EXIT_SUCCESS;
+}
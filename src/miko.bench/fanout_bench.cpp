@@ -0,0 +1,162 @@
+//
+// Allocations and CPU per delivered message as room size grows.
+//
+// For each room size in --sizes, that many loopback clients join one room.
+// The bench then calls MikoServer::send_room_message --broadcasts times and
+// waits until every member has received every line. Allocation counts and
+// process CPU time (server and clients share the process) are divided by the
+// number of deliveries.
+//
+
+#include "AllocCounter.h"
+#include "BenchUtil.h"
+#include "MikoServer.hpp"
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket.hpp>
+#include <sys/resource.h>
+#include <atomic>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace net = boost::asio;
+namespace beast = boost::beast;
+namespace websocket = beast::websocket;
+using tcp = net::ip::tcp;
+
+struct RunState {
+    std::atomic<long> joined{0};
+    std::atomic<uint64_t> delivered{0};
+};
+
+class Member : public std::enable_shared_from_this<Member> {
+public:
+    Member(net::io_context& ioc, RunState& state, std::string join)
+        : ws_(ioc), state_(state), join_(std::move(join)) {}
+
+    void start(const tcp::endpoint& endpoint) {
+        ws_.next_layer().async_connect(endpoint, [self = shared_from_this()](beast::error_code ec) {
+            if (ec) return;
+            self->ws_.async_handshake("127.0.0.1", "/", [self](beast::error_code ec) {
+                if (ec) return;
+                self->ws_.text(true);
+                self->ws_.async_write(net::buffer(self->join_), [self](beast::error_code ec, std::size_t) {
+                    if (!ec) self->do_read();
+                });
+            });
+        });
+    }
+
+private:
+    void do_read() {
+        ws_.async_read(buffer_, [self = shared_from_this()](beast::error_code ec, std::size_t) {
+            if (ec) return;
+            self->on_message();
+            self->buffer_.consume(self->buffer_.size());
+            self->do_read();
+        });
+    }
+
+    void on_message() {
+        auto data = buffer_.data();
+        const char* p = static_cast<const char*>(data.data());
+        const size_t n = data.size();
+        if (n >= 4 && std::memcmp(p, "/CMD", 4) == 0) {
+            state_.joined.fetch_add(1);
+            return;
+        }
+        // Coalesced chat lines are newline-separated.
+        uint64_t lines = 1;
+        for (const char* q = p; (q = static_cast<const char*>(std::memchr(q, '\n', p + n - q))); ++q)
+            ++lines;
+        state_.delivered.fetch_add(lines, std::memory_order_relaxed);
+    }
+
+    // Concrete executor type, so the client side does not allocate per read.
+    websocket::stream<net::basic_stream_socket<tcp, net::io_context::executor_type>> ws_;
+    beast::flat_buffer buffer_;
+    RunState& state_;
+    std::string join_;
+};
+
+static double cpu_seconds() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void wait_for(const std::atomic<uint64_t>& value, uint64_t target) {
+    while (value.load() < target)
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+}
+
+int main(int argc, char* argv[]) {
+    const long broadcasts = bench::arg_or(argc, argv, "--broadcasts", 200);
+    std::vector<long> sizes = {10, 100, 1000, 5000};
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string(argv[i]) == "--sizes") {
+            sizes.clear();
+            std::istringstream iss(argv[i + 1]);
+            std::string item;
+            while (std::getline(iss, item, ',')) sizes.push_back(std::stol(item));
+        }
+    }
+
+    std::cout << "broadcasts=" << broadcasts << std::endl;
+    std::cout << std::setw(8) << "members" << std::setw(14) << "delivered" << std::setw(18) << "allocs/delivery"
+              << std::setw(18) << "cpu ns/delivery" << std::endl;
+
+    for (long members : sizes) {
+        net::io_context ioc;
+        ServerConfig config;
+        config.send_queue_high_water = 64 * 1024 * 1024;
+        auto server = std::make_shared<MikoServer>(ioc, tcp::endpoint{net::ip::make_address("127.0.0.1"), 0}, config);
+        RunState state;
+        std::string room_id;
+        std::thread runner;
+        {
+            bench::QuietStdout quiet;
+            room_id = server->create_room("fanout");
+            std::string join = "/CMD join-room " + room_id + " " + server->get_room(room_id)->get_key() + " m";
+            server->run();
+            std::vector<std::shared_ptr<Member>> pool;
+            for (long i = 0; i < members; ++i) {
+                pool.push_back(std::make_shared<Member>(ioc, state, join));
+                pool.back()->start(server->local_endpoint());
+            }
+            runner = std::thread([&ioc] { ioc.run(); });
+            while (state.joined.load() < members)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        // Warm up queues, buffers and handler memory before measuring.
+        const std::string payload(64, 'x');
+        server->send_room_message(room_id, "bench", payload);
+        wait_for(state.delivered, members);
+
+        const uint64_t target = state.delivered.load() + static_cast<uint64_t>(broadcasts) * members;
+        const uint64_t allocs_before = bench::allocations.load();
+        const double cpu_before = cpu_seconds();
+        // Broadcast from an I/O thread, as a receiving session would.
+        net::post(ioc, [&] {
+            for (long i = 0; i < broadcasts; ++i)
+                server->send_room_message(room_id, "bench", payload);
+        });
+        wait_for(state.delivered, target);
+        const double cpu = cpu_seconds() - cpu_before;
+        const uint64_t allocs = bench::allocations.load() - allocs_before;
+
+        const double deliveries = static_cast<double>(broadcasts) * members;
+        std::cout << std::setw(8) << members << std::setw(14) << static_cast<uint64_t>(deliveries) << std::setw(18)
+                  << std::fixed << std::setprecision(3) << allocs / deliveries << std::setw(18)
+                  << std::setprecision(0) << cpu * 1e9 / deliveries << std::endl;
+
+        ioc.stop();
+        runner.join();
+    }
+    return EXIT_SUCCESS;
+}
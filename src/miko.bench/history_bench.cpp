@@ -0,0 +1,108 @@
+//
+// Room history store: insert throughput and resident memory.
+//
+// --rooms rooms each receive --messages messages, round-robin, with payload
+// sizes cycling between 40 and 200 bytes; "fill" is that pass, "steady" a
+// second one of the same length once every store is at its limit. "deque" is the previous store, a
+// std::deque<std::string> capped at 16384 messages; "arena" is HistoryArena
+// with --arena-bytes per room and the same message cap. Each store runs in
+// its own child process so RSS is not polluted by the other.
+//
+
+#include "BenchUtil.h"
+#include "HistoryArena.hpp"
+#include "Room.hpp"
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+class DequeHistory {
+public:
+    void push_back(std::string_view message) {
+        if (history_.size() >= Room::max_history)
+            history_.pop_front();
+        history_.emplace_back(message);
+    }
+    size_t size() const { return history_.size(); }
+
+private:
+    std::deque<std::string> history_;
+};
+
+size_t rss_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+// Inserts per second for one round-robin pass over every room.
+template <typename Store>
+double pass(std::vector<Store>& stores, long messages) {
+    static const std::string payload(200, 'm');
+    // Sizes come from a table so the compiler cannot specialise the copy
+    // for a known range, as it could not for real messages.
+    static std::vector<size_t> sizes;
+    for (long m = static_cast<long>(sizes.size()); m < messages; ++m)
+        sizes.push_back(40 + (m * 37) % 161);
+    auto start = bench::clock::now();
+    for (long m = 0; m < messages; ++m) {
+        for (auto& store : stores)
+            store.push_back(std::string_view(payload.data(), sizes[m]));
+    }
+    const double inserts = static_cast<double>(stores.size()) * messages;
+    return inserts / (bench::elapsed_us(start, bench::clock::now()) / 1e6);
+}
+
+template <typename Store, typename Make>
+void run(const char* name, long rooms, long messages, Make&& make) {
+    const size_t before = rss_bytes();
+    std::vector<Store> stores;
+    stores.reserve(rooms);
+    for (long r = 0; r < rooms; ++r)
+        stores.push_back(make());
+
+    const double fill = pass(stores, messages);
+    const double steady = pass(stores, messages);
+    std::cout << std::setw(8) << name << std::fixed << std::setprecision(0) << std::setw(14) << fill
+              << std::setw(14) << steady << std::setw(12) << stores.front().size() << std::setw(12)
+              << std::setprecision(1) << (rss_bytes() - before) / (1024.0 * 1024.0) << std::endl;
+}
+
+// Run 'fn' in a child process and wait for it.
+template <typename Fn>
+void isolated(Fn&& fn) {
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        fn();
+        std::cout.flush();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const long rooms = bench::arg_or(argc, argv, "--rooms", 1000);
+    const long messages = bench::arg_or(argc, argv, "--messages", 20000);
+    const long arena_bytes = bench::arg_or(argc, argv, "--arena-bytes", Room::default_history_bytes);
+
+    std::cout << "rooms=" << rooms << " messages/room=" << messages << " arena_bytes=" << arena_bytes << std::endl;
+    std::cout << std::setw(8) << "store" << std::setw(14) << "fill ins/s" << std::setw(14) << "steady ins/s"
+              << std::setw(12) << "kept/room" << std::setw(12) << "RSS MiB" << std::endl;
+
+    isolated([&] { run<DequeHistory>("deque", rooms, messages, [] { return DequeHistory(); }); });
+    isolated([&] {
+        run<HistoryArena>("arena", rooms, messages, [&] { return HistoryArena(arena_bytes, Room::max_history); });
+    });
+    return EXIT_SUCCESS;
+}
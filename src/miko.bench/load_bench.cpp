@@ -0,0 +1,425 @@
+//
+// End-to-end load: open-loop room traffic over thousands of connections.
+//
+// Starts an in-process MikoServer on loopback with --threads worker threads
+// and opens --connections WebSocket connections to it. --rooms of them create
+// a room each with create-room, then every connection joins room i % rooms
+// with join-room, speaking as miko.cli does: binary control frames, and
+// compact room frames encrypted with AESHelper once joined. Room keys only
+// appear in the server's log, so the creators read them from the server.
+//
+// For --seconds the connections together send --rate room messages per
+// second of --size bytes, on a fixed schedule whether or not the server keeps
+// up. Each payload carries the time it was due, so a server falling behind
+// shows as latency rather than as a lower send rate. Every member records
+// the delay of each message it receives; the run reports messages sent and
+// delivered per second and the p50/p99/p999/max delivery latency. With
+// --relay 1 the server forwards encrypted frames and the members decrypt
+// them, as miko.cli does.
+//
+// --flood N adds N connections to the first room that send as fast as their
+// one write in flight allows. With --session-rate, --room-rate and their
+// --*-burst the server's rate limits apply; latency is then also reported
+// separately for the flooded room and for the others, whose latency the
+// limits should keep flat.
+//
+
+#include "BenchUtil.h"
+#include "ControlFrame.hpp"
+#include "MikoServer.hpp"
+#include "RoomFrame.hpp"
+#include "aes_encryption.h"
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket.hpp>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <iomanip>
+#include <thread>
+#include <vector>
+
+namespace net = boost::asio;
+namespace beast = boost::beast;
+namespace websocket = beast::websocket;
+using tcp = net::ip::tcp;
+
+namespace {
+
+struct RunState {
+    std::atomic<long> connected{0};
+    std::atomic<long> created{0};
+    std::atomic<long> joined{0};
+    std::atomic<long> failed{0};
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> expected{0}; // deliveries owed for the messages sent
+    std::atomic<uint64_t> delivered{0};
+    std::atomic<uint64_t> rejected{0}; // refused by a rate limit
+};
+
+uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(bench::clock::now().time_since_epoch()).count();
+}
+
+class LoadClient : public std::enable_shared_from_this<LoadClient> {
+public:
+    LoadClient(net::io_context& ioc, RunState& state, long index, size_t size)
+        : ws_(net::make_strand(ioc)), timer_(ws_.get_executor()), state_(state),
+          nick_("c" + std::to_string(index)), size_(size) {}
+
+    void start(const tcp::endpoint& endpoint) {
+        ws_.next_layer().async_connect(endpoint, [self = shared_from_this()](beast::error_code ec) {
+            if (ec) return self->fail();
+            self->ws_.set_option(websocket::stream_base::decorator([](websocket::request_type& req) {
+                req.set(beast::http::field::sec_websocket_protocol, control_subprotocol);
+            }));
+            self->ws_.async_handshake("127.0.0.1", "/", [self](beast::error_code ec) {
+                if (ec) return self->fail();
+                self->ws_.binary(true);
+                self->state_.connected.fetch_add(1);
+                self->do_read();
+            });
+        });
+    }
+
+    void create_room(std::string name) {
+        net::post(ws_.get_executor(), [self = shared_from_this(), name = std::move(name)] {
+            ControlWriter frame(ControlOp::CreateRoom, true);
+            self->write(frame.add(name).add("").take());
+        });
+    }
+
+    void join_room(long room, std::string room_id, std::string room_key, uint64_t members) {
+        net::post(ws_.get_executor(), [self = shared_from_this(), room, room_id = std::move(room_id),
+                                       room_key = std::move(room_key), members] {
+            self->room_ = room;
+            self->room_key_ = room_key;
+            self->members_ = members;
+            ControlWriter frame(ControlOp::JoinRoom, true);
+            self->write(frame.add(room_id).add(room_key).add(self->nick_).take());
+        });
+    }
+
+    // Send one message every 'interval', the first due at 'first', until 'end'.
+    void start_sending(bench::clock::time_point first, bench::clock::duration interval,
+                       bench::clock::time_point end) {
+        net::post(ws_.get_executor(), [self = shared_from_this(), first, interval, end] {
+            self->due_ = first;
+            self->interval_ = interval;
+            self->end_ = end;
+            self->schedule();
+        });
+    }
+
+    // Send back to back until 'end', one write in flight.
+    void start_flooding(bench::clock::time_point end) {
+        net::post(ws_.get_executor(), [self = shared_from_this(), end] {
+            self->flooding_ = true;
+            self->end_ = end;
+            self->due_ = bench::clock::now();
+            self->send_due();
+        });
+    }
+
+    void stop() {
+        net::post(ws_.get_executor(), [self = shared_from_this()] { self->timer_.cancel(); });
+    }
+
+    long room() const { return room_; }
+    bool flooding() const { return flooding_; }
+    const std::string& created_room() const { return created_room_; }
+    const std::vector<uint32_t>& latencies_us() const { return latencies_us_; }
+
+private:
+    void fail() { state_.failed.fetch_add(1); }
+
+    void do_read() {
+        ws_.async_read(buffer_, [self = shared_from_this()](beast::error_code ec, std::size_t) {
+            if (ec) return;
+            auto data = self->buffer_.data();
+            std::string_view message(static_cast<const char*>(data.data()), data.size());
+            try {
+                if (!self->ws_.got_binary())
+                    self->on_chat(message);
+                else if (is_chat_batch_frame(message))
+                    self->on_chat(unpack_chat_batch(message).lines);
+                else if (is_control_frame(message))
+                    self->on_control(message);
+                else
+                    self->on_relayed(message);
+            } catch (const std::exception&) {
+                self->fail();
+            }
+            self->buffer_.consume(data.size());
+            self->do_read();
+        });
+    }
+
+    void on_control(std::string_view frame) {
+        ControlReader reader(frame);
+        if (reader.op() == ControlOp::RoomCreated) {
+            created_room_ = std::string(reader.text());
+            state_.created.fetch_add(1);
+        } else if (reader.op() == ControlOp::JoinSuccess) {
+            reader.text(); // room id
+            reader.text(); // name
+            CipherMode cipher = CipherMode::AES_128_CBC;
+            parse_cipher(std::string(reader.text()), cipher);
+            reader.number(); // seq
+            reader.number(); // replay
+            room_handle_ = static_cast<uint32_t>(reader.number());
+            sender_id_ = static_cast<uint32_t>(reader.number());
+            aes_ = std::make_unique<AESHelper>(room_key_, cipher);
+            state_.joined.fetch_add(1);
+        } else if (reader.op() == ControlOp::RoomMessageFailure && reader.text() == "Rate limited") {
+            state_.rejected.fetch_add(1, std::memory_order_relaxed);
+            state_.expected.fetch_sub(members_, std::memory_order_relaxed);
+        } else {
+            fail();
+        }
+    }
+
+    // Decrypted messages arrive as "[nick]: text" lines, possibly coalesced.
+    void on_chat(std::string_view lines) {
+        while (!lines.empty()) {
+            const size_t end = lines.find('\n');
+            std::string_view line = lines.substr(0, end);
+            const size_t text = line.find("]: ");
+            if (text != std::string_view::npos)
+                on_delivered(line.substr(text + 3));
+            if (end == std::string_view::npos)
+                break;
+            lines.remove_prefix(end + 1);
+        }
+    }
+
+    // Relayed frames arrive back to back, still encrypted.
+    void on_relayed(std::string_view frames) {
+        size_t offset = 0;
+        while (offset < frames.size()) {
+            unpack_view(frames, offset); // room id
+            unpack_view(frames, offset); // nickname
+            aes_->decrypt(unpack_view(frames, offset), plaintext_);
+            on_delivered(plaintext_);
+        }
+    }
+
+    void on_delivered(std::string_view text) {
+        const uint64_t received = now_ns();
+        uint64_t due = 0;
+        for (char c : text.substr(0, text.find(' ')))
+            due = due * 10 + static_cast<uint64_t>(c - '0');
+        latencies_us_.push_back(static_cast<uint32_t>(received > due ? (received - due) / 1000 : 0));
+        state_.delivered.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void schedule() {
+        if (due_ >= end_)
+            return;
+        timer_.expires_at(due_);
+        timer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+            if (ec) return;
+            self->send_due();
+            self->schedule();
+        });
+    }
+
+    // The payload is the due time in steady-clock nanoseconds, padded to
+    // size_ bytes.
+    void send_due() {
+        const uint64_t due = std::chrono::duration_cast<std::chrono::nanoseconds>(due_.time_since_epoch()).count();
+        due_ += interval_;
+        text_ = std::to_string(due);
+        text_.push_back(' ');
+        if (text_.size() < size_)
+            text_.resize(size_, 'm');
+        aes_->encrypt(text_, ciphertext_);
+        std::string frame;
+        pack_compact_room_message(frame, room_handle_, sender_id_, ciphertext_);
+        state_.sent.fetch_add(1, std::memory_order_relaxed);
+        state_.expected.fetch_add(members_, std::memory_order_relaxed);
+        write(std::move(frame));
+    }
+
+    // One write in flight; later frames wait their turn.
+    void write(std::string frame) {
+        pending_.push_back(std::move(frame));
+        if (pending_.size() == 1)
+            write_front();
+    }
+
+    void write_front() {
+        ws_.async_write(net::buffer(pending_.front()), [self = shared_from_this()](beast::error_code ec, std::size_t) {
+            if (ec) return self->fail();
+            self->pending_.pop_front();
+            if (!self->pending_.empty())
+                self->write_front();
+            else if (self->flooding_ && bench::clock::now() < self->end_) {
+                self->due_ = bench::clock::now();
+                self->send_due();
+            }
+        });
+    }
+
+    websocket::stream<tcp::socket> ws_;
+    net::steady_timer timer_;
+    beast::flat_buffer buffer_;
+    RunState& state_;
+    std::string nick_;
+    size_t size_;
+    std::string created_room_;
+    std::string room_key_;
+    long room_ = 0;
+    bool flooding_ = false;
+    uint64_t members_ = 0;
+    uint32_t room_handle_ = 0;
+    uint32_t sender_id_ = 0;
+    std::unique_ptr<AESHelper> aes_;
+    bench::clock::time_point due_;
+    bench::clock::duration interval_{};
+    bench::clock::time_point end_;
+    std::string text_;
+    std::string ciphertext_;
+    std::string plaintext_;
+    std::deque<std::string> pending_;
+    std::vector<uint32_t> latencies_us_;
+};
+
+// Waits until 'count' reaches 'target' or connections fail; false on failure.
+bool wait_for(const std::atomic<long>& count, long target, const RunState& state, const char* phase) {
+    const auto deadline = bench::clock::now() + std::chrono::seconds(30);
+    while (count.load() < target) {
+        if (state.failed.load() > 0 || bench::clock::now() > deadline) {
+            std::cerr << phase << ": " << count.load() << " of " << target << " (" << state.failed.load()
+                      << " failed)" << std::endl;
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const long connections = bench::arg_or(argc, argv, "--connections", 2000);
+    const long rooms = std::clamp(bench::arg_or(argc, argv, "--rooms", 100), 1L, connections);
+    const long rate = std::max(bench::arg_or(argc, argv, "--rate", 5000), 1L);
+    const size_t size = static_cast<size_t>(bench::arg_or(argc, argv, "--size", 128));
+    const long seconds = bench::arg_or(argc, argv, "--seconds", 5);
+    const int threads = static_cast<int>(bench::arg_or(argc, argv, "--threads", 1));
+    const long client_threads = bench::arg_or(argc, argv, "--client-threads", 1);
+    const long flood = bench::arg_or(argc, argv, "--flood", 0);
+    ServerConfig config;
+    config.relay = bench::arg_or(argc, argv, "--relay", 0) != 0;
+    config.session_rate = bench::arg_or(argc, argv, "--session-rate", 0);
+    config.session_burst = bench::arg_or(argc, argv, "--session-burst", 0);
+    config.room_rate = bench::arg_or(argc, argv, "--room-rate", 0);
+    config.room_burst = bench::arg_or(argc, argv, "--room-burst", 0);
+
+    std::cout << "connections=" << connections << " rooms=" << rooms << " rate=" << rate << "/s size=" << size
+              << " seconds=" << seconds << " threads=" << threads << (config.relay ? " relay" : "") << std::endl;
+    if (flood > 0) {
+        std::cout << "flood=" << flood << " session-rate=" << config.session_rate << " room-rate=" << config.room_rate
+                  << std::endl;
+    }
+
+    net::io_context server_ioc{threads};
+    auto server = std::make_shared<MikoServer>(server_ioc, tcp::endpoint{net::ip::make_address("127.0.0.1"), 0},
+                                               config);
+    server->run();
+    std::vector<std::thread> server_threads;
+    for (int i = 0; i < threads; ++i)
+        server_threads.emplace_back([&server_ioc] { server_ioc.run(); });
+
+    net::io_context client_ioc;
+    auto work = net::make_work_guard(client_ioc);
+    std::vector<std::thread> client_pool;
+    for (long i = 0; i < client_threads; ++i)
+        client_pool.emplace_back([&client_ioc] { client_ioc.run(); });
+
+    RunState state;
+    std::vector<std::shared_ptr<LoadClient>> pool;
+    for (long i = 0; i < connections + flood; ++i)
+        pool.push_back(std::make_shared<LoadClient>(client_ioc, state, i, size));
+
+    bool ok = true;
+    bench::clock::time_point start, end;
+    {
+        bench::QuietStdout quiet; // the server logs every room and join
+        for (auto& client : pool)
+            client->start(server->local_endpoint());
+        ok = wait_for(state.connected, connections + flood, state, "connect");
+        for (long r = 0; ok && r < rooms; ++r)
+            pool[r]->create_room("load-" + std::to_string(r));
+        ok = ok && wait_for(state.created, rooms, state, "create-room");
+        // The flooders, after the others, join the first room.
+        for (long i = 0; ok && i < connections + flood; ++i) {
+            const long room = i < connections ? i % rooms : 0;
+            const std::string& room_id = pool[room]->created_room();
+            const uint64_t members = connections / rooms + (room < connections % rooms ? 1 : 0) +
+                                     (room == 0 ? flood : 0);
+            pool[i]->join_room(room, room_id, server->get_room(room_id)->get_key(), members);
+        }
+        ok = ok && wait_for(state.joined, connections + flood, state, "join-room");
+
+        if (ok) {
+            // Each connection sends every connections/rate seconds, staggered
+            // so the server sees an even stream.
+            const auto interval = std::chrono::duration_cast<bench::clock::duration>(
+                std::chrono::duration<double>(static_cast<double>(connections) / rate));
+            start = bench::clock::now() + std::chrono::milliseconds(10);
+            end = start + std::chrono::seconds(seconds);
+            for (long i = 0; i < connections; ++i)
+                pool[i]->start_sending(start + interval * i / connections, interval, end);
+            for (long i = connections; i < connections + flood; ++i)
+                pool[i]->start_flooding(end);
+            std::this_thread::sleep_until(end);
+            // Let the last messages arrive, up to a second.
+            const auto drain = bench::clock::now() + std::chrono::seconds(1);
+            while (state.delivered.load() < state.expected.load() && bench::clock::now() < drain)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            end = bench::clock::now();
+        }
+
+        for (auto& client : pool)
+            client->stop();
+        work.reset();
+        client_ioc.stop();
+        server_ioc.stop();
+        for (auto& t : client_pool) t.join();
+        for (auto& t : server_threads) t.join();
+    }
+    if (!ok)
+        return EXIT_FAILURE;
+
+    // Latency over the clients 'include' picks, flooders aside.
+    auto report = [&](const char* label, auto include) {
+        std::vector<uint32_t> latencies;
+        for (const auto& client : pool) {
+            if (!client->flooding() && include(*client))
+                latencies.insert(latencies.end(), client->latencies_us().begin(), client->latencies_us().end());
+        }
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) {
+            return latencies.empty() ? 0
+                                     : latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+        };
+        std::cout << label << "latency_us p50=" << percentile(0.50) << " p99=" << percentile(0.99)
+                  << " p999=" << percentile(0.999) << " max=" << (latencies.empty() ? 0 : latencies.back())
+                  << std::endl;
+    };
+
+    const double elapsed = bench::elapsed_us(start, end) / 1e6;
+    std::cout << std::fixed << std::setprecision(0);
+    std::cout << "sent=" << state.sent.load() << " (" << state.sent.load() / elapsed << "/s)"
+              << " delivered=" << state.delivered.load() << " of " << state.expected.load() << " ("
+              << state.delivered.load() / elapsed << "/s)" << std::endl;
+    report("", [](const LoadClient&) { return true; });
+    if (flood > 0) {
+        std::cout << "rate-limited=" << state.rejected.load() << std::endl;
+        report("flooded room ", [](const LoadClient& client) { return client.room() == 0; });
+        report("other rooms  ", [](const LoadClient& client) { return client.room() != 0; });
+    }
+    return state.failed.load() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,83 @@
+//
+// Caller-side cost of a log line: std::cout with std::endl against Logger.
+//
+// --threads threads each log --lines lines like the server's "[User Joined]"
+// line; every row reports the ns a line costs the calling thread, and the
+// worst single call. stdout is sent to --out (default /dev/null; a pipe or
+// a terminal is slower still), and the results go to stderr. "cout endl"
+// is the previous logging, serialized by a lock as join_room's was; "async"
+// returns once the line is queued, and includes waiting for the queue to
+// drain at the end; lines that find the queue full are dropped and counted.
+//
+
+#include "BenchUtil.h"
+#include "Logger.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+template <typename Fn>
+void row(const char* name, long threads, long lines, Fn&& log) {
+    std::atomic<uint64_t> worst_ns{0};
+    const uint64_t dropped_before = Logger::instance().dropped();
+    auto start = bench::clock::now();
+    std::vector<std::thread> pool;
+    for (long t = 0; t < threads; ++t) {
+        pool.emplace_back([&, t] {
+            uint64_t worst = 0;
+            for (long i = 0; i < lines; ++i) {
+                auto before = bench::clock::now();
+                log(t, i);
+                worst = std::max<uint64_t>(worst, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                      bench::clock::now() - before).count());
+            }
+            uint64_t seen = worst_ns.load();
+            while (worst > seen && !worst_ns.compare_exchange_weak(seen, worst)) {
+            }
+        });
+    }
+    for (auto& thread : pool)
+        thread.join();
+    Logger::instance().flush();
+    const uint64_t dropped = Logger::instance().dropped() - dropped_before;
+    const double ns = bench::elapsed_us(start, bench::clock::now()) * 1000.0 / (threads * lines);
+    std::cerr << std::setw(12) << name << std::setw(10) << threads << std::fixed << std::setprecision(0)
+              << std::setw(12) << ns << std::setw(14) << worst_ns.load() << std::setw(10) << dropped << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const long lines = bench::arg_or(argc, argv, "--lines", 200000);
+    const long max_threads = bench::arg_or(argc, argv, "--threads", 4);
+    std::string out = "/dev/null";
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string(argv[i]) == "--out")
+            out = argv[i + 1];
+    }
+    if (!std::freopen(out.c_str(), "w", stdout)) {
+        std::cerr << "Cannot open " << out << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cerr << "lines/thread=" << lines << " out=" << out << std::endl;
+    std::cerr << std::setw(12) << "row" << std::setw(10) << "threads" << std::setw(12) << "ns/line"
+              << std::setw(14) << "worst_ns" << std::setw(10) << "dropped" << std::endl;
+    std::mutex lock;
+    for (long threads = 1; threads <= max_threads; threads *= 2) {
+        row("cout endl", threads, lines, [&](long t, long i) {
+            std::lock_guard<std::mutex> guard(lock);
+            std::cout << "[User Joined] Room: Rz7O6TEj Nickname: user" << t << "-" << i << std::endl;
+        });
+        row("async", threads, lines, [](long t, long i) {
+            LogLine(LogLevel::Info) << "[User Joined] Room: Rz7O6TEj Nickname: user" << t << "-" << i;
+        });
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,117 @@
+//
+// Registry contention: concurrent joins and messages across many rooms.
+//
+// Each of --threads threads owns --sessions sessions spread over --rooms
+// rooms and runs --ops operations: one in ten moves a random session to a
+// random room, the rest send a message to a session's room. "global" runs
+// the same work with every server call under one outer mutex, the way the
+// registry used to serialize it; "sharded" calls the server directly.
+//
+
+#include "BenchUtil.h"
+#include "MikoServer.hpp"
+#include "Session.hpp"
+#include <boost/asio.hpp>
+#include <iomanip>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace net = boost::asio;
+using tcp = net::ip::tcp;
+
+namespace {
+
+struct Fixture {
+    net::io_context ioc;
+    std::shared_ptr<MikoServer> server;
+    std::vector<std::pair<std::string, std::string>> rooms; // id, key
+
+    explicit Fixture(long room_count) {
+        ServerConfig config;
+        // Sessions are never started, so their queues only grow; drop rather
+        // than let the overflow policy close them part way through.
+        config.send_overflow = OverflowPolicy::Drop;
+        server = std::make_shared<MikoServer>(ioc, tcp::endpoint{net::ip::make_address("127.0.0.1"), 0}, config);
+        bench::QuietStdout quiet;
+        for (long r = 0; r < room_count; ++r) {
+            std::string id = server->create_room();
+            rooms.emplace_back(id, server->get_room(id)->get_key());
+        }
+    }
+};
+
+// Operations per second over all threads.
+double run(long threads, long sessions, long rooms, long ops, bool global) {
+    Fixture fx(rooms);
+    std::mutex global_mutex;
+    std::vector<std::vector<std::shared_ptr<Session>>> owned(threads);
+    {
+        bench::QuietStdout quiet;
+        for (long t = 0; t < threads; ++t) {
+            for (long s = 0; s < sessions; ++s) {
+                auto session = std::make_shared<Session>(Session::socket_type(net::make_strand(fx.ioc)), fx.server);
+                fx.server->add_session(session);
+                const auto& room = fx.rooms[(t * sessions + s) % rooms];
+                fx.server->join_room(room.first, room.second, session, "bench");
+                owned[t].push_back(session);
+            }
+        }
+    }
+
+    const std::string payload(64, 'x');
+    auto worker = [&](long t) {
+        std::minstd_rand rng(static_cast<unsigned>(t + 1));
+        auto& mine = owned[t];
+        for (long i = 0; i < ops; ++i) {
+            auto& session = mine[rng() % mine.size()];
+            std::unique_lock<std::mutex> lock(global_mutex, std::defer_lock);
+            if (global) lock.lock();
+            if (i % 10 == 0) {
+                const auto& room = fx.rooms[rng() % fx.rooms.size()];
+                fx.server->join_room(room.first, room.second, session, "bench");
+            } else {
+                fx.server->send_room_message(session->get_room(), "bench", payload);
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    bench::QuietStdout quiet;
+    auto start = bench::clock::now();
+    for (long t = 0; t < threads; ++t) {
+        pool.emplace_back(worker, t);
+    }
+    for (auto& thread : pool) {
+        thread.join();
+    }
+    const double seconds = bench::elapsed_us(start, bench::clock::now()) / 1e6;
+    for (auto& sessions_of : owned) {
+        for (auto& session : sessions_of) {
+            fx.server->remove_session(session);
+        }
+    }
+    return static_cast<double>(threads) * ops / seconds;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const long sessions = bench::arg_or(argc, argv, "--sessions", 64);
+    const long rooms = bench::arg_or(argc, argv, "--rooms", 1000);
+    const long ops = bench::arg_or(argc, argv, "--ops", 50000);
+    const long max_threads = bench::arg_or(argc, argv, "--threads", 16);
+
+    std::cout << "sessions/thread=" << sessions << " rooms=" << rooms << " ops/thread=" << ops
+              << " cores=" << std::thread::hardware_concurrency() << std::endl;
+    std::cout << std::setw(8) << "threads" << std::setw(14) << "global ops/s" << std::setw(15) << "sharded ops/s"
+              << std::endl;
+    for (long threads = 1; threads <= max_threads; threads *= 2) {
+        const double global = run(threads, sessions, rooms, ops, true);
+        const double sharded = run(threads, sessions, rooms, ops, false);
+        std::cout << std::setw(8) << threads << std::fixed << std::setprecision(0) << std::setw(14) << global
+                  << std::setw(15) << sharded << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
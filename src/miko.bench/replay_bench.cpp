@@ -0,0 +1,192 @@
+//
+// Allocations per message on the server receive path.
+//
+// Replays a recording of binary room-message frames through
+// Session::process_binary_room_message and counts heap allocations. The
+// recording is a file of frames, each prefixed with its 4-byte big-endian
+// length; --record FILE writes a synthetic one (--frames, --payload) and
+// --replay FILE reads it back. Without either, a synthetic recording is
+// generated in memory.
+//
+// Rows:
+//   parse    unpack_room_message alone
+//   relay    full relay-mode path (includes the one shared broadcast buffer
+//            and the room history entry)
+//   decrypt  full decrypting path (includes the broadcast line and history)
+//   compact-relay, compact-decrypt
+//            the same frames in the compact form, naming room and sender
+//            by the numbers join-success returned
+//
+// The session is never connected, so fan-out writes fail once and are then
+// skipped; only receive-side work is measured.
+//
+
+#include "AllocCounter.h"
+#include "BenchUtil.h"
+#include "MikoServer.hpp"
+#include "RoomFrame.hpp"
+#include "Session.hpp"
+#include "aes_encryption.h"
+#include <boost/asio.hpp>
+#include <arpa/inet.h>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+
+namespace net = boost::asio;
+using tcp = net::ip::tcp;
+
+static void pack_string(std::string& buffer, std::string_view s) {
+    uint32_t len = htonl(static_cast<uint32_t>(s.size()));
+    buffer.append(reinterpret_cast<const char*>(&len), 4);
+    buffer.append(s);
+}
+
+static std::vector<std::string> synthesize(long frames, long payload, const std::string& room_id,
+                                           const std::string& key, const std::string& nick) {
+    AESHelper aes(key);
+    std::vector<std::string> recording;
+    for (long i = 0; i < frames; ++i) {
+        std::string frame;
+        pack_string(frame, room_id);
+        pack_string(frame, nick);
+        pack_string(frame, aes.encrypt(std::string(payload, static_cast<char>('a' + i % 26))));
+        recording.push_back(std::move(frame));
+    }
+    return recording;
+}
+
+static void write_recording(const std::string& path, const std::vector<std::string>& recording) {
+    std::ofstream out(path, std::ios::binary);
+    for (const auto& frame : recording) {
+        std::string record;
+        pack_string(record, frame);
+        out.write(record.data(), record.size());
+    }
+}
+
+static std::vector<std::string> read_recording(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::vector<std::string> recording;
+    uint32_t len = 0;
+    while (in.read(reinterpret_cast<char*>(&len), 4)) {
+        std::string frame(ntohl(len), '\0');
+        if (!in.read(&frame[0], frame.size()))
+            break;
+        recording.push_back(std::move(frame));
+    }
+    return recording;
+}
+
+static std::string arg_string(int argc, char* argv[], const std::string& name) {
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (name == argv[i]) return argv[i + 1];
+    }
+    return "";
+}
+
+// The room id, key and nickname are fixed so that recordings replay against
+// a fresh server.
+static const std::string kRoomKey = "0123456789abcdef";
+static const std::string kNick = "replayer";
+
+struct Fixture {
+    net::io_context ioc;
+    std::shared_ptr<MikoServer> server;
+    std::shared_ptr<Session> session;
+    std::string room_id;
+
+    explicit Fixture(bool relay) {
+        ServerConfig config;
+        config.relay = relay;
+        server = std::make_shared<MikoServer>(ioc, tcp::endpoint{net::ip::make_address("127.0.0.1"), 0}, config);
+        bench::QuietStdout quiet;
+        room_id = server->create_room("replay");
+        session = std::make_shared<Session>(Session::socket_type(net::make_strand(ioc)), server);
+        server->add_session(session);
+        // Through the command, so the session hands out a room handle.
+        session->process_command("/CMD join-room " + room_id + " " + server->get_room(room_id)->get_key() + " " +
+                                 kNick);
+    }
+};
+
+// Rewrite a recording so its frames carry this fixture's room id, and
+// re-encrypt with its key (recorded frames use kRoomKey).
+static std::vector<std::string> retarget(const std::vector<std::string>& recording, Fixture& fx, bool compact) {
+    AESHelper recorded(kRoomKey);
+    AESHelper live(fx.server->get_room(fx.room_id)->get_key());
+    std::vector<std::string> frames;
+    for (const auto& frame : recording) {
+        RoomMessageView rm = unpack_room_message(frame);
+        const std::string payload = live.encrypt(recorded.decrypt(std::string(rm.encrypted_payload)));
+        std::string out;
+        if (compact) {
+            // The fixture's session joined one room, so its handle is 0.
+            pack_compact_room_message(out, 0, fx.session->sender_id(), payload);
+        } else {
+            pack_string(out, fx.room_id);
+            pack_string(out, kNick);
+            pack_string(out, payload);
+        }
+        frames.push_back(std::move(out));
+    }
+    return frames;
+}
+
+template <typename Fn>
+static void report(const char* name, const std::vector<std::string>& frames, long passes, Fn&& fn) {
+    for (const auto& frame : frames) fn(frame); // warm-up
+    const uint64_t before = bench::allocations.load();
+    auto start = bench::clock::now();
+    for (long p = 0; p < passes; ++p)
+        for (const auto& frame : frames) fn(frame);
+    auto end = bench::clock::now();
+    const double messages = static_cast<double>(frames.size()) * passes;
+    std::cout << std::setw(16) << name << std::setw(16) << std::fixed << std::setprecision(3)
+              << (bench::allocations.load() - before) / messages << std::setw(14) << std::setprecision(0)
+              << bench::elapsed_us(start, end) * 1000 / messages << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    const long frame_count = bench::arg_or(argc, argv, "--frames", 10000);
+    const long payload = bench::arg_or(argc, argv, "--payload", 120);
+    const long passes = bench::arg_or(argc, argv, "--passes", 5);
+    const std::string record_path = arg_string(argc, argv, "--record");
+    const std::string replay_path = arg_string(argc, argv, "--replay");
+
+    std::vector<std::string> recording;
+    if (!replay_path.empty()) {
+        recording = read_recording(replay_path);
+    } else {
+        recording = synthesize(frame_count, payload, "recorded", kRoomKey, kNick);
+        if (!record_path.empty()) {
+            write_recording(record_path, recording);
+            std::cout << "wrote " << recording.size() << " frames to " << record_path << std::endl;
+            return EXIT_SUCCESS;
+        }
+    }
+
+    std::cout << "frames=" << recording.size() << " passes=" << passes << std::endl;
+    std::cout << std::setw(16) << "path" << std::setw(16) << "allocs/msg" << std::setw(14) << "ns/msg" << std::endl;
+
+    size_t checksum = 0;
+    report("parse", recording, passes, [&](const std::string& frame) {
+        RoomMessageView rm = unpack_room_message(frame);
+        checksum += rm.encrypted_payload.size();
+    });
+
+    for (bool compact : {false, true}) {
+        for (bool relay : {true, false}) {
+            Fixture fx(relay);
+            std::vector<std::string> frames = retarget(recording, fx, compact);
+            // Let the first (failing) write mark the unconnected session closed.
+            fx.session->send("/CMD warmup");
+            fx.ioc.poll();
+            const char* name = compact ? (relay ? "compact-relay" : "compact-decrypt") : (relay ? "relay" : "decrypt");
+            report(name, frames, passes, [&](const std::string& frame) {
+                fx.session->process_binary_message(frame);
+            });
+        }
+    }
+    return checksum ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,237 @@
+//
+// Many-room throughput over loopback WebSockets.
+//
+// Starts an in-process MikoServer, then --clients connections spread over
+// --rooms rooms. Each client sends --messages room messages, closed-loop: the
+// next one goes out when its own echo comes back. The run is repeated for
+// each server thread count in --threads (e.g. "1,2,4,8") and reports
+// delivered messages per second. --relay 1 runs the server in relay mode,
+// where it forwards the encrypted frames instead of decrypting them.
+//
+
+#include "BenchUtil.h"
+#include "MikoServer.hpp"
+#include "aes_encryption.h"
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket.hpp>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace net = boost::asio;
+namespace beast = boost::beast;
+namespace websocket = beast::websocket;
+using tcp = net::ip::tcp;
+
+static void pack_string(std::string& buffer, const std::string& s) {
+    uint32_t len = htonl(static_cast<uint32_t>(s.size()));
+    buffer.append(reinterpret_cast<const char*>(&len), 4);
+    buffer.append(s);
+}
+
+struct RunState {
+    std::atomic<uint64_t> delivered{0};
+    std::atomic<long> finished{0};
+    std::atomic<long> failed{0};
+};
+
+class BenchClient : public std::enable_shared_from_this<BenchClient> {
+public:
+    BenchClient(net::io_context& ioc, RunState& state, std::string room_id, std::string room_key,
+                std::string nick, long messages)
+        : ws_(net::make_strand(ioc)), state_(state), room_id_(std::move(room_id)),
+          room_key_(std::move(room_key)), nick_(std::move(nick)), echo_prefix_("[" + nick_ + "]: "),
+          messages_(messages) {}
+
+    void start(const tcp::endpoint& endpoint) {
+        ws_.next_layer().async_connect(endpoint, [self = shared_from_this()](beast::error_code ec) {
+            if (ec) return self->fail();
+            self->ws_.async_handshake("127.0.0.1", "/", [self](beast::error_code ec) {
+                if (ec) return self->fail();
+                self->out_ = "/CMD join-room " + self->room_id_ + " " + self->room_key_ + " " + self->nick_;
+                self->ws_.text(true);
+                self->ws_.async_write(net::buffer(self->out_), [self](beast::error_code ec, std::size_t) {
+                    if (ec) return self->fail();
+                    self->do_read();
+                });
+            });
+        });
+    }
+
+private:
+    void fail() { state_.failed.fetch_add(1); }
+
+    void do_read() {
+        ws_.async_read(buffer_, [self = shared_from_this()](beast::error_code ec, std::size_t) {
+            if (ec) return;
+            if (self->ws_.got_binary())
+                self->on_relayed(beast::buffers_to_string(self->buffer_.data()));
+            else
+                self->on_message(beast::buffers_to_string(self->buffer_.data()));
+            self->buffer_.consume(self->buffer_.size());
+            self->do_read();
+        });
+    }
+
+    void on_message(const std::string& msg) {
+        if (msg.rfind("/CMD", 0) == 0) {
+            if (msg.rfind("/CMD join-success", 0) == 0)
+                send_next();
+            return;
+        }
+        // Chat lines may arrive coalesced, one per line.
+        std::istringstream lines(msg);
+        std::string line;
+        while (std::getline(lines, line)) {
+            on_delivered(line.compare(0, echo_prefix_.size(), echo_prefix_) == 0);
+        }
+    }
+
+    // Relayed frames (room id, nickname, payload) arrive back to back.
+    void on_relayed(const std::string& frames) {
+        size_t offset = 0;
+        while (offset + 4 <= frames.size()) {
+            std::string fields[3];
+            for (auto& field : fields) {
+                uint32_t len = 0;
+                std::memcpy(&len, frames.data() + offset, 4);
+                len = ntohl(len);
+                field = frames.substr(offset + 4, len);
+                offset += 4 + len;
+            }
+            on_delivered(fields[1] == nick_);
+        }
+    }
+
+    void on_delivered(bool own_echo) {
+        state_.delivered.fetch_add(1, std::memory_order_relaxed);
+        if (!own_echo)
+            return;
+        if (sent_ < messages_) {
+            send_next();
+        } else {
+            state_.finished.fetch_add(1);
+        }
+    }
+
+    void send_next() {
+        // The echo can overtake our own write completion; never overlap writes.
+        if (writing_) {
+            send_pending_ = true;
+            return;
+        }
+        writing_ = true;
+        ++sent_;
+        AESHelper aes(room_key_);
+        out_.clear();
+        pack_string(out_, room_id_);
+        pack_string(out_, nick_);
+        pack_string(out_, aes.encrypt(std::string(64, 'm')));
+        ws_.binary(true);
+        ws_.async_write(net::buffer(out_), [self = shared_from_this()](beast::error_code ec, std::size_t) {
+            if (ec) return self->fail();
+            self->writing_ = false;
+            if (self->send_pending_) {
+                self->send_pending_ = false;
+                self->send_next();
+            }
+        });
+    }
+
+    websocket::stream<tcp::socket> ws_;
+    beast::flat_buffer buffer_;
+    RunState& state_;
+    std::string room_id_;
+    std::string room_key_;
+    std::string nick_;
+    std::string echo_prefix_;
+    std::string out_;
+    long messages_;
+    long sent_ = 0;
+    bool writing_ = false;
+    bool send_pending_ = false;
+};
+
+static std::vector<int> parse_threads(int argc, char* argv[]) {
+    std::string spec = "1";
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string(argv[i]) == "--threads") spec = argv[i + 1];
+    }
+    std::vector<int> counts;
+    std::istringstream iss(spec);
+    std::string item;
+    while (std::getline(iss, item, ',')) counts.push_back(std::stoi(item));
+    return counts;
+}
+
+int main(int argc, char* argv[]) {
+    const long rooms = bench::arg_or(argc, argv, "--rooms", 64);
+    const long clients = bench::arg_or(argc, argv, "--clients", 512);
+    const long messages = bench::arg_or(argc, argv, "--messages", 200);
+    const long client_threads = bench::arg_or(argc, argv, "--client-threads", 1);
+    ServerConfig config;
+    config.relay = bench::arg_or(argc, argv, "--relay", 0) != 0;
+
+    std::cout << "rooms=" << rooms << " clients=" << clients << " messages/client=" << messages
+              << (config.relay ? " relay" : "") << std::endl;
+    std::cout << std::setw(8) << "threads" << std::setw(14) << "delivered" << std::setw(14) << "seconds"
+              << std::setw(16) << "delivered/s" << std::endl;
+
+    for (int threads : parse_threads(argc, argv)) {
+        net::io_context server_ioc{threads};
+        auto server = std::make_shared<MikoServer>(server_ioc, tcp::endpoint{net::ip::make_address("127.0.0.1"), 0},
+                                                   config);
+        std::vector<std::pair<std::string, std::string>> room_keys;
+        {
+            bench::QuietStdout quiet;
+            for (long i = 0; i < rooms; ++i) {
+                std::string id = server->create_room();
+                room_keys.emplace_back(id, server->get_room(id)->get_key());
+            }
+        }
+        server->run();
+        std::vector<std::thread> server_threads;
+        for (int i = 0; i < threads; ++i)
+            server_threads.emplace_back([&server_ioc] { server_ioc.run(); });
+
+        net::io_context client_ioc;
+        RunState state;
+        std::vector<std::shared_ptr<BenchClient>> pool;
+        for (long i = 0; i < clients; ++i) {
+            const auto& room = room_keys[i % rooms];
+            pool.push_back(std::make_shared<BenchClient>(client_ioc, state, room.first, room.second,
+                                                         "c" + std::to_string(i), messages));
+        }
+
+        bench::clock::time_point start, end;
+        {
+            bench::QuietStdout quiet;
+            start = bench::clock::now();
+            for (auto& client : pool)
+                client->start(server->local_endpoint());
+            std::vector<std::thread> client_pool;
+            for (long i = 0; i < client_threads; ++i)
+                client_pool.emplace_back([&client_ioc] { client_ioc.run(); });
+            while (state.finished.load() + state.failed.load() < clients)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            end = bench::clock::now();
+
+            client_ioc.stop();
+            server_ioc.stop();
+            for (auto& t : client_pool) t.join();
+            for (auto& t : server_threads) t.join();
+        }
+
+        const double seconds = bench::elapsed_us(start, end) / 1e6;
+        const uint64_t delivered = state.delivered.load();
+        std::cout << std::setw(8) << threads << std::setw(14) << delivered << std::setw(14) << std::fixed
+                  << std::setprecision(3) << seconds << std::setw(16) << std::setprecision(0)
+                  << delivered / seconds << (state.failed ? "  (connection failures)" : "") << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
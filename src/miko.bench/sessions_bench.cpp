@@ -0,0 +1,162 @@
+//
+// Allocations per connection and per message on the session paths.
+//
+// churn  --cycles connections, --inflight at a time, each of which connects,
+//        completes the handshake, joins a room, reads the reply and closes,
+//        as in a reconnect storm.
+// echo   one member of a relay room sends --messages frames one at a time
+//        and waits for each to come back, so every message is one read and
+//        one write on the server.
+//
+// Both run with the session pool off (--session-pool 0) and on. Server and
+// clients share one thread and the process-wide allocation count, so the
+// difference between the rows is the server's.
+//
+
+#include "AllocCounter.h"
+#include "BenchUtil.h"
+#include "MikoServer.hpp"
+#include "RoomFrame.hpp"
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket.hpp>
+#include <iomanip>
+#include <thread>
+
+namespace net = boost::asio;
+namespace beast = boost::beast;
+namespace websocket = beast::websocket;
+using tcp = net::ip::tcp;
+
+struct Churn {
+    net::io_context& ioc;
+    tcp::endpoint endpoint;
+    std::string join;
+    long remaining;
+    long completed = 0;
+};
+
+// Connects, joins, reads the reply and closes, then starts the next cycle.
+class ChurnClient : public std::enable_shared_from_this<ChurnClient> {
+public:
+    explicit ChurnClient(Churn& churn) : ws_(churn.ioc), churn_(churn) {}
+
+    static void next(Churn& churn) {
+        if (churn.remaining == 0)
+            return;
+        --churn.remaining;
+        std::make_shared<ChurnClient>(churn)->start();
+    }
+
+    void start() {
+        ws_.next_layer().async_connect(churn_.endpoint, [self = shared_from_this()](beast::error_code ec) {
+            if (ec) return next(self->churn_);
+            self->ws_.async_handshake("127.0.0.1", "/", [self](beast::error_code ec) {
+                if (ec) return next(self->churn_);
+                self->ws_.text(true);
+                self->ws_.async_write(net::buffer(self->churn_.join), [self](beast::error_code ec, std::size_t) {
+                    if (ec) return next(self->churn_);
+                    self->ws_.async_read(self->buffer_, [self](beast::error_code ec, std::size_t) {
+                        if (ec) return next(self->churn_);
+                        self->ws_.async_close(websocket::close_code::normal, [self](beast::error_code) {
+                            ++self->churn_.completed;
+                            next(self->churn_);
+                        });
+                    });
+                });
+            });
+        });
+    }
+
+private:
+    websocket::stream<net::basic_stream_socket<tcp, net::io_context::executor_type>> ws_;
+    beast::flat_buffer buffer_;
+    Churn& churn_;
+};
+
+struct Row {
+    double churn_allocs = 0;
+    double churn_us = 0;
+    double echo_allocs = 0;
+    double echo_us = 0;
+};
+
+static Row run(size_t pool, long cycles, long inflight, long messages) {
+    net::io_context ioc(1);
+    ServerConfig config;
+    config.relay = true;
+    config.session_pool = pool;
+    auto server = std::make_shared<MikoServer>(ioc, tcp::endpoint{net::ip::make_address("127.0.0.1"), 0}, config);
+    Row row;
+    bench::QuietStdout quiet;
+    const std::string room_id = server->create_room("sessions");
+    const std::string join = "/CMD join-room " + room_id + " " + server->get_room(room_id)->get_key() + " m";
+    server->run();
+
+    // Churn, after a first round that fills the pool.
+    for (int round = 0; round < 2; ++round) {
+        Churn churn{ioc, server->local_endpoint(), join, cycles};
+        const uint64_t allocs_before = bench::allocations.load();
+        const auto start = bench::clock::now();
+        for (long i = 0; i < inflight; ++i)
+            ChurnClient::next(churn);
+        while (churn.completed < cycles && ioc.run_one()) {
+        }
+        // Let the server notice the last closes.
+        ioc.restart();
+        ioc.poll();
+        row.churn_us = bench::elapsed_us(start, bench::clock::now()) / churn.completed;
+        row.churn_allocs = static_cast<double>(bench::allocations.load() - allocs_before) / churn.completed;
+    }
+
+    // Echo: one member, so every frame the server relays comes back to it.
+    websocket::stream<net::basic_stream_socket<tcp, net::io_context::executor_type>> ws(ioc);
+    ws.next_layer().connect(server->local_endpoint());
+    std::thread io([&ioc] {
+        auto guard = net::make_work_guard(ioc);
+        ioc.run();
+    });
+    ws.handshake("127.0.0.1", "/");
+    ws.text(true);
+    ws.write(net::buffer(join));
+    beast::flat_buffer buffer;
+    ws.read(buffer);
+    buffer.clear();
+    std::string frame;
+    pack_view(frame, room_id);
+    pack_view(frame, "m");
+    pack_view(frame, std::string(64, 'x'));
+    ws.binary(true);
+    for (int round = 0; round < 2; ++round) {
+        const uint64_t allocs_before = bench::allocations.load();
+        const auto start = bench::clock::now();
+        for (long i = 0; i < messages; ++i) {
+            ws.write(net::buffer(frame));
+            ws.read(buffer);
+            buffer.clear();
+        }
+        row.echo_us = bench::elapsed_us(start, bench::clock::now()) / messages;
+        row.echo_allocs = static_cast<double>(bench::allocations.load() - allocs_before) / messages;
+    }
+    ioc.stop();
+    io.join();
+    return row;
+}
+
+int main(int argc, char* argv[]) {
+    const long cycles = bench::arg_or(argc, argv, "--cycles", 2000);
+    const long inflight = bench::arg_or(argc, argv, "--inflight", 16);
+    const long messages = bench::arg_or(argc, argv, "--messages", 20000);
+    const long pool = bench::arg_or(argc, argv, "--session-pool", 1024);
+
+    std::cout << "cycles=" << cycles << " inflight=" << inflight << " messages=" << messages << std::endl;
+    std::cout << std::setw(8) << "pool" << std::setw(16) << "allocs/conn" << std::setw(12) << "us/conn"
+              << std::setw(14) << "allocs/echo" << std::setw(12) << "us/echo" << std::endl;
+    for (long size : {0L, pool}) {
+        const Row row = run(static_cast<size_t>(size), cycles, inflight, messages);
+        std::cout << std::setw(8) << size << std::fixed << std::setprecision(2) << std::setw(16) << row.churn_allocs
+                  << std::setw(12) << row.churn_us << std::setw(14) << row.echo_allocs << std::setw(12)
+                  << row.echo_us << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
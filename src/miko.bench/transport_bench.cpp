@@ -0,0 +1,251 @@
+//
+// Syscalls and CPU per delivered message on the server's I/O thread.
+//
+// The server runs on one thread of its own and the loopback clients on
+// another. --connections clients join --rooms rooms and --idle more connect
+// and then stay silent, as most of a chat server's connections do. The bench
+// sends --bursts rounds of one message to every room and waits until every
+// member has received them all. Syscalls (the raw_syscalls:sys_enter
+// tracepoint), CPU time and context switches are counted for the server
+// thread alone and divided by the number of deliveries.
+//
+// Asio picks its backend at compile time, so comparing epoll with io_uring
+// means running this from two builds, one with -DMIKO_IO_URING=ON.
+//
+
+#include "BenchUtil.h"
+#include "MikoServer.hpp"
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket.hpp>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <thread>
+#include <vector>
+
+namespace net = boost::asio;
+namespace beast = boost::beast;
+namespace websocket = beast::websocket;
+using tcp = net::ip::tcp;
+
+struct RunState {
+    std::atomic<long> connected{0};
+    std::atomic<long> joined{0};
+    std::atomic<uint64_t> delivered{0};
+};
+
+// A member reads and counts room lines; with an empty join it connects and
+// then only waits, like an idle client.
+class Client : public std::enable_shared_from_this<Client> {
+public:
+    Client(net::io_context& ioc, RunState& state, std::string join)
+        : ws_(ioc), state_(state), join_(std::move(join)) {}
+
+    void start(const tcp::endpoint& endpoint) {
+        ws_.next_layer().async_connect(endpoint, [self = shared_from_this()](beast::error_code ec) {
+            if (ec) return;
+            self->ws_.async_handshake("127.0.0.1", "/", [self](beast::error_code ec) {
+                if (ec) return;
+                self->state_.connected.fetch_add(1);
+                self->ws_.text(true);
+                if (self->join_.empty()) {
+                    self->do_read();
+                    return;
+                }
+                self->ws_.async_write(net::buffer(self->join_), [self](beast::error_code ec, std::size_t) {
+                    if (!ec) self->do_read();
+                });
+            });
+        });
+    }
+
+private:
+    void do_read() {
+        ws_.async_read(buffer_, [self = shared_from_this()](beast::error_code ec, std::size_t) {
+            if (ec) return;
+            self->on_message();
+            self->buffer_.consume(self->buffer_.size());
+            self->do_read();
+        });
+    }
+
+    void on_message() {
+        auto data = buffer_.data();
+        const char* p = static_cast<const char*>(data.data());
+        const size_t n = data.size();
+        if (n >= 4 && std::memcmp(p, "/CMD", 4) == 0) {
+            state_.joined.fetch_add(1);
+            return;
+        }
+        // Coalesced chat lines are newline-separated.
+        uint64_t lines = 1;
+        for (const char* q = p; (q = static_cast<const char*>(std::memchr(q, '\n', p + n - q))); ++q)
+            ++lines;
+        state_.delivered.fetch_add(lines, std::memory_order_relaxed);
+    }
+
+    websocket::stream<net::basic_stream_socket<tcp, net::io_context::executor_type>> ws_;
+    beast::flat_buffer buffer_;
+    RunState& state_;
+    std::string join_;
+};
+
+// A perf counter on one thread, or -1 where the kernel refuses it
+// (perf_event_paranoid, no tracefs, a container).
+static int open_counter(uint32_t type, uint64_t config, pid_t tid) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0));
+}
+
+static int open_syscall_counter(pid_t tid) {
+    for (const char* path : {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                             "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"}) {
+        std::ifstream in(path);
+        uint64_t id = 0;
+        if (in >> id)
+            return open_counter(PERF_TYPE_TRACEPOINT, id, tid);
+    }
+    return -1;
+}
+
+static uint64_t read_counter(int fd) {
+    uint64_t value = 0;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+        return 0;
+    return value;
+}
+
+static double thread_cpu_seconds(std::thread& thread) {
+    clockid_t clock;
+    timespec ts{};
+    if (pthread_getcpuclockid(thread.native_handle(), &clock) != 0 || clock_gettime(clock, &ts) != 0)
+        return 0;
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void wait_for(const std::atomic<uint64_t>& value, uint64_t target) {
+    while (value.load() < target)
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+}
+
+static void wait_for(const std::atomic<long>& value, long target) {
+    while (value.load() < target)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+int main(int argc, char* argv[]) {
+    const long connections = bench::arg_or(argc, argv, "--connections", 2000);
+    const long idle = bench::arg_or(argc, argv, "--idle", 2000);
+    const long room_count = bench::arg_or(argc, argv, "--rooms", 20);
+    const long bursts = bench::arg_or(argc, argv, "--bursts", 50);
+    const long size = bench::arg_or(argc, argv, "--size", 64);
+
+    std::cout << "backend=" << MikoServer::io_backend() << " connections=" << connections << " idle=" << idle
+              << " rooms=" << room_count << " bursts=" << bursts << " size=" << size << std::endl;
+
+    net::io_context server_ioc(1);
+    net::io_context client_ioc(1);
+    ServerConfig config;
+    config.send_queue_high_water = 64 * 1024 * 1024;
+    auto server = std::make_shared<MikoServer>(server_ioc, tcp::endpoint{net::ip::make_address("127.0.0.1"), 0},
+                                               config);
+    RunState state;
+    std::vector<std::string> rooms;
+    std::vector<std::shared_ptr<Client>> clients;
+    std::atomic<pid_t> server_tid{0};
+    std::thread server_thread;
+    std::thread client_thread;
+    {
+        bench::QuietStdout quiet;
+        for (long r = 0; r < room_count; ++r)
+            rooms.push_back(server->create_room("transport-" + std::to_string(r)));
+        server->run();
+        for (long i = 0; i < connections + idle; ++i) {
+            std::string join;
+            if (i < connections) {
+                const std::string& room_id = rooms[i % room_count];
+                join = "/CMD join-room " + room_id + " " + server->get_room(room_id)->get_key() + " m" +
+                       std::to_string(i);
+            }
+            clients.push_back(std::make_shared<Client>(client_ioc, state, std::move(join)));
+            clients.back()->start(server->local_endpoint());
+        }
+        server_thread = std::thread([&] {
+            server_tid = static_cast<pid_t>(syscall(SYS_gettid));
+            server_ioc.run();
+        });
+        client_thread = std::thread([&client_ioc] { client_ioc.run(); });
+        wait_for(state.connected, connections + idle);
+        wait_for(state.joined, connections);
+    }
+
+    const std::string payload(static_cast<size_t>(size), 'x');
+    // Broadcast on the server thread, as a receiving session would.
+    auto burst = [&] {
+        net::post(server_ioc, [&] {
+            for (const auto& room_id : rooms)
+                server->send_room_message(room_id, "bench", payload);
+        });
+    };
+
+    // Warm up queues and buffers before measuring.
+    burst();
+    wait_for(state.delivered, static_cast<uint64_t>(connections));
+
+    const int syscalls_fd = open_syscall_counter(server_tid);
+    const int switches_fd = open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, server_tid);
+    const uint64_t syscalls_before = read_counter(syscalls_fd);
+    const uint64_t switches_before = read_counter(switches_fd);
+    const double cpu_before = thread_cpu_seconds(server_thread);
+    const auto start = bench::clock::now();
+    // One round at a time, so each is a burst onto quiet connections rather
+    // than one long stream the write queues can coalesce.
+    for (long b = 0; b < bursts; ++b) {
+        const uint64_t round = state.delivered.load() + static_cast<uint64_t>(connections);
+        burst();
+        wait_for(state.delivered, round);
+    }
+    const double us = bench::elapsed_us(start, bench::clock::now());
+    const double cpu = thread_cpu_seconds(server_thread) - cpu_before;
+    const uint64_t syscalls = read_counter(syscalls_fd) - syscalls_before;
+    const uint64_t switches = read_counter(switches_fd) - switches_before;
+
+    const double deliveries = static_cast<double>(bursts) * connections;
+    std::cout << "server thread, per delivered message:" << std::endl;
+    std::cout << std::setw(14) << "delivered" << std::setw(12) << "syscalls" << std::setw(12) << "cpu ns"
+              << std::setw(12) << "switches" << std::setw(14) << "deliveries/s" << std::endl;
+    std::cout << std::setw(14) << static_cast<uint64_t>(deliveries) << std::fixed << std::setprecision(3);
+    if (syscalls_fd >= 0)
+        std::cout << std::setw(12) << syscalls / deliveries;
+    else
+        std::cout << std::setw(12) << "n/a";
+    std::cout << std::setw(12) << std::setprecision(0) << cpu * 1e9 / deliveries << std::setprecision(3);
+    if (switches_fd >= 0)
+        std::cout << std::setw(12) << switches / deliveries;
+    else
+        std::cout << std::setw(12) << "n/a";
+    std::cout << std::setw(14) << std::setprecision(0) << deliveries * 1e6 / us << std::endl;
+    if (syscalls_fd < 0)
+        std::cout << "(syscall counts need perf_event_open on the raw_syscalls tracepoint: root or "
+                     "perf_event_paranoid <= 1, and tracefs mounted)"
+                  << std::endl;
+
+    if (syscalls_fd >= 0) close(syscalls_fd);
+    if (switches_fd >= 0) close(switches_fd);
+    server_ioc.stop();
+    client_ioc.stop();
+    server_thread.join();
+    client_thread.join();
+    return EXIT_SUCCESS;
+}
@@ -7,10 +7,22 @@
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/asio/strand.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
 #include <iostream>
+#include <random>
 #include <sstream>
 
 #include "Base64.h"
+#include "PayloadCompression.hpp"
+#include "RoomFrame.hpp"
 
 // For brevity, assume the use of plain text in control commands.
 // In production, you might factor out command parsing.
@@ -20,10 +32,25 @@ namespace beast = boost::beast;
 namespace websocket = beast::websocket;
 using tcp = net::ip::tcp;
 
-ClientSession::ClientSession(net::io_context& io)
+ClientSession::ClientSession(net::io_context& io, bool text_control, bool deflate, size_t read_message_max)
     : io_context_(io),
-      ws_(io)
-{}
+      ws_(io),
+      next_transfer_id_(std::random_device{}()),
+      text_control_(text_control)
+{
+    ws_.read_message_max(read_message_max);
+    // Ping a quiet server after 30 s and give up on it after 60 s, so a dead
+    // connection shows up as a read error instead of a silent prompt.
+    websocket::stream_base::timeout timeout = websocket::stream_base::timeout::suggested(beast::role_type::client);
+    timeout.idle_timeout = std::chrono::seconds(60);
+    timeout.keep_alive_pings = true;
+    ws_.set_option(timeout);
+    if (deflate) {
+        websocket::permessage_deflate pmd;
+        pmd.client_enable = true;
+        ws_.set_option(pmd);
+    }
+}
 
 void ClientSession::connect(const std::string& host, const std::string& port) {
     tcp::resolver resolver(io_context_);
@@ -34,13 +61,21 @@ void ClientSession::connect(const std::string& host, const std::string& port) {
                 std::cerr << "[ClientSession] Connect error: " << ec.message() << std::endl;
                 return;
             }
-            ws_.async_handshake(host, "/",
+            if (!text_control_) {
+                ws_.set_option(websocket::stream_base::decorator([](websocket::request_type& req) {
+                    req.set(beast::http::field::sec_websocket_protocol, control_subprotocol);
+                }));
+            }
+            ws_.async_handshake(handshake_response_, host, "/",
                 [this](boost::system::error_code ec) {
                     if (ec) {
                         std::cerr << "[ClientSession] Handshake error: " << ec.message() << std::endl;
                         return;
                     }
-                    std::cout << "[ClientSession] Connected to server via WebSocket." << std::endl;
+                    binary_control_ =
+                        handshake_response_[beast::http::field::sec_websocket_protocol] == control_subprotocol;
+                    std::cout << "[ClientSession] Connected to server via WebSocket"
+                              << (binary_control_ ? " (binary control)." : ".") << std::endl;
                     start_reading();
                 });
         });
@@ -56,11 +91,25 @@ void ClientSession::start_reading() {
             }
             std::string msg = beast::buffers_to_string(ws_buffer_.data());
             ws_buffer_.consume(ws_buffer_.size());
-            // If the message is a control command, process it.
-            if (msg.rfind("/CMD", 0) == 0) {
+            if (ws_.got_binary() && is_control_frame(msg)) {
+                process_control_frame(msg);
+            } else if (ws_.got_binary() && is_file_relay_frame(msg)) {
+                process_file_relay(msg);
+            } else if (ws_.got_binary() && is_chat_batch_frame(msg)) {
+                process_chat_batch(msg);
+            } else if (ws_.got_binary()) {
+                // Relayed room frames, still encrypted with the room key.
+                process_relayed_messages(msg);
+            } else if (msg.rfind("/CMD", 0) == 0) {
+                // If the message is a control command, process it.
                 std::cout << "\n[Control] " << msg << std::endl;
                 process_control_response(msg);
             } else {
+                // Chat lines, possibly several coalesced into one message.
+                // Only text control sessions get chat this way, and nothing
+                // in it says how many messages it holds: count lines, which
+                // overcounts messages that contain newlines themselves.
+                next_seq_ += std::count(msg.begin(), msg.end(), '\n') + 1;
                 std::cout << "\n" << msg << std::endl;
             }
             //print_prompt();
@@ -77,6 +126,151 @@ static void pack_string(std::vector<unsigned char>& buffer, const std::string& s
     buffer.insert(buffer.end(), s.begin(), s.end());
 }
 
+// Helper: read back a string packed by pack_string.
+static std::string unpack_string(const std::string& data, size_t& offset) {
+    if (offset + 4 > data.size())
+        throw std::runtime_error("Invalid packet: unable to read field length");
+    uint32_t net_len = 0;
+    std::memcpy(&net_len, data.data() + offset, 4);
+    uint32_t field_len = ntohl(net_len);
+    offset += 4;
+    if (field_len > data.size() - offset)
+        throw std::runtime_error("Invalid packet: field length exceeds packet size");
+    std::string field = data.substr(offset, field_len);
+    offset += field_len;
+    return field;
+}
+
+void ClientSession::process_chat_batch(const std::string& frame) {
+    try {
+        ChatBatchView batch = unpack_chat_batch(frame);
+        next_seq_ = batch.first_seq + batch.count;
+        std::cout << "\n" << batch.lines << std::endl;
+    } catch (std::exception& e) {
+        std::cerr << "[ClientSession] Chat batch error: " << e.what() << std::endl;
+    }
+}
+
+void ClientSession::process_relayed_messages(const std::string& frames) {
+    // The server may coalesce several frames into one message; each frame is
+    // room id, nickname and encrypted payload, so they parse back to back.
+    size_t offset = 0;
+    try {
+        while (offset < frames.size()) {
+            std::string room_id = unpack_string(frames, offset);
+            std::string nickname = unpack_string(frames, offset);
+            std::string payload = unpack_string(frames, offset);
+            if (room_id != get_room())
+                continue;
+            ++next_seq_;
+            AESHelper aes(get_room_key(), get_cipher());
+            std::string text = aes.decrypt(payload);
+            if (compressed_) {
+                std::string inflated;
+                decompress_payload(text, inflated);
+                text.swap(inflated);
+            }
+            std::cout << "\n[" << nickname << "]: " << text << std::endl;
+        }
+    } catch (std::exception& e) {
+        std::cerr << "[ClientSession] Relay decode error: " << e.what() << std::endl;
+    }
+}
+
+// A sender's file name, reduced to a plain name in the current directory.
+static std::string safe_file_name(std::string_view name) {
+    const size_t slash = name.find_last_of("/\\");
+    if (slash != std::string_view::npos)
+        name.remove_prefix(slash + 1);
+    std::string safe;
+    for (char c : name)
+        safe.push_back(std::isalnum(static_cast<unsigned char>(c)) || c == '.' || c == '-' || c == '_' ? c : '_');
+    safe.erase(0, safe.find_first_not_of('.'));
+    return safe.empty() ? "file" : safe;
+}
+
+void ClientSession::abandon_download(const std::pair<std::string, uint32_t>& key, const std::string& reason) {
+    auto it = downloads_.find(key);
+    if (it == downloads_.end())
+        return;
+    it->second.out.close();
+    std::error_code ignored;
+    std::filesystem::remove(it->second.path, ignored);
+    std::cerr << "[ClientSession] File " << it->second.path << " from " << key.first << ": " << reason << std::endl;
+    downloads_.erase(it);
+}
+
+void ClientSession::process_file_relay(const std::string& frame) {
+    std::pair<std::string, uint32_t> key;
+    try {
+        FileChunkView chunk = unpack_file_relay(frame);
+        if (chunk.room_id != get_room())
+            return;
+        key = std::make_pair(std::string(chunk.nickname), chunk.transfer_id);
+        if (chunk.flags & file_chunk_aborted) {
+            // The server dropped us from the transfer for falling behind, or
+            // the sender left.
+            auto it = downloads_.find(key);
+            if (it != downloads_.end())
+                abandon_download(key, "aborted by the server after " + std::to_string(it->second.received) + " bytes");
+            return;
+        }
+        AESHelper aes(get_room_key(), get_cipher());
+        std::string data = aes.decrypt(std::string(chunk.encrypted_payload));
+        if (chunk.seq == 0) {
+            // The offer: the file's name and size.
+            const size_t separator = data.find('\0');
+            if (separator == std::string::npos)
+                throw std::runtime_error("malformed file offer");
+            IncomingFile file;
+            file.size = std::stoull(data.substr(separator + 1));
+            file.path = safe_file_name(chunk.nickname) + "-" + safe_file_name(data.substr(0, separator));
+            if (std::filesystem::exists(file.path))
+                file.path += "." + std::to_string(chunk.transfer_id);
+            file.out.open(file.path, std::ios::binary | std::ios::trunc);
+            if (!file.out)
+                throw std::runtime_error("cannot write " + file.path);
+            std::cout << "\n[File] " << chunk.nickname << " is sending " << data.substr(0, separator) << " ("
+                      << file.size << " bytes) to " << file.path << std::endl;
+            downloads_[key] = std::move(file);
+        } else {
+            auto it = downloads_.find(key);
+            if (it == downloads_.end())
+                return; // offered before we joined, or already abandoned
+            IncomingFile& file = it->second;
+            if (chunk.seq != file.next_seq) {
+                abandon_download(key, "chunk " + std::to_string(chunk.seq) + " out of order, abandoned");
+                return;
+            }
+            if (data.size() > file.size - file.received) {
+                abandon_download(key, "more than the offered " + std::to_string(file.size) + " bytes, abandoned");
+                return;
+            }
+            ++file.next_seq;
+            file.out.write(data.data(), static_cast<std::streamsize>(data.size()));
+            file.received += data.size();
+        }
+        if (chunk.flags & file_chunk_last) {
+            auto it = downloads_.find(key);
+            if (it == downloads_.end())
+                return;
+            IncomingFile& file = it->second;
+            file.out.close();
+            if (file.received != file.size || !file.out) {
+                abandon_download(key, "got " + std::to_string(file.received) + " of " + std::to_string(file.size) +
+                                          " bytes");
+                return;
+            }
+            std::cout << "\n[File] Received " << file.path << " (" << file.received << " bytes) from "
+                      << chunk.nickname << std::endl;
+            downloads_.erase(it);
+        }
+    } catch (std::exception& e) {
+        std::cerr << "[ClientSession] File decode error: " << e.what() << std::endl;
+        abandon_download(key, "abandoned");
+    }
+}
+
 void ClientSession::process_input(const std::string& line) {
     std::istringstream iss(line);
     std::string token;
@@ -91,21 +285,74 @@ void ClientSession::process_input(const std::string& line) {
                 return !std::isspace(ch);
             }));
             if (room_name.empty()) {
-                std::cerr << "[ClientSession] Usage: /create-room <room_name>" << std::endl;
+                std::cerr << "[ClientSession] Usage: /create-room [--cipher aes-128-cbc|aes-128-gcm|aes-256-gcm]"
+                             " [--compress] <room_name>" << std::endl;
                 return;
             }
             // Send the control command with the room name.
+            if (binary_control_) {
+                std::string cipher;
+                std::string compression;
+                std::istringstream rest(room_name);
+                room_name.clear();
+                std::string word;
+                while (rest >> word) {
+                    if (word == "--cipher") {
+                        rest >> cipher;
+                    } else if (word == "--compress") {
+                        compression = "deflate";
+                    } else {
+                        std::getline(rest, room_name);
+                        room_name.insert(0, word);
+                        break;
+                    }
+                }
+                ControlWriter frame(ControlOp::CreateRoom, true);
+                frame.add(room_name).add(cipher);
+                if (!compression.empty())
+                    frame.add(compression);
+                send_control_frame(frame);
+                return;
+            }
             send_control_command("create-room " + room_name);
         } else if (token == "/join-room") {
-            std::string room_id, room_key, nick;
+            std::string room_id, room_key, nick, history;
             iss >> room_id >> room_key >> nick;
+            std::getline(iss, history);
             if (room_id.empty() || room_key.empty() || nick.empty()) {
-                std::cerr << "[ClientSession] Usage: /join-room <room_id> <room_key> <nickname>" << std::endl;
+                std::cerr << "[ClientSession] Usage: /join-room <room_id> <room_key> <nickname>"
+                             " [--last N | --since SEQ]" << std::endl;
                 return;
             }
+            // Rejoining a room picks up where we left off.
+            if (history.find_first_not_of(' ') == std::string::npos && room_id == joined_room_)
+                history = " --since " + std::to_string(next_seq_);
             set_room(room_id, room_key);
             set_nickname(nick);
-            send_control_command("join-room " + room_id + " " + room_key + " " + nick);
+            has_handle_ = false;
+            if (!uploads_.empty()) {
+                std::cout << "[ClientSession] Cancelled " << uploads_.size() << " file transfer(s)" << std::endl;
+                uploads_.clear();
+            }
+            downloads_.clear();
+            if (binary_control_) {
+                ControlWriter frame(ControlOp::JoinRoom, true);
+                frame.add(room_id).add(room_key).add(nick);
+                std::istringstream options(history);
+                std::string option;
+                uint64_t value = 0;
+                if (options >> option) {
+                    if ((option != "--last" && option != "--since") || !(options >> value)) {
+                        std::cerr << "[ClientSession] Usage: /join-room <room_id> <room_key> <nickname>"
+                                     " [--last N | --since SEQ]" << std::endl;
+                        return;
+                    }
+                    frame.add(option.substr(2)).add("count", value);
+                }
+                send_control_frame(frame);
+                return;
+            }
+            send_control_command("join-room " + room_id + " " + room_key + " " + nick + history);
         } else if (token == "/nick") {
             std::string newnick;
             iss >> newnick;
@@ -114,7 +361,34 @@ void ClientSession::process_input(const std::string& line) {
                 return;
             }
             set_nickname(newnick);
+            if (binary_control_) {
+                ControlWriter frame(ControlOp::Nick, true);
+                send_control_frame(frame.add(newnick));
+                return;
+            }
             send_control_command("nick " + newnick);
+        } else if (token == "/stats") {
+            std::string admin_token;
+            iss >> admin_token;
+            if (admin_token.empty()) {
+                std::cerr << "[ClientSession] Usage: /stats <admin_token>" << std::endl;
+                return;
+            }
+            if (binary_control_) {
+                ControlWriter frame(ControlOp::Stats, true);
+                send_control_frame(frame.add(admin_token));
+                return;
+            }
+            send_control_command("stats " + admin_token);
+        } else if (token == "/send-file") {
+            std::string path;
+            std::getline(iss, path);
+            path.erase(0, path.find_first_not_of(' '));
+            if (path.empty()) {
+                std::cerr << "[ClientSession] Usage: /send-file <path>" << std::endl;
+                return;
+            }
+            send_file(path);
         } else {
             std::cerr << "[ClientSession] Unknown command: " << token << std::endl;
         }
@@ -131,44 +405,175 @@ void ClientSession::process_input(const std::string& line) {
 
 void ClientSession::send(const std::string& msg) {
     std::cout << msg << "preparing to send" << std::endl;
-    ws_.async_write(net::buffer(msg),
-        [this](boost::system::error_code ec, std::size_t) {
+    queue_write(msg, false);
+}
+
+void ClientSession::send_control_command(const std::string& command) {
+    // Sent as a text message.
+    send("/CMD " + command);
+}
+
+void ClientSession::send_control_frame(ControlWriter& frame) {
+    queue_write(frame.take(), true);
+}
+
+void ClientSession::queue_write(std::string data, bool binary, bool fin) {
+    writes_.push_back({std::make_shared<const std::string>(std::move(data)), binary, fin});
+    if (writes_.size() == 1)
+        write_next();
+}
+
+// write_some with fin unset leaves the message open for the next frame.
+void ClientSession::write_next() {
+    const PendingWrite& write = writes_.front();
+    ws_.binary(write.binary);
+    ws_.async_write_some(write.fin, net::buffer(*write.data),
+        [this, data = write.data](boost::system::error_code ec, std::size_t) {
             if (ec) {
                 std::cerr << "[ClientSession] Send error: " << ec.message() << std::endl;
+                writes_.clear();
+                return;
             }
+            writes_.pop_front();
+            if (!writes_.empty())
+                write_next();
+            else
+                send_file_chunk();
         });
 }
 
-void ClientSession::send_control_command(const std::string& command) {
-    // Set WebSocket to text mode.
-    ws_.binary(false);
-    send("/CMD " + command);
+std::string ClientSession::encrypt_payload(AESHelper& aes, const std::string& text) const {
+    if (!compressed_)
+        return aes.encrypt(text);
+    // Compress before encrypting: ciphertext does not compress.
+    std::string payload;
+    compress_payload(text, payload);
+    return aes.encrypt(payload);
 }
 
 void ClientSession::send_room_message(const std::string& line) {
     try {
-        AESHelper aes(get_room_key());
-        std::string encrypted_payload = aes.encrypt(line);
+        if (has_handle_ && line.size() > chunked_piece_bytes) {
+            send_chunked_room_message(line);
+            return;
+        }
+        AESHelper aes(get_room_key(), get_cipher());
+        std::string encrypted_payload = encrypt_payload(aes, line);
+        if (has_handle_) {
+            // The server knows this room and sender by number.
+            std::string packet;
+            pack_compact_room_message(packet, room_handle_, sender_id_, encrypted_payload);
+            queue_write(std::move(packet), true);
+            return;
+        }
         // Pack the fields.
         std::vector<unsigned char> packet;
         pack_string(packet, get_room());         // Room ID
         pack_string(packet, get_nickname());       // Nickname
         pack_string(packet, encrypted_payload);    // Encrypted payload
-
-        // Set WebSocket to binary mode.
-        ws_.binary(true);
-        // Send the binary packet.
-        ws_.async_write(boost::asio::buffer(packet),
-            [this](boost::system::error_code ec, std::size_t) {
-                if (ec) {
-                    std::cerr << "[ClientSession] Send error: " << ec.message() << std::endl;
-                }
-            });
+        queue_write(std::string(packet.begin(), packet.end()), true);
     } catch (std::exception& e) {
         std::cerr << "[ClientSession] Encryption error: " << e.what() << std::endl;
     }
 }
 
+// Members see each piece as a message of its own, so pieces end on a UTF-8
+// character boundary.
+void ClientSession::send_chunked_room_message(const std::string& line) {
+    AESHelper aes(get_room_key(), get_cipher());
+    std::string header;
+    pack_chunked_room_header(header, room_handle_);
+    queue_write(std::move(header), true, false);
+    size_t offset = 0;
+    while (offset < line.size()) {
+        size_t end = std::min(line.size(), offset + chunked_piece_bytes);
+        while (end < line.size() && end > offset + 1 && (static_cast<unsigned char>(line[end]) & 0xC0) == 0x80)
+            --end;
+        std::string piece;
+        pack_view(piece, encrypt_payload(aes, line.substr(offset, end - offset)));
+        queue_write(std::move(piece), true, end == line.size());
+        offset = end;
+    }
+}
+
+ClientSession::OutgoingFile::~OutgoingFile() {
+    if (data)
+        ::munmap(const_cast<char*>(data), size);
+    if (fd >= 0)
+        ::close(fd);
+}
+
+// File chunks are sent as compact frames are, so only to servers that hand
+// out room handles. The server relays them without decrypting.
+void ClientSession::send_file(const std::string& path) {
+    if (!has_handle_) {
+        std::cerr << "[ClientSession] /send-file needs a joined room on a server that hands out room handles"
+                  << std::endl;
+        return;
+    }
+    auto file = std::make_unique<OutgoingFile>();
+    file->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    if (file->fd < 0 || ::fstat(file->fd, &st) != 0) {
+        std::cerr << "[ClientSession] Cannot send " << path << ": " << std::strerror(errno) << std::endl;
+        return;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        std::cerr << "[ClientSession] Cannot send " << path << ": not a regular file" << std::endl;
+        return;
+    }
+    file->size = static_cast<size_t>(st.st_size);
+    if (file->size > 0) {
+        void* data = ::mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+        if (data == MAP_FAILED) {
+            std::cerr << "[ClientSession] Cannot map " << path << ": " << std::strerror(errno) << std::endl;
+            return;
+        }
+        ::madvise(data, file->size, MADV_SEQUENTIAL);
+        file->data = static_cast<const char*>(data);
+    }
+    file->name = std::filesystem::path(path).filename().string();
+    file->room_handle = room_handle_;
+    file->transfer_id = next_transfer_id_++;
+    std::cout << "[ClientSession] Sending " << file->name << " (" << file->size << " bytes)" << std::endl;
+    uploads_.push_back(std::move(file));
+    if (writes_.empty())
+        send_file_chunk();
+}
+
+// Queues the next chunk of the oldest upload, once nothing else is waiting
+// to be written.
+void ClientSession::send_file_chunk() {
+    if (uploads_.empty() || !writes_.empty())
+        return;
+    OutgoingFile& file = *uploads_.front();
+    try {
+        AESHelper aes(get_room_key(), get_cipher());
+        std::string plain;
+        if (file.next_seq == 0) {
+            plain = file.name;
+            plain.push_back('\0');
+            plain += std::to_string(file.size);
+        } else {
+            const size_t length = std::min(file_chunk_bytes, file.size - file.offset);
+            plain.assign(file.data + file.offset, length);
+            file.offset += length;
+        }
+        const bool last = file.offset == file.size && (file.next_seq > 0 || file.size == 0);
+        std::string frame;
+        pack_file_chunk(frame, file.room_handle, file.transfer_id, file.next_seq++, last ? file_chunk_last : 0,
+                        aes.encrypt(plain));
+        if (last) {
+            std::cout << "[ClientSession] Sent " << file.name << std::endl;
+            uploads_.pop_front();
+        }
+        queue_write(std::move(frame), true);
+    } catch (std::exception& e) {
+        std::cerr << "[ClientSession] Cannot send " << file.name << ": " << e.what() << std::endl;
+        uploads_.pop_front();
+    }
+}
+
 // In ClientSession or CliApp, when processing an incoming control command:
 void ClientSession::process_control_response(const std::string& response) {
     // For example, if response starts with "/CMD join-success", then parse it.
@@ -176,9 +581,100 @@ void ClientSession::process_control_response(const std::string& response) {
     std::string prefix, subcmd, room_id, room_name;
     iss >> prefix >> subcmd >> room_id >> room_name;
     if (subcmd == "join-success") {
-        set_room(room_id, get_room_key()); // get_room_key() is already stored from join command.
-        // Also store the room name.
-        current_room_name_ = room_name;
-        std::cout << "[ClientSession] Joined room " << room_id << " (" << room_name << ")" << std::endl;
+        // The room's cipher is announced as a trailing "cipher=<name>" token.
+        // Then "seq=<next>" and "replay=<first>": history [first, next) is
+        // streamed before live messages.
+        // "handle=<n> sender=<id>" name the room and this client in compact
+        // room frames; "compress=deflate" marks a room whose messages are
+        // compressed before encryption.
+        CipherMode cipher = CipherMode::AES_128_CBC;
+        uint64_t seq = 0;
+        uint64_t replay = 0;
+        bool has_handle = false;
+        uint32_t handle = 0;
+        uint32_t sender = 0;
+        bool compressed = false;
+        std::string token;
+        while (iss >> token) {
+            if (token.rfind("cipher=", 0) == 0)
+                parse_cipher(token.substr(7), cipher);
+            else if (token.rfind("seq=", 0) == 0)
+                seq = std::stoull(token.substr(4));
+            else if (token.rfind("replay=", 0) == 0)
+                replay = std::stoull(token.substr(7));
+            else if (token.rfind("handle=", 0) == 0)
+                handle = static_cast<uint32_t>(std::stoul(token.substr(7))), has_handle = true;
+            else if (token.rfind("sender=", 0) == 0)
+                sender = static_cast<uint32_t>(std::stoul(token.substr(7)));
+            else if (token.rfind("compress=", 0) == 0)
+                compressed = token.substr(9) == "deflate";
+        }
+        on_join_success(room_id, room_name, cipher, seq, replay, has_handle, handle, sender, compressed);
     }
-}
\ No newline at end of file
+}
+
+void ClientSession::process_control_frame(const std::string& frame) {
+    try {
+        ControlReader reader(frame);
+        // Shown as the equivalent text command.
+        ControlWriter text(reader.op(), false);
+        if (reader.op() == ControlOp::JoinSuccess) {
+            std::string room_id(reader.text());
+            std::string room_name(reader.text());
+            std::string cipher_text(reader.text());
+            uint64_t seq = reader.number();
+            uint64_t replay = reader.number();
+            text.add(room_id).add(room_name).add("cipher", cipher_text).add("seq", seq).add("replay", replay);
+            const bool has_handle = reader.more();
+            uint32_t handle = 0;
+            uint32_t sender = 0;
+            if (has_handle) {
+                handle = static_cast<uint32_t>(reader.number());
+                sender = static_cast<uint32_t>(reader.number());
+                text.add("handle", handle).add("sender", sender);
+            }
+            bool compressed = false;
+            if (reader.more()) {
+                std::string_view compression = reader.text();
+                text.add("compress", compression);
+                compressed = compression == "deflate";
+            }
+            std::cout << "\n[Control] " << text.take() << std::endl;
+            CipherMode cipher = CipherMode::AES_128_CBC;
+            parse_cipher(cipher_text, cipher);
+            on_join_success(room_id, room_name, cipher, seq, replay, has_handle, handle, sender, compressed);
+            return;
+        }
+        if (reader.op() == ControlOp::StatsResult) {
+            while (reader.more()) {
+                std::string_view name = reader.text();
+                text.add(name, reader.number());
+            }
+            std::cout << "\n[Control] " << text.take() << std::endl;
+            return;
+        }
+        while (reader.more())
+            text.add(reader.text());
+        std::cout << "\n[Control] " << text.take() << std::endl;
+    } catch (std::exception& e) {
+        std::cerr << "[ClientSession] Control frame error: " << e.what() << std::endl;
+    }
+}
+
+void ClientSession::on_join_success(const std::string& room_id, const std::string& room_name, CipherMode cipher,
+                                    uint64_t seq, uint64_t replay, bool has_handle, uint32_t handle,
+                                    uint32_t sender, bool compressed) {
+    set_room(room_id, get_room_key()); // get_room_key() is already stored from join command.
+    current_cipher_ = cipher;
+    has_handle_ = has_handle;
+    room_handle_ = handle;
+    sender_id_ = sender;
+    compressed_ = compressed;
+    next_seq_ = std::min(replay, seq);
+    joined_room_ = room_id;
+    // Also store the room name.
+    current_room_name_ = room_name;
+    std::cout << "[ClientSession] Joined room " << room_id << " (" << room_name << ")" << std::endl;
+    if (seq > replay)
+        std::cout << "[ClientSession] Replaying " << (seq - replay) << " earlier messages" << std::endl;
+}
@@ -5,8 +5,16 @@
 #pragma once
 #include <boost/beast/websocket.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
 #include <string>
+#include <utility>
 #include <boost/asio/streambuf.hpp>
+#include "aes_encryption.h"
+#include "ControlFrame.hpp"
 
 namespace beast = boost::beast;
 namespace websocket = beast::websocket;
@@ -15,7 +23,19 @@ using tcp = net::ip::tcp;
 
 class ClientSession {
 public:
-    ClientSession(net::io_context& io);
+    // Unless 'text_control' is set, offer binary control frames at the
+    // handshake; a server that does not know them keeps the text commands.
+    // 'deflate' offers permessage-deflate. A message from the server longer
+    // than 'read_message_max' bytes ends the connection.
+    ClientSession(net::io_context& io, bool text_control = false, bool deflate = false,
+                  size_t read_message_max = 16 * 1024 * 1024);
+
+    // Lines longer than this go as chunked room messages, a piece of this
+    // size at a time, on servers that hand out room handles.
+    static constexpr size_t chunked_piece_bytes = 16 * 1024;
+
+    // /send-file reads the file this much at a time into each chunk.
+    static constexpr size_t file_chunk_bytes = 64 * 1024;
 
     // Connect to the server using the provided host and port.
     void connect(const std::string& host, const std::string& port);
@@ -31,11 +51,27 @@ public:
     void send_room_message(const std::string &line);
 
     void process_control_response(const std::string &response);
+    void process_control_frame(const std::string &frame);
+
+    // Print decrypted chat lines and note where a rejoin resumes.
+    void process_chat_batch(const std::string &frame);
+
+    // Decrypt and print room frames relayed by a server in relay mode.
+    void process_relayed_messages(const std::string &frames);
+
+    // Write a file another member is sending to the current directory.
+    void process_file_relay(const std::string &frame);
+    // Close and delete a partly received file.
+    void abandon_download(const std::pair<std::string, uint32_t> &key, const std::string &reason);
 
     // Getters/setters for state.
     const std::string& get_room() const { return current_room_; }
     const std::string& get_room_key() const { return current_room_key_; }
     const std::string& get_nickname() const { return current_nickname_; }
+    CipherMode get_cipher() const { return current_cipher_; }
+    // Sequence number of the next room message to arrive; rejoining the same
+    // room resumes from here.
+    uint64_t get_next_seq() const { return next_seq_; }
     std::string current_room_name_;
 
     void set_room(const std::string& room_id, const std::string& room_key) {
@@ -51,12 +87,74 @@ public:
     void start_reading();
 
 private:
+    void send_control_frame(ControlWriter& frame);
+    void send_chunked_room_message(const std::string& line);
+    std::string encrypt_payload(AESHelper& aes, const std::string& text) const;
+    void send_file(const std::string& path);
+    void send_file_chunk();
+
+    // Writes go out one frame at a time, in order. A chunked message's
+    // frames are queued together, so nothing is written in between.
+    void queue_write(std::string data, bool binary, bool fin = true);
+    void write_next();
+    void on_join_success(const std::string& room_id, const std::string& room_name, CipherMode cipher,
+                         uint64_t seq, uint64_t replay, bool has_handle, uint32_t handle, uint32_t sender,
+                         bool compressed);
+
     net::io_context& io_context_;
     websocket::stream<tcp::socket> ws_;
     net::streambuf ws_buffer_;
+    struct PendingWrite {
+        std::shared_ptr<const std::string> data;
+        bool binary;
+        bool fin; // the last frame of its message
+    };
+    std::deque<PendingWrite> writes_; // the front one is being written
+
+    // A file being sent, mapped rather than read. Its next chunk is queued
+    // only once writes_ is empty, so lines typed meanwhile go out between
+    // chunks instead of behind the whole file.
+    struct OutgoingFile {
+        OutgoingFile() = default;
+        OutgoingFile(const OutgoingFile&) = delete;
+        OutgoingFile& operator=(const OutgoingFile&) = delete;
+        ~OutgoingFile();
+
+        int fd = -1;
+        const char* data = nullptr; // null for an empty file
+        size_t size = 0;
+        size_t offset = 0;
+        std::string name;
+        uint32_t room_handle = 0;
+        uint32_t transfer_id = 0;
+        uint32_t next_seq = 0; // 0 is the offer: name and size
+    };
+    std::deque<std::unique_ptr<OutgoingFile>> uploads_; // sent one after another
+    uint32_t next_transfer_id_;
+
+    struct IncomingFile {
+        std::ofstream out;
+        std::string path;
+        uint64_t size = 0;
+        uint64_t received = 0;
+        uint32_t next_seq = 1;
+    };
+    std::map<std::pair<std::string, uint32_t>, IncomingFile> downloads_; // by sender nickname and transfer id
+    websocket::response_type handshake_response_;
+    bool text_control_;
+    bool binary_control_ = false; // the server accepted binary control frames
 
     // Client state.
     std::string current_room_;
     std::string current_room_key_;
+    CipherMode current_cipher_ = CipherMode::AES_128_CBC;
+    uint64_t next_seq_ = 0;
+    std::string joined_room_; // room next_seq_ belongs to
+    // Set by join-success on servers that hand out numbers for compact room
+    // frames; cleared while a join is pending.
+    bool has_handle_ = false;
+    uint32_t room_handle_ = 0;
+    uint32_t sender_id_ = 0;
+    bool compressed_ = false; // room messages are compressed before encryption
     std::string current_nickname_ = "Anonymous";
 };
\ No newline at end of file
@@ -18,11 +18,12 @@ void enable_echo() {
     tcsetattr(STDIN_FILENO, TCSANOW, &tty);
 }
 
-CliApp::CliApp(net::io_context& io, const std::string& host, const std::string& port)
+CliApp::CliApp(net::io_context& io, const std::string& host, const std::string& port, bool text_control,
+               bool deflate, size_t read_message_max)
     : io_context_(io),
       stdin_(io, ::dup(STDIN_FILENO))
 {
-    client_session_ = std::make_unique<ClientSession>(io);
+    client_session_ = std::make_unique<ClientSession>(io, text_control, deflate, read_message_max);
     client_session_->connect(host, port);
 }
 
@@ -11,7 +11,8 @@ namespace net = boost::asio;
 
 class CliApp {
 public:
-    CliApp(net::io_context& io, const std::string& host, const std::string& port);
+    CliApp(net::io_context& io, const std::string& host, const std::string& port, bool text_control = false,
+           bool deflate = false, size_t read_message_max = 16 * 1024 * 1024);
     void run();
     void process_input(const std::string& line);
 
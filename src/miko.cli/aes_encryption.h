@@ -5,94 +5,204 @@
 #include <stdexcept>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <algorithm>
+#include <cstring>
+
+// Room ciphers. CBC is the original format; GCM is authenticated and lets
+// OpenSSL use its AES-NI/CLMUL fast paths.
+enum class CipherMode {
+    AES_128_CBC,
+    AES_128_GCM,
+    AES_256_GCM
+};
+
+inline const char* cipher_name(CipherMode mode) {
+    switch (mode) {
+        case CipherMode::AES_128_GCM: return "aes-128-gcm";
+        case CipherMode::AES_256_GCM: return "aes-256-gcm";
+        default: return "aes-128-cbc";
+    }
+}
+
+inline bool parse_cipher(const std::string& name, CipherMode& mode) {
+    for (CipherMode m : {CipherMode::AES_128_CBC, CipherMode::AES_128_GCM, CipherMode::AES_256_GCM}) {
+        if (name == cipher_name(m)) {
+            mode = m;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline size_t cipher_key_size(CipherMode mode) {
+    return mode == CipherMode::AES_256_GCM ? 32 : 16;
+}
 
 class AESHelper {
 public:
-    static constexpr size_t BLOCK_SIZE = 16; // 16 bytes for AES-128
+    static constexpr size_t BLOCK_SIZE = 16;   // AES block, and the CBC IV
+    static constexpr size_t GCM_IV_SIZE = 12;
+    static constexpr size_t GCM_TAG_SIZE = 16;
+    static constexpr size_t MAX_KEY_SIZE = 32;
 
-    explicit AESHelper(const std::string& key) {
-        if (key.size() != BLOCK_SIZE) {
-            throw std::invalid_argument("Key must be 16 bytes (128 bits).");
+    explicit AESHelper(const std::string& key, CipherMode mode = CipherMode::AES_128_CBC)
+        : m_mode(mode), m_key_size(cipher_key_size(mode)) {
+        if (key.size() != m_key_size) {
+            throw std::invalid_argument(m_key_size == 16 ? "Key must be 16 bytes (128 bits)."
+                                                         : "Key must be 32 bytes (256 bits).");
         }
-        m_key.assign(key.begin(), key.end());
+        std::memcpy(m_key, key.data(), m_key_size);
     }
 
-    //Encrypt: prepends the IV to the ciphertext so decryption can retrieve it.
-    std::string encrypt(const std::string& plaintext) {
-        unsigned char iv[BLOCK_SIZE];
-        if (!RAND_bytes(iv, BLOCK_SIZE)) {
+    CipherMode mode() const { return m_mode; }
+
+    // Output size bounds, for sizing caller-provided buffers.
+    size_t max_encrypted_size(size_t plaintext_size) const {
+        return is_gcm() ? GCM_IV_SIZE + plaintext_size + GCM_TAG_SIZE
+                        : BLOCK_SIZE + plaintext_size + BLOCK_SIZE;
+    }
+    size_t max_decrypted_size(size_t cipher_size) const { return cipher_size; }
+
+    // Encrypt into 'out' (at least max_encrypted_size bytes). The output is
+    // IV + ciphertext, plus the tag for GCM. Returns the bytes written.
+    size_t encrypt(const unsigned char* plaintext, size_t size, unsigned char* out) {
+        const size_t iv_size = is_gcm() ? GCM_IV_SIZE : BLOCK_SIZE;
+        if (!RAND_bytes(out, static_cast<int>(iv_size))) {
             throw std::runtime_error("Error generating random IV.");
         }
-
-        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-        if (!ctx) {
-            throw std::runtime_error("Error creating EVP context.");
+        EVP_CIPHER_CTX* ctx = context(true, out);
+        unsigned char* ciphertext = out + iv_size;
+        int len = 0;
+        if (1 != EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, static_cast<int>(size))) {
+            fail("Error encrypting data.");
+        }
+        size_t written = len;
+        if (1 != EVP_EncryptFinal_ex(ctx, ciphertext + written, &len)) {
+            fail("Error finalizing encryption.");
         }
+        written += len;
+        if (is_gcm()) {
+            if (1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, GCM_TAG_SIZE, ciphertext + written)) {
+                fail("Error reading authentication tag.");
+            }
+            written += GCM_TAG_SIZE;
+        }
+        return iv_size + written;
+    }
 
-        if (1 != EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), nullptr, m_key.data(), iv)) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Error initializing encryption.");
+    // Decrypt the output of encrypt() into 'out' (at least
+    // max_decrypted_size bytes). Returns the plaintext size.
+    size_t decrypt(const unsigned char* input, size_t size, unsigned char* out) {
+        const size_t overhead = is_gcm() ? GCM_IV_SIZE + GCM_TAG_SIZE : BLOCK_SIZE;
+        if (size < overhead) {
+            throw std::runtime_error("Ciphertext too short.");
         }
+        const size_t iv_size = is_gcm() ? GCM_IV_SIZE : BLOCK_SIZE;
+        const unsigned char* ciphertext = input + iv_size;
+        const size_t ciphertext_len = size - overhead;
 
-        std::vector<unsigned char> ciphertext(plaintext.size() + BLOCK_SIZE);
+        EVP_CIPHER_CTX* ctx = context(false, input);
         int len = 0;
-        int ciphertext_len = 0;
-        if (1 != EVP_EncryptUpdate(ctx, ciphertext.data(), &len, reinterpret_cast<const unsigned char*>(plaintext.data()), plaintext.size())) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Error encrypting data.");
+        if (1 != EVP_DecryptUpdate(ctx, out, &len, ciphertext, static_cast<int>(ciphertext_len))) {
+            fail("Error decrypting data.");
         }
-        ciphertext_len = len;
-
-        if (1 != EVP_EncryptFinal_ex(ctx, ciphertext.data() + len, &len)) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Error finalizing encryption.");
+        size_t written = len;
+        if (is_gcm()) {
+            auto* tag = const_cast<unsigned char*>(ciphertext + ciphertext_len);
+            if (1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, GCM_TAG_SIZE, tag)) {
+                fail("Error setting authentication tag.");
+            }
+        }
+        if (1 != EVP_DecryptFinal_ex(ctx, out + written, &len)) {
+            fail(is_gcm() ? "Message authentication failed." : "Error finalizing decryption.");
         }
-        ciphertext_len += len;
-        EVP_CIPHER_CTX_free(ctx);
+        return written + len;
+    }
+
+    // Same, into a caller-owned string whose capacity is reused.
+    void encrypt(std::string_view plaintext, std::string& out) {
+        out.resize(max_encrypted_size(plaintext.size()));
+        out.resize(encrypt(reinterpret_cast<const unsigned char*>(plaintext.data()), plaintext.size(),
+                           reinterpret_cast<unsigned char*>(&out[0])));
+    }
 
-        // Return iv + ciphertext.
-        std::string result(reinterpret_cast<char*>(iv), BLOCK_SIZE);
-        result.append(reinterpret_cast<char*>(ciphertext.data()), ciphertext_len);
+    void decrypt(std::string_view cipher_with_iv, std::string& out) {
+        out.resize(max_decrypted_size(cipher_with_iv.size()));
+        out.resize(decrypt(reinterpret_cast<const unsigned char*>(cipher_with_iv.data()), cipher_with_iv.size(),
+                           reinterpret_cast<unsigned char*>(&out[0])));
+    }
+
+    //Encrypt: prepends the IV to the ciphertext so decryption can retrieve it.
+    std::string encrypt(const std::string& plaintext) {
+        std::string result;
+        encrypt(std::string_view(plaintext), result);
         return result;
     }
 
     //Decrypt: extracts the IV from the beginning of the input.
     std::string decrypt(const std::string& cipher_with_iv) {
-        if (cipher_with_iv.size() < BLOCK_SIZE) {
-            throw std::runtime_error("Ciphertext too short.");
-        }
-        const auto* iv = reinterpret_cast<const unsigned char*>(cipher_with_iv.data());
-        const auto* ciphertext = reinterpret_cast<const unsigned char*>(cipher_with_iv.data() + BLOCK_SIZE);
-        int ciphertext_len = cipher_with_iv.size() - BLOCK_SIZE;
+        std::string result;
+        decrypt(std::string_view(cipher_with_iv), result);
+        return result;
+    }
 
+private:
+    // One cipher context per thread and direction, reused across messages
+    // and helpers. When the cipher and key match the previous call only the
+    // IV is reset, so the key schedule is not recomputed either.
+    struct ThreadContext {
         EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-        if (!ctx) {
+        bool ready = false;
+        CipherMode mode = CipherMode::AES_128_CBC;
+        unsigned char key[MAX_KEY_SIZE] = {};
+        ~ThreadContext() { EVP_CIPHER_CTX_free(ctx); }
+    };
+
+    static ThreadContext& thread_context(bool encrypting) {
+        thread_local ThreadContext contexts[2];
+        ThreadContext& tc = contexts[encrypting ? 1 : 0];
+        if (!tc.ctx) {
             throw std::runtime_error("Error creating EVP context.");
         }
-        if (1 != EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), nullptr, m_key.data(), iv)) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Error initializing decryption.");
-        }
+        return tc;
+    }
 
-        std::vector<unsigned char> plaintext(ciphertext_len + BLOCK_SIZE);
-        int len = 0;
-        int plaintext_len = 0;
-        if (1 != EVP_DecryptUpdate(ctx, plaintext.data(), &len, ciphertext, ciphertext_len)) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Error decrypting data.");
+    EVP_CIPHER_CTX* context(bool encrypting, const unsigned char* iv) {
+        ThreadContext& tc = thread_context(encrypting);
+        const bool same = tc.ready && tc.mode == m_mode && std::memcmp(tc.key, m_key, m_key_size) == 0;
+        const EVP_CIPHER* cipher = same ? nullptr : evp_cipher();
+        const unsigned char* key = same ? nullptr : m_key;
+        tc.ready = false;
+        int ok = encrypting ? EVP_EncryptInit_ex(tc.ctx, cipher, nullptr, key, iv)
+                            : EVP_DecryptInit_ex(tc.ctx, cipher, nullptr, key, iv);
+        if (1 != ok) {
+            throw std::runtime_error(encrypting ? "Error initializing encryption." : "Error initializing decryption.");
         }
-        plaintext_len = len;
+        tc.ready = true;
+        tc.mode = m_mode;
+        std::memcpy(tc.key, m_key, m_key_size);
+        return tc.ctx;
+    }
+
+    // Leave no half-finished state behind for the next message on this thread.
+    [[noreturn]] static void fail(const char* what) {
+        thread_context(false).ready = false;
+        thread_context(true).ready = false;
+        throw std::runtime_error(what);
+    }
 
-        if (1 != EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &len)) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Error finalizing decryption.");
+    const EVP_CIPHER* evp_cipher() const {
+        switch (m_mode) {
+            case CipherMode::AES_128_GCM: return EVP_aes_128_gcm();
+            case CipherMode::AES_256_GCM: return EVP_aes_256_gcm();
+            default: return EVP_aes_128_cbc();
         }
-        plaintext_len += len;
-        EVP_CIPHER_CTX_free(ctx);
-        return std::string(reinterpret_cast<char*>(plaintext.data()), plaintext_len);
     }
 
-private:
-    std::vector<unsigned char> m_key;
-};
\ No newline at end of file
+    bool is_gcm() const { return m_mode != CipherMode::AES_128_CBC; }
+
+    CipherMode m_mode;
+    size_t m_key_size;
+    unsigned char m_key[MAX_KEY_SIZE];
+};
@@ -9,6 +9,9 @@ int main(int argc, char* argv[]) {
     try {
         std::string host = "127.0.0.1";
         std::string port = "8080";
+        bool text_control = false;
+        bool deflate = false;
+        size_t read_message_max = 16 * 1024 * 1024;
         // Optionally parse command-line args for host/port.
         for (int i = 1; i < argc; ++i) {
             std::string arg(argv[i]);
@@ -16,10 +19,19 @@ int main(int argc, char* argv[]) {
                 host = argv[++i];
             } else if (arg == "--port" && i + 1 < argc) {
                 port = argv[++i];
+            } else if (arg == "--text-control") {
+                // Use the text control commands even if the server knows the binary ones.
+                text_control = true;
+            } else if (arg == "--deflate") {
+                // Offer permessage-deflate; servers started with --deflate accept it.
+                deflate = true;
+            } else if (arg == "--read-message-max" && i + 1 < argc) {
+                // Longest message accepted from the server.
+                read_message_max = std::stoul(argv[++i]);
             }
         }
         net::io_context io;
-        CliApp app(io, host, port);
+        CliApp app(io, host, port, text_control, deflate, read_message_max);
         std::cout << "miko.cli v1.0" << std::endl;
         std::cout << "target host: " << host << std::endl;
         std::cout << "target port: " << port << std::endl;
@@ -0,0 +1,603 @@
+//
+// Several miko.service processes sharing their rooms.
+//
+
+#include "Cluster.hpp"
+#include "ControlFrame.hpp"
+#include "Logger.hpp"
+#include "MikoServer.hpp"
+#include "Room.hpp"
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket.hpp>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+
+namespace net = boost::asio;
+namespace beast = boost::beast;
+namespace websocket = beast::websocket;
+using tcp = net::ip::tcp;
+
+namespace {
+
+constexpr size_t ring_points = 64;       // per node
+constexpr size_t max_link_queue = 65536; // frames waiting for a link
+constexpr auto redial_delay = std::chrono::milliseconds(500);
+constexpr auto join_timeout = std::chrono::seconds(5);
+constexpr auto accept_retry_delay = std::chrono::milliseconds(100);
+constexpr size_t challenge_size = 16;
+
+// FNV-1a with a SplitMix64 finish, so short ids still spread over the ring.
+// It has to agree between processes, which std::hash need not.
+uint64_t ring_hash(std::string_view text) {
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : text) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+LogRateLimit frame_errors(10);
+LogRateLimit accept_errors(10);
+
+} // namespace
+
+// The link this node dials to another: it carries this node's frames there.
+class Cluster::Link : public std::enable_shared_from_this<Link> {
+public:
+    using stream_type = websocket::stream<tcp::socket>;
+
+    Link(net::io_context& ioc, Cluster& cluster, size_t node, tcp::endpoint endpoint)
+        : strand_(net::make_strand(ioc)), timer_(strand_), cluster_(cluster), node_(node), endpoint_(endpoint) {}
+
+    void start() {
+        net::dispatch(strand_, [self = shared_from_this()] { self->connect(); });
+    }
+
+    void stop() {
+        net::dispatch(strand_, [self = shared_from_this()] {
+            self->stopped_ = true;
+            self->timer_.cancel();
+            if (self->ws_) {
+                beast::error_code ignored;
+                self->ws_->next_layer().close(ignored);
+            }
+        });
+    }
+
+    void send(SharedBuffer frame) {
+        net::post(strand_, [self = shared_from_this(), frame = std::move(frame)]() mutable {
+            if (self->queue_.size() >= max_link_queue) {
+                self->cluster_.server_.metrics().cluster_frames_dropped.add();
+                return;
+            }
+            self->queue_.push_back(std::move(frame));
+            self->write();
+        });
+    }
+
+    bool up() const { return up_.load(std::memory_order_relaxed); }
+
+private:
+    // Each connection attempt gets a new stream and generation; handlers of
+    // an older one keep their stream alive and find their generation gone.
+    void connect() {
+        if (stopped_)
+            return;
+        const uint64_t generation = ++generation_;
+        auto ws = std::make_shared<stream_type>(strand_);
+        ws_ = ws;
+        // The other node checks that the hello comes from this node's address.
+        beast::error_code ec;
+        ws->next_layer().open(endpoint_.protocol(), ec);
+        if (!ec)
+            ws->next_layer().bind({cluster_.nodes_[cluster_.self_].address(), 0}, ec);
+        if (ec)
+            return redial(generation);
+        ws->next_layer().async_connect(endpoint_, [self = shared_from_this(), ws, generation](beast::error_code ec) {
+            if (ec)
+                return self->redial(generation);
+            ws->async_handshake(self->endpoint_.address().to_string(), "/",
+                                [self, ws, generation](beast::error_code ec) {
+                if (ec)
+                    return self->redial(generation);
+                if (self->cluster_.secret_.empty())
+                    return self->hello(ws, generation, {});
+                self->read_challenge(ws, generation);
+            });
+        });
+    }
+
+    void read_challenge(const std::shared_ptr<stream_type>& ws, uint64_t generation) {
+        auto buffer = std::make_shared<beast::flat_buffer>();
+        ws->async_read(*buffer, [self = shared_from_this(), ws, generation, buffer](beast::error_code ec, std::size_t) {
+            if (ec)
+                return self->redial(generation);
+            auto data = buffer->data();
+            std::string_view frame(static_cast<const char*>(data.data()), data.size());
+            std::string nonce;
+            try {
+                ControlReader reader(frame);
+                if (reader.op() == ControlOp::PeerChallenge)
+                    nonce = std::string(reader.text());
+            } catch (const std::exception&) {
+            }
+            if (nonce.empty()) {
+                uint64_t suppressed = 0;
+                if (frame_errors.allow(suppressed))
+                    LogLine(LogLevel::Warn) << "[Cluster] Node " << self->node_ << " sent no challenge"
+                                            << LogSuppressed{suppressed};
+                return self->redial(generation);
+            }
+            self->hello(ws, generation, nonce);
+        });
+    }
+
+    void hello(const std::shared_ptr<stream_type>& ws, uint64_t generation, std::string_view nonce) {
+        ws->binary(true);
+        up_ = true;
+        LogLine(LogLevel::Info) << "[Cluster] Link to node " << node_ << " up";
+        ControlWriter hello(ControlOp::PeerHello, true);
+        hello.add("node", cluster_.self_);
+        if (!nonce.empty())
+            hello.add(cluster_.proof(nonce, cluster_.self_));
+        queue_.push_front(std::make_shared<const std::string>(hello.take()));
+        cluster_.on_link_up(node_);
+        read(ws, generation);
+        write();
+    }
+
+    void redial(uint64_t generation) {
+        if (generation != generation_ || stopped_)
+            return;
+        ++generation_;
+        if (up_.exchange(false))
+            LogLine(LogLevel::Warn) << "[Cluster] Link to node " << node_ << " down";
+        writing_ = false;
+        if (ws_) {
+            beast::error_code ignored;
+            ws_->next_layer().close(ignored);
+        }
+        timer_.expires_after(redial_delay);
+        timer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+            if (!ec)
+                self->connect();
+        });
+    }
+
+    // Nothing is expected back; the read answers pings and notices a close.
+    void read(const std::shared_ptr<stream_type>& ws, uint64_t generation,
+              std::shared_ptr<beast::flat_buffer> buffer = std::make_shared<beast::flat_buffer>()) {
+        ws->async_read(*buffer, [self = shared_from_this(), ws, generation, buffer](beast::error_code ec, std::size_t) {
+            if (ec)
+                return self->redial(generation);
+            buffer->clear();
+            self->read(ws, generation, buffer);
+        });
+    }
+
+    // The front frame leaves the queue only once written, so a frame cut off
+    // by a dropped link is sent again on the next one.
+    void write() {
+        if (!up_ || writing_ || queue_.empty())
+            return;
+        writing_ = true;
+        const uint64_t generation = generation_;
+        ws_->async_write(net::buffer(*queue_.front()),
+                         [self = shared_from_this(), ws = ws_, generation](beast::error_code ec, std::size_t) {
+            if (generation != self->generation_)
+                return;
+            self->writing_ = false;
+            if (ec)
+                return self->redial(generation);
+            self->queue_.pop_front();
+            self->cluster_.server_.metrics().cluster_frames_out.add();
+            self->write();
+        });
+    }
+
+    net::strand<net::io_context::executor_type> strand_;
+    net::steady_timer timer_;
+    Cluster& cluster_;
+    const size_t node_;
+    const tcp::endpoint endpoint_;
+    std::shared_ptr<stream_type> ws_;
+    std::deque<SharedBuffer> queue_;
+    uint64_t generation_ = 0;
+    bool writing_ = false;
+    bool stopped_ = false;
+    std::atomic<bool> up_{false};
+};
+
+// A link another node dialled to this one: it carries that node's frames.
+// The first frame names the node, and answers the challenge if there is one.
+class Cluster::Inbound : public std::enable_shared_from_this<Inbound> {
+public:
+    Inbound(tcp::socket socket, Cluster& cluster, net::ip::address address)
+        : ws_(std::move(socket)), cluster_(cluster), address_(address) {}
+
+    void start() {
+        ws_.async_accept([self = shared_from_this()](beast::error_code ec) {
+            if (ec)
+                return;
+            self->ws_.binary(true);
+            if (!self->cluster_.secret_.empty())
+                self->challenge();
+            self->read();
+        });
+    }
+
+private:
+    // Only written once, so it can go out while the first read is pending.
+    void challenge() {
+        nonce_.resize(challenge_size);
+        if (RAND_bytes(reinterpret_cast<unsigned char*>(nonce_.data()), static_cast<int>(nonce_.size())) != 1) {
+            nonce_.clear();
+            return;
+        }
+        ControlWriter frame(ControlOp::PeerChallenge, true);
+        frame.add(nonce_);
+        challenge_ = frame.take();
+        ws_.async_write(net::buffer(challenge_), [self = shared_from_this()](beast::error_code, std::size_t) {});
+    }
+
+    void read() {
+        ws_.async_read(buffer_, [self = shared_from_this()](beast::error_code ec, std::size_t) {
+            if (ec)
+                return;
+            auto data = self->buffer_.data();
+            std::string_view frame(static_cast<const char*>(data.data()), data.size());
+            if (!self->on_frame(frame))
+                return;
+            self->buffer_.consume(data.size());
+            self->read();
+        });
+    }
+
+    bool on_frame(std::string_view frame) {
+        if (node_ != SIZE_MAX) {
+            cluster_.on_frame(node_, frame);
+            return true;
+        }
+        try {
+            ControlReader reader(frame);
+            const uint64_t node = reader.op() == ControlOp::PeerHello ? reader.number() : SIZE_MAX;
+            const std::string_view proof = reader.more() ? reader.text() : std::string_view();
+            if (node < cluster_.nodes_.size() && node != cluster_.self_ &&
+                cluster_.nodes_[node].address() == address_ && valid_proof(node, proof)) {
+                node_ = static_cast<size_t>(node);
+                return true;
+            }
+        } catch (const std::exception&) {
+        }
+        uint64_t suppressed = 0;
+        if (frame_errors.allow(suppressed))
+            LogLine(LogLevel::Warn) << "[Cluster] Link without a valid hello closed" << LogSuppressed{suppressed};
+        return false;
+    }
+
+    bool valid_proof(uint64_t node, std::string_view proof) const {
+        if (cluster_.secret_.empty())
+            return true;
+        if (nonce_.empty())
+            return false;
+        const std::string expected = cluster_.proof(nonce_, node);
+        return proof.size() == expected.size() &&
+               CRYPTO_memcmp(proof.data(), expected.data(), expected.size()) == 0;
+    }
+
+    websocket::stream<tcp::socket> ws_;
+    Cluster& cluster_;
+    const net::ip::address address_;
+    beast::flat_buffer buffer_;
+    std::string nonce_;
+    std::string challenge_;
+    size_t node_ = SIZE_MAX;
+};
+
+Cluster::Cluster(net::io_context& ioc, MikoServer& server, std::vector<tcp::endpoint> nodes, size_t self,
+                 std::string secret)
+    : ioc_(ioc), server_(server), nodes_(std::move(nodes)), self_(self), secret_(std::move(secret)),
+      acceptor_(ioc), accept_timer_(ioc)
+{
+    if (nodes_.empty() || nodes_.size() > max_nodes || self_ >= nodes_.size()) {
+        throw std::invalid_argument("Cluster: need 1 to 64 nodes and this node's index among them");
+    }
+    for (size_t node = 0; node < nodes_.size(); ++node) {
+        const std::string name = nodes_[node].address().to_string() + ":" + std::to_string(nodes_[node].port());
+        for (size_t point = 0; point < ring_points; ++point)
+            ring_.emplace_back(ring_hash(name + "#" + std::to_string(point)), node);
+    }
+    std::sort(ring_.begin(), ring_.end());
+    links_.resize(nodes_.size());
+    for (size_t node = 0; node < nodes_.size(); ++node) {
+        if (node != self_)
+            links_[node] = std::make_shared<Link>(ioc_, *this, node, nodes_[node]);
+    }
+}
+
+Cluster::~Cluster() {
+    for (auto& link : links_) {
+        if (link)
+            link->stop();
+    }
+}
+
+tcp::endpoint Cluster::parse_endpoint(const std::string& text) {
+    const size_t colon = text.rfind(':');
+    if (colon == std::string::npos)
+        throw std::invalid_argument("Cluster endpoint without a port: " + text);
+    std::string host = text.substr(0, colon);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+    return {net::ip::make_address(host), static_cast<unsigned short>(std::stoul(text.substr(colon + 1)))};
+}
+
+void Cluster::run() {
+    const tcp::endpoint& endpoint = nodes_[self_];
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(tcp::acceptor::reuse_address(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+    do_accept();
+    for (auto& link : links_) {
+        if (link)
+            link->start();
+    }
+    LogLine(LogLevel::Info) << "[Cluster] Node " << self_ << " of " << nodes_.size() << " on " << endpoint;
+}
+
+// As in MetricsListener: a persistent error waits before the next accept,
+// and a closed acceptor, or a cluster that is gone, ends the loop.
+void Cluster::do_accept() {
+    acceptor_.async_accept(net::make_strand(ioc_), [weak = weak_from_this()](beast::error_code ec, tcp::socket socket) {
+        auto self = weak.lock();
+        if (!self || ec == net::error::operation_aborted)
+            return;
+        if (!ec) {
+            self->accept(std::move(socket));
+            self->do_accept();
+            return;
+        }
+        uint64_t suppressed = 0;
+        if (accept_errors.allow(suppressed))
+            LogLine(LogLevel::Warn) << "[Cluster] Accept error: " << ec.message() << LogSuppressed{suppressed};
+        self->accept_timer_.expires_after(accept_retry_delay);
+        self->accept_timer_.async_wait([weak](beast::error_code ec) {
+            auto self = weak.lock();
+            if (self && !ec)
+                self->do_accept();
+        });
+    });
+}
+
+void Cluster::accept(tcp::socket socket) {
+    beast::error_code ec;
+    const tcp::endpoint remote = socket.remote_endpoint(ec);
+    if (ec)
+        return;
+    if (!known_address(remote.address())) {
+        uint64_t suppressed = 0;
+        if (frame_errors.allow(suppressed))
+            LogLine(LogLevel::Warn) << "[Cluster] Refused link from " << remote.address() << LogSuppressed{suppressed};
+        return;
+    }
+    std::make_shared<Inbound>(std::move(socket), *this, remote.address())->start();
+}
+
+bool Cluster::known_address(const net::ip::address& address) const {
+    return std::any_of(nodes_.begin(), nodes_.end(), [&](const tcp::endpoint& node) {
+        return node.address() == address;
+    });
+}
+
+std::string Cluster::proof(std::string_view nonce, uint64_t node) const {
+    if (secret_.empty())
+        return {};
+    std::string message(nonce);
+    for (int i = 0; i < 8; ++i)
+        message.push_back(static_cast<char>(node >> (56 - 8 * i)));
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int size = 0;
+    HMAC(EVP_sha256(), secret_.data(), static_cast<int>(secret_.size()),
+         reinterpret_cast<const unsigned char*>(message.data()), message.size(), mac, &size);
+    return std::string(reinterpret_cast<const char*>(mac), size);
+}
+
+size_t Cluster::owner_of(std::string_view room_id) const {
+    auto it = std::lower_bound(ring_.begin(), ring_.end(), std::make_pair(ring_hash(room_id), size_t{0}));
+    return it == ring_.end() ? ring_.front().second : it->second;
+}
+
+size_t Cluster::links_up() const {
+    return static_cast<size_t>(std::count_if(links_.begin(), links_.end(), [](const auto& link) {
+        return link && link->up();
+    }));
+}
+
+void Cluster::send(size_t node, SharedBuffer frame) {
+    if (node < links_.size() && links_[node])
+        links_[node]->send(std::move(frame));
+}
+
+void Cluster::join(const std::string& room_id, const std::string& key,
+                   std::function<void(std::optional<RemoteRoom>)> done) {
+    auto timer = std::make_shared<net::steady_timer>(ioc_, join_timeout);
+    uint64_t request;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        request = next_request_++;
+        pending_.emplace(request, PendingJoin{key, std::move(done), timer});
+    }
+    timer->async_wait([this, request](beast::error_code ec) {
+        if (ec)
+            return;
+        if (auto pending = take_pending(request))
+            pending->done(std::nullopt);
+    });
+    ControlWriter frame(ControlOp::PeerJoin, true);
+    frame.add("request", request).add(room_id).add(key);
+    send(owner_of(room_id), std::make_shared<const std::string>(frame.take()));
+}
+
+std::optional<Cluster::PendingJoin> Cluster::take_pending(uint64_t request) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = pending_.find(request);
+    if (it == pending_.end())
+        return std::nullopt;
+    PendingJoin pending = std::move(it->second);
+    pending_.erase(it);
+    pending.timer->cancel();
+    return pending;
+}
+
+// Renew this node's mirrors of the rooms 'node' owns, in case it restarted.
+// The answers carry request 0 and are dropped.
+void Cluster::on_link_up(size_t node) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& [room_id, key] : mirrors_) {
+        if (owner_of(room_id) != node)
+            continue;
+        ControlWriter frame(ControlOp::PeerJoin, true);
+        frame.add("request", uint64_t{0}).add(room_id).add(key);
+        links_[node]->send(std::make_shared<const std::string>(frame.take()));
+    }
+}
+
+void Cluster::share_message(const Room& room, std::string_view nickname, std::string_view message) {
+    ControlWriter frame(ControlOp::PeerMessage, true);
+    frame.add(room.get_id()).add(nickname).add(message);
+    auto shared = std::make_shared<const std::string>(frame.take());
+    if (room.remote()) {
+        send(room.owner(), std::move(shared));
+        return;
+    }
+    for (uint64_t nodes = room.subscribers(); nodes; nodes &= nodes - 1)
+        send(static_cast<size_t>(__builtin_ctzll(nodes)), shared);
+}
+
+void Cluster::share_frame(const Room& room, std::string_view relay_frame) {
+    ControlWriter frame(ControlOp::PeerFrame, true);
+    frame.add(room.get_id()).add(relay_frame);
+    auto shared = std::make_shared<const std::string>(frame.take());
+    if (room.remote()) {
+        send(room.owner(), std::move(shared));
+        return;
+    }
+    for (uint64_t nodes = room.subscribers(); nodes; nodes &= nodes - 1)
+        send(static_cast<size_t>(__builtin_ctzll(nodes)), shared);
+}
+
+void Cluster::share_file_chunk(const Room& room, std::string_view file_frame, size_t skip) {
+    ControlWriter frame(ControlOp::PeerFile, true);
+    frame.add(room.get_id()).add(file_frame);
+    auto shared = std::make_shared<const std::string>(frame.take());
+    if (room.remote()) {
+        send(room.owner(), std::move(shared));
+        return;
+    }
+    for (uint64_t nodes = room.subscribers() & ~(uint64_t{1} << skip); nodes; nodes &= nodes - 1)
+        send(static_cast<size_t>(__builtin_ctzll(nodes)), shared);
+}
+
+// Runs on the inbound link's strand. A message for a room owned here came
+// from a mirror and is broadcast as if sent here, which shares it onwards,
+// the sender's node included; one for a mirror came from the owner and only
+// reaches local members.
+void Cluster::on_frame(size_t from, std::string_view frame) {
+    server_.metrics().cluster_frames_in.add();
+    try {
+        ControlReader reader(frame);
+        switch (reader.op()) {
+        case ControlOp::PeerJoin: {
+            const uint64_t request = reader.number();
+            std::string_view room_id = reader.text();
+            std::string_view key = reader.text();
+            Room* room = server_.get_room(room_id);
+            if (room && !room->remote() && room->get_key() == key) {
+                room->add_subscriber(from);
+                ControlWriter reply(ControlOp::PeerJoined, true);
+                reply.add("request", request).add(room_id).add(room->get_name())
+                     .add(cipher_name(room->get_cipher())).add(room->compressed() ? "deflate" : "none");
+                send(from, std::make_shared<const std::string>(reply.take()));
+            } else {
+                ControlWriter reply(ControlOp::PeerJoinFailure, true);
+                reply.add("request", request).add(room_id);
+                send(from, std::make_shared<const std::string>(reply.take()));
+            }
+            break;
+        }
+        case ControlOp::PeerJoined: {
+            const uint64_t request = reader.number();
+            RemoteRoom room;
+            room.id = std::string(reader.text());
+            room.name = std::string(reader.text());
+            if (!parse_cipher(std::string(reader.text()), room.cipher))
+                throw std::runtime_error("unknown cipher");
+            room.compressed = reader.text() == "deflate";
+            if (auto pending = take_pending(request)) {
+                room.key = pending->key;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    mirrors_.emplace(room.id, room.key);
+                }
+                pending->done(std::move(room));
+            }
+            break;
+        }
+        case ControlOp::PeerJoinFailure:
+            if (auto pending = take_pending(reader.number()))
+                pending->done(std::nullopt);
+            break;
+        case ControlOp::PeerMessage:
+        case ControlOp::PeerFrame:
+        case ControlOp::PeerFile: {
+            Room* room = server_.get_room(reader.text());
+            // Only the owner may publish to a mirror, and only mirrors send
+            // to the owner.
+            if (!room || (room->remote() ? room->owner() != from : !(room->subscribers() >> from & 1)))
+                break;
+            if (reader.op() == ControlOp::PeerMessage) {
+                std::string_view nickname = reader.text();
+                std::string_view message = reader.text();
+                if (room->remote())
+                    server_.deliver_room_message(*room, nickname, message);
+                else
+                    server_.send_room_message(*room, nickname, message);
+            } else if (reader.op() == ControlOp::PeerFile) {
+                auto file_frame = std::make_shared<const std::string>(reader.text());
+                const FileChunkView chunk = unpack_file_relay(*file_frame);
+                const std::string transfer = file_transfer_key(chunk.room_id, chunk.nickname, chunk.transfer_id);
+                if (!room->remote())
+                    share_file_chunk(*room, *file_frame, from);
+                server_.deliver_file_chunk(*room, std::move(file_frame), nullptr, transfer,
+                                           chunk.flags & file_chunk_last);
+            } else {
+                auto relay_frame = std::make_shared<const std::string>(reader.text());
+                if (room->remote())
+                    server_.deliver_relay_frame(*room, std::move(relay_frame));
+                else
+                    server_.relay_room_message(*room, std::move(relay_frame));
+            }
+            break;
+        }
+        default:
+            throw std::runtime_error("unexpected op");
+        }
+    } catch (const std::exception& e) {
+        uint64_t suppressed = 0;
+        if (frame_errors.allow(suppressed))
+            LogLine(LogLevel::Warn) << "[Cluster] Bad frame from node " << from << ": " << e.what()
+                                    << LogSuppressed{suppressed};
+    }
+}
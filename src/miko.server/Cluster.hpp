@@ -0,0 +1,125 @@
+//
+// Several miko.service processes sharing their rooms.
+//
+
+#pragma once
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "aes_encryption.h"
+
+class MikoServer;
+class Room;
+using SharedBuffer = std::shared_ptr<const std::string>;
+
+// Every node is started with the same list of cluster endpoints and its own
+// index in it. A room belongs to the node that consistent hashing of its id
+// picks, and a node only creates rooms it owns. Another node whose clients
+// join the room asks the owner to check the key, then keeps a mirror of it:
+// a local Room holding that node's members. Messages sent on a mirror go to
+// the owner, which broadcasts them to its own members and sends them once
+// to each node mirroring the room, however many members it has there.
+//
+// Nodes talk over WebSocket links carrying control frames (ControlFrame.hpp).
+// Each node dials every other one and sends its own traffic on that link; it
+// reads what the others send on the links they dial to it. A link that drops
+// is redialled, frames wait for it up to a limit, and a redialled link
+// renews the mirrors of rooms its node owns.
+//
+// A node only accepts links from the addresses of the configured nodes, and
+// a link's hello must come from the address of the node it names; links are
+// dialled from this node's own address to match. With a shared secret, the
+// accepting node also sends a random challenge, and the hello must carry its
+// HMAC-SHA256 under the secret. Links are not encrypted: room keys and
+// messages cross them in the clear.
+class Cluster : public std::enable_shared_from_this<Cluster> {
+public:
+    static constexpr size_t max_nodes = 64;
+
+    // 'nodes' is every node's cluster endpoint, this one's at 'self'.
+    // 'secret' may be empty.
+    Cluster(boost::asio::io_context& ioc, MikoServer& server, std::vector<boost::asio::ip::tcp::endpoint> nodes,
+            size_t self, std::string secret);
+    ~Cluster();
+    void run();
+
+    // "host:port", with the host an IP address.
+    static boost::asio::ip::tcp::endpoint parse_endpoint(const std::string& text);
+
+    size_t self() const { return self_; }
+    size_t owner_of(std::string_view room_id) const;
+    bool owns(std::string_view room_id) const { return owner_of(room_id) == self_; }
+    size_t links_up() const;
+
+    // What a room's owner reports to a node joining it.
+    struct RemoteRoom {
+        std::string id;
+        std::string key;
+        std::string name;
+        CipherMode cipher = CipherMode::AES_128_CBC;
+        bool compressed = false;
+    };
+
+    // Asks the owner of 'room_id' whether 'key' opens it. 'done' gets the
+    // room, or nothing when the key is wrong, the room does not exist or the
+    // owner has not answered within five seconds. It runs on a cluster
+    // thread.
+    void join(const std::string& room_id, const std::string& key,
+              std::function<void(std::optional<RemoteRoom>)> done);
+
+    // Sends a room message on to the nodes that need it: the owner, for a
+    // mirror, or every node mirroring the room, for a room owned here.
+    void share_message(const Room& room, std::string_view nickname, std::string_view message);
+    void share_frame(const Room& room, std::string_view frame);
+    // File chunks are delivered where they arrive, so they are not sent back
+    // to the node they came from, 'skip' (self() when sent here).
+    void share_file_chunk(const Room& room, std::string_view frame, size_t skip);
+
+private:
+    class Link;
+    class Inbound;
+    friend class Link;
+    friend class Inbound;
+
+    void send(size_t node, SharedBuffer frame);
+    void on_frame(size_t from, std::string_view frame);
+    void on_link_up(size_t node);
+    void do_accept();
+    void accept(boost::asio::ip::tcp::socket socket);
+    bool known_address(const boost::asio::ip::address& address) const;
+    // The hello's proof for 'nonce' from 'node': empty without a secret.
+    std::string proof(std::string_view nonce, uint64_t node) const;
+
+    struct PendingJoin {
+        std::string key;
+        std::function<void(std::optional<RemoteRoom>)> done;
+        std::shared_ptr<boost::asio::steady_timer> timer;
+    };
+    std::optional<PendingJoin> take_pending(uint64_t request);
+
+    boost::asio::io_context& ioc_;
+    MikoServer& server_;
+    const std::vector<boost::asio::ip::tcp::endpoint> nodes_;
+    const size_t self_;
+    const std::string secret_;
+    std::vector<std::pair<uint64_t, size_t>> ring_; // point, node; sorted
+    boost::asio::ip::tcp::acceptor acceptor_;
+    boost::asio::steady_timer accept_timer_; // after an accept error
+    std::vector<std::shared_ptr<Link>> links_; // by node; none for self
+
+    std::mutex mutex_;
+    uint64_t next_request_ = 1;
+    std::unordered_map<uint64_t, PendingJoin> pending_;
+    std::unordered_map<std::string, std::string> mirrors_; // room id -> key
+};
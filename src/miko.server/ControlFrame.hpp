@@ -0,0 +1,178 @@
+//
+// Binary control frames: the compact form of the text "/CMD" commands.
+//
+
+#pragma once
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include "RoomFrame.hpp"
+
+// A control frame is a version byte, an opcode byte, then fields in the room
+// frame layout: a 4-byte big-endian length followed by that many bytes.
+// Numbers are 8-byte big-endian fields. A room frame starts with the high
+// byte of its room id length, which is always 0, so both kinds of frame share
+// the binary channel.
+//
+// A client opts in by offering control_subprotocol in the WebSocket
+// handshake; the server echoes it and then sends its replies as control
+// frames too. Clients that do not offer it keep the text commands. Readers
+// skip fields past the ones they know, so a later version may append fields.
+constexpr uint8_t control_version = 0xC1;
+constexpr const char* control_subprotocol = "miko.control.v1";
+
+enum class ControlOp : uint8_t {
+    // Client to server.
+    CreateRoom = 0x01,         // name, cipher (empty for the server default) [, "deflate"]
+    JoinRoom = 0x02,           // room id, key, nickname [, "last" or "since", number]
+    Nick = 0x03,               // nickname
+    Stats = 0x04,              // admin token
+    // Node to node, on cluster links only (see Cluster.hpp).
+    PeerHello = 0x40,          // node index [, proof]
+    PeerJoin = 0x41,           // request id, room id, key
+    PeerJoined = 0x42,         // request id, room id, name, cipher, compression
+    PeerJoinFailure = 0x43,    // request id, room id
+    PeerMessage = 0x44,        // room id, nickname, text
+    PeerFrame = 0x45,          // room id, relay frame
+    PeerFile = 0x46,           // room id, file relay frame
+    PeerChallenge = 0x47,      // nonce, from the accepting node
+    // Server to client.
+    RoomCreated = 0x81,        // room id, name
+    RoomFailure = 0x82,        // reason
+    JoinSuccess = 0x83,        // room id, name, cipher, seq, replay, room handle, sender id,
+                               // compression
+    JoinFailure = 0x84,        // reason
+    NickChanged = 0x85,        // nickname
+    NickFailure = 0x86,        // reason
+    RoomMessageFailure = 0x87, // reason
+    StatsResult = 0x88,        // name, number pairs
+    StatsFailure = 0x89,       // reason
+};
+
+// The op's text command name, as in "/CMD join-success".
+inline const char* control_op_name(ControlOp op) {
+    switch (op) {
+    case ControlOp::CreateRoom: return "create-room";
+    case ControlOp::JoinRoom: return "join-room";
+    case ControlOp::Nick: return "nick";
+    case ControlOp::Stats: return "stats";
+    case ControlOp::PeerHello: return "peer-hello";
+    case ControlOp::PeerJoin: return "peer-join";
+    case ControlOp::PeerJoined: return "peer-joined";
+    case ControlOp::PeerJoinFailure: return "peer-join-failure";
+    case ControlOp::PeerMessage: return "peer-message";
+    case ControlOp::PeerFrame: return "peer-frame";
+    case ControlOp::PeerFile: return "peer-file";
+    case ControlOp::PeerChallenge: return "peer-challenge";
+    case ControlOp::RoomCreated: return "room-created";
+    case ControlOp::RoomFailure: return "room-failure";
+    case ControlOp::JoinSuccess: return "join-success";
+    case ControlOp::JoinFailure: return "join-failure";
+    case ControlOp::NickChanged: return "nick-changed";
+    case ControlOp::NickFailure: return "nick-failure";
+    case ControlOp::RoomMessageFailure: return "room-message-failure";
+    case ControlOp::StatsResult: return "stats-result";
+    case ControlOp::StatsFailure: return "stats-failure";
+    }
+    return "unknown";
+}
+
+inline bool is_control_frame(std::string_view frame) {
+    return !frame.empty() && static_cast<uint8_t>(frame[0]) == control_version;
+}
+
+// Builds one control message, as a binary frame or as the equivalent text
+// command: "/CMD <name>" followed by the fields, space separated, keyed ones
+// as "key=value". Keys only appear in the text form.
+class ControlWriter {
+public:
+    ControlWriter(ControlOp op, bool binary) : binary_(binary) {
+        out_.reserve(128); // one allocation for a typical message
+        if (binary_) {
+            out_.push_back(static_cast<char>(control_version));
+            out_.push_back(static_cast<char>(op));
+        } else {
+            out_.append("/CMD ").append(control_op_name(op));
+        }
+    }
+
+    ControlWriter& add(std::string_view value) {
+        if (binary_)
+            pack_view(out_, value);
+        else
+            out_.append(" ").append(value);
+        return *this;
+    }
+
+    ControlWriter& add(std::string_view key, std::string_view value) {
+        if (!binary_)
+            out_.append(" ").append(key).append("=").append(value);
+        else
+            add(value);
+        return *this;
+    }
+
+    ControlWriter& add(std::string_view key, uint64_t value) {
+        if (!binary_) {
+            out_.append(" ").append(key).append("=").append(std::to_string(value));
+            return *this;
+        }
+        char field[12];
+        const uint32_t len = htonl(8);
+        std::memcpy(field, &len, 4);
+        for (int i = 0; i < 8; ++i)
+            field[4 + i] = static_cast<char>(value >> (56 - 8 * i));
+        out_.append(field, sizeof(field));
+        return *this;
+    }
+
+    // A keyed number whose key the binary form carries too, as a text field
+    // before the number, for replies without a fixed field list.
+    ControlWriter& add_named(std::string_view key, uint64_t value) {
+        if (binary_)
+            pack_view(out_, key);
+        return add(key, value);
+    }
+
+    bool binary() const { return binary_; }
+    std::string take() { return std::move(out_); }
+
+private:
+    bool binary_;
+    std::string out_;
+};
+
+// Reads a binary control frame in place; the views it returns point into
+// the frame. Malformed input throws std::runtime_error.
+class ControlReader {
+public:
+    explicit ControlReader(std::string_view frame) : frame_(frame) {
+        if (frame_.size() < 2 || !is_control_frame(frame_))
+            throw std::runtime_error("Invalid control frame");
+        op_ = static_cast<ControlOp>(static_cast<uint8_t>(frame_[1]));
+        offset_ = 2;
+    }
+
+    ControlOp op() const { return op_; }
+    bool more() const { return offset_ < frame_.size(); }
+
+    std::string_view text() { return unpack_view(frame_, offset_); }
+
+    uint64_t number() {
+        std::string_view field = unpack_view(frame_, offset_);
+        if (field.size() != 8)
+            throw std::runtime_error("Invalid control frame: bad number field");
+        uint64_t value = 0;
+        for (unsigned char byte : field)
+            value = value << 8 | byte;
+        return value;
+    }
+
+private:
+    std::string_view frame_;
+    size_t offset_ = 0;
+    ControlOp op_{};
+};
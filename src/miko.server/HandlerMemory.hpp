@@ -0,0 +1,94 @@
+//
+// Per-connection memory for Asio completion handlers.
+//
+
+#pragma once
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// One slot of memory for the operations on one path of a connection, its
+// reads or its writes. Asio and Beast allocate each operation's state
+// through the handler's associated allocator; a handler bound to a
+// HandlerMemory gets the slot instead of the heap. A path has one
+// operation in flight at a time and Asio frees an operation before calling
+// its handler, so the slot is normally free when the next one starts. An
+// allocation that finds it taken, or does not fit, falls back to the heap.
+// Not thread-safe: each path's operations run one after another.
+class HandlerMemory {
+public:
+    static constexpr size_t size = 1024;
+
+    HandlerMemory() = default;
+    HandlerMemory(const HandlerMemory&) = delete;
+    HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+    void* allocate(size_t bytes) {
+        if (!in_use_ && bytes <= size) {
+            in_use_ = true;
+            return &storage_;
+        }
+        return ::operator new(bytes);
+    }
+
+    void deallocate(void* p) noexcept {
+        if (p == &storage_)
+            in_use_ = false;
+        else
+            ::operator delete(p);
+    }
+
+private:
+    std::aligned_storage_t<size, alignof(std::max_align_t)> storage_;
+    bool in_use_ = false;
+};
+
+template <typename T>
+class HandlerAllocator {
+public:
+    using value_type = T;
+
+    explicit HandlerAllocator(HandlerMemory& memory) noexcept : memory_(&memory) {}
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U>& other) noexcept : memory_(other.memory_) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(memory_->allocate(sizeof(T) * n)); }
+    void deallocate(T* p, size_t) noexcept { memory_->deallocate(p); }
+
+    template <typename U>
+    bool operator==(const HandlerAllocator<U>& other) const noexcept { return memory_ == other.memory_; }
+    template <typename U>
+    bool operator!=(const HandlerAllocator<U>& other) const noexcept { return memory_ != other.memory_; }
+
+private:
+    template <typename U>
+    friend class HandlerAllocator;
+    HandlerMemory* memory_;
+};
+
+// Wraps a completion handler so operations started with it allocate from
+// 'memory'. The handler's executor is left alone.
+template <typename Handler>
+class MemoryBoundHandler {
+public:
+    using allocator_type = HandlerAllocator<Handler>;
+
+    MemoryBoundHandler(HandlerMemory& memory, Handler handler) : memory_(memory), handler_(std::move(handler)) {}
+
+    allocator_type get_allocator() const noexcept { return allocator_type(memory_); }
+
+    template <typename... Args>
+    void operator()(Args&&... args) {
+        handler_(std::forward<Args>(args)...);
+    }
+
+private:
+    HandlerMemory& memory_;
+    Handler handler_;
+};
+
+template <typename Handler>
+MemoryBoundHandler<std::decay_t<Handler>> bind_handler_memory(HandlerMemory& memory, Handler&& handler) {
+    return MemoryBoundHandler<std::decay_t<Handler>>(memory, std::forward<Handler>(handler));
+}
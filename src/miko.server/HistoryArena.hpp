@@ -0,0 +1,125 @@
+//
+// Fixed-capacity ring of messages for a room's in-memory history.
+//
+// Messages are stored back to back in one byte buffer, indexed by a ring of
+// (offset, length) entries. Appending past either limit evicts the oldest
+// messages by advancing the head; nothing is freed per message. A message
+// never wraps: when it does not fit before the end of the buffer it starts
+// again at offset 0. The buffer and index are allocated at full size on the
+// first append but left untouched, so a quiet room only costs the pages it
+// has written.
+//
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+
+class HistoryArena {
+public:
+    // Entries hold 32-bit offsets, so the capacity is at most 4 GiB.
+    HistoryArena(size_t capacity_bytes, size_t max_messages) : capacity_(capacity_bytes) {
+        if (capacity_bytes > UINT32_MAX)
+            throw std::invalid_argument("History cache larger than 4 GiB");
+        // A power of two, so ring positions are a mask away.
+        while (index_size_ < max_messages)
+            index_size_ *= 2;
+    }
+
+    size_t size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+    size_t capacity_bytes() const { return capacity_; }
+
+    // The i-th oldest message; valid until the next push_back.
+    std::string_view operator[](size_t i) const {
+        const Entry& entry = index_[(first_ + i) & (index_size_ - 1)];
+        return {data_.get() + entry.offset, entry.length};
+    }
+
+    // Append, evicting the oldest messages as needed. A message larger than
+    // the whole arena is not kept, and empties it: the arena then holds no
+    // message older than the next one, so what it holds stays consecutive.
+    void push_back(std::string_view message) {
+        if (message.size() > capacity_) {
+            count_ = 0;
+            return;
+        }
+        if (!data_) {
+            data_.reset(new char[capacity_]);
+            index_.reset(new Entry[index_size_]);
+        }
+        if (count_ == index_size_)
+            pop_front();
+        size_t offset;
+        while (!place(message.size(), offset))
+            pop_front();
+        if (!message.empty())
+            std::memcpy(data_.get() + offset, message.data(), message.size());
+        index_[(first_ + count_) & (index_size_ - 1)] = Entry{static_cast<uint32_t>(offset),
+                                                             static_cast<uint32_t>(message.size())};
+        tail_ = offset + message.size();
+        ++count_;
+
+        // With many rooms, a room's buffer is long out of cache by its next
+        // message, and the stores would stall fetching the lines they land
+        // in. Prefetch the likely next position and the index slots the
+        // next append touches. Written out here: GCC 12 drops prefetches
+        // from an inlined helper.
+        const char* next = data_.get() + (tail_ + prefetch_bytes <= capacity_ ? tail_ : 0);
+        if (capacity_ >= prefetch_bytes) {
+            __builtin_prefetch(next, 1);
+            __builtin_prefetch(next + 64, 1);
+            __builtin_prefetch(next + 128, 1);
+            __builtin_prefetch(next + 192, 1);
+        }
+        __builtin_prefetch(&index_[(first_ + count_) & (index_size_ - 1)], 1);
+        __builtin_prefetch(&index_[(first_ + 1) & (index_size_ - 1)], 0);
+    }
+
+    void pop_front() {
+        first_ = (first_ + 1) & (index_size_ - 1);
+        --count_;
+    }
+
+    void clear() { count_ = 0; }
+
+private:
+    struct Entry {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    static constexpr size_t prefetch_bytes = 256; // four lines; a typical chat line
+
+    // Find room for 'size' bytes after the newest message.
+    bool place(size_t size, size_t& offset) const {
+        if (count_ == 0) {
+            offset = 0;
+            return size <= capacity_;
+        }
+        const size_t head = index_[first_].offset;
+        if (tail_ > head) {
+            // Live bytes are [head, tail): use the end, else wrap to the start.
+            if (size <= capacity_ - tail_) {
+                offset = tail_;
+                return true;
+            }
+            offset = 0;
+            return size <= head;
+        }
+        // Wrapped: live bytes are [head, end) and [0, tail).
+        offset = tail_;
+        return size <= head - tail_;
+    }
+
+    size_t capacity_;
+    std::unique_ptr<char[]> data_;
+    std::unique_ptr<Entry[]> index_;
+    size_t index_size_ = 1;
+    size_t first_ = 0; // index_ slot of the oldest message
+    size_t count_ = 0;
+    size_t tail_ = 0;  // end of the newest message
+};
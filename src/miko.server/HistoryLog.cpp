@@ -0,0 +1,286 @@
+//
+// Append-only, segmented, memory-mapped message log for one room.
+//
+
+#include "HistoryLog.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+static constexpr size_t kHeaderSize = sizeof(uint32_t);
+
+static void check(bool ok, const std::string& what) {
+    if (!ok) {
+        throw std::runtime_error(what + ": " + std::strerror(errno));
+    }
+}
+
+static std::string meta_path(const std::string& dir) {
+    return dir + "/room.meta";
+}
+
+HistoryLog::HistoryLog(std::string dir, Options options)
+    : dir_(std::move(dir)), options_(options) {}
+
+HistoryLog::~HistoryLog() {
+    for (auto& segment : segments_) {
+        unmap(segment);
+    }
+}
+
+std::unique_ptr<HistoryLog> HistoryLog::create(const std::string& dir, const RoomMeta& meta, Options options) {
+    fs::create_directories(dir);
+    if (fs::exists(meta_path(dir))) {
+        throw std::runtime_error("History already exists in " + dir);
+    }
+    // One field per line, so none may contain a line break.
+    for (const std::string* field : {&meta.id, &meta.name, &meta.cipher, &meta.key, &meta.compression}) {
+        if (field->find_first_of("\r\n") != std::string::npos) {
+            throw std::invalid_argument("Line break in room metadata");
+        }
+    }
+    // Written aside and renamed into place so a crash never leaves a torn
+    // meta file that would hide the room on restart.
+    const std::string temp = meta_path(dir) + ".tmp";
+    std::ofstream out(temp);
+    out << meta.id << '\n' << meta.name << '\n' << meta.cipher << '\n' << meta.key << '\n' << meta.compression << '\n';
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Cannot write " + temp);
+    }
+    // The room key is in there.
+    fs::permissions(temp, fs::perms::owner_read | fs::perms::owner_write);
+    fs::rename(temp, meta_path(dir));
+
+    std::unique_ptr<HistoryLog> log(new HistoryLog(dir, options));
+    log->meta_ = meta;
+    Segment segment;
+    segment.path = log->segment_path(0);
+    log->segments_.push_back(segment);
+    log->open_active(log->segments_.back());
+    return log;
+}
+
+std::unique_ptr<HistoryLog> HistoryLog::open(const std::string& dir, Options options) {
+    std::unique_ptr<HistoryLog> log(new HistoryLog(dir, options));
+    std::ifstream in(meta_path(dir));
+    RoomMeta& meta = log->meta_;
+    if (!std::getline(in, meta.id) || !std::getline(in, meta.name) || !std::getline(in, meta.cipher) ||
+        !std::getline(in, meta.key)) {
+        throw std::runtime_error("Missing or truncated " + meta_path(dir));
+    }
+    // Absent in logs written before rooms had a compression policy.
+    if (!std::getline(in, meta.compression) || meta.compression.empty()) {
+        meta.compression = "none";
+    }
+
+    std::vector<uint64_t> starts;
+    for (const auto& entry : fs::directory_iterator(dir)) {
+        if (entry.path().extension() == ".log") {
+            starts.push_back(std::stoull(entry.path().stem().string()));
+        }
+    }
+    std::sort(starts.begin(), starts.end());
+    if (starts.empty()) {
+        starts.push_back(0);
+    }
+
+    // Every segment is opened as if active so a torn tail can be repaired in
+    // place; all but the last are then sealed again.
+    for (uint64_t first_seq : starts) {
+        Segment segment;
+        segment.first_seq = first_seq;
+        segment.path = log->segment_path(first_seq);
+        log->segments_.push_back(segment);
+        log->open_active(log->segments_.back());
+        log->recover(log->segments_.back());
+    }
+    for (size_t i = 0; i + 1 < log->segments_.size(); ++i) {
+        log->seal(log->segments_[i]);
+    }
+    return log;
+}
+
+uint64_t HistoryLog::first_seq() const {
+    return segments_.front().first_seq;
+}
+
+uint64_t HistoryLog::next_seq() const {
+    const Segment& active = segments_.back();
+    return active.first_seq + active.count;
+}
+
+uint64_t HistoryLog::append(std::string_view message) {
+    if (message.empty()) {
+        throw std::invalid_argument("Empty history record.");
+    }
+    if (kHeaderSize + message.size() > options_.segment_bytes) {
+        throw std::invalid_argument("Message larger than a history segment.");
+    }
+    Segment* active = &segments_.back();
+    if (active->count == active->idx_size || active->bytes + kHeaderSize + message.size() > active->log_size) {
+        roll();
+        active = &segments_.back();
+    }
+
+    // Payload first, then the zero header that terminates the log after this
+    // record, then this record's length, then its index entry. A crash at any
+    // point leaves either the old tail or a complete record behind.
+    char* record = active->log + active->bytes;
+    const size_t end = active->bytes + kHeaderSize + message.size();
+    std::memcpy(record + kHeaderSize, message.data(), message.size());
+    if (end + kHeaderSize <= active->log_size) {
+        std::memset(active->log + end, 0, kHeaderSize);
+    }
+    std::atomic_signal_fence(std::memory_order_release);
+    const auto length = static_cast<uint32_t>(message.size());
+    std::memcpy(record, &length, kHeaderSize);
+    std::atomic_signal_fence(std::memory_order_release);
+    active->idx[active->count] = end;
+
+    active->bytes = end;
+    return active->first_seq + active->count++;
+}
+
+std::string_view HistoryLog::read(uint64_t seq) const {
+    const Segment& segment = segment_for(seq);
+    const uint64_t i = seq - segment.first_seq;
+    const size_t start = i == 0 ? 0 : segment.idx[i - 1];
+    return {segment.log + start + kHeaderSize, segment.idx[i] - start - kHeaderSize};
+}
+
+const HistoryLog::Segment& HistoryLog::segment_for(uint64_t seq) const {
+    auto it = std::upper_bound(segments_.begin(), segments_.end(), seq,
+                               [](uint64_t s, const Segment& segment) { return s < segment.first_seq; });
+    if (it == segments_.begin() || seq - std::prev(it)->first_seq >= std::prev(it)->count) {
+        throw std::out_of_range("History sequence " + std::to_string(seq) + " not in log.");
+    }
+    return *std::prev(it);
+}
+
+std::string HistoryLog::segment_path(uint64_t first_seq) const {
+    std::ostringstream path;
+    path << dir_ << '/' << std::setw(20) << std::setfill('0') << first_seq;
+    return path.str();
+}
+
+// Open (creating if needed) a segment's files, grow them to the configured
+// capacity and map them read/write.
+void HistoryLog::open_active(Segment& segment) {
+    segment.log_fd = ::open((segment.path + ".log").c_str(), O_RDWR | O_CREAT, 0600);
+    check(segment.log_fd >= 0, "Cannot open " + segment.path + ".log");
+    segment.idx_fd = ::open((segment.path + ".idx").c_str(), O_RDWR | O_CREAT, 0600);
+    check(segment.idx_fd >= 0, "Cannot open " + segment.path + ".idx");
+
+    struct stat st {};
+    check(::fstat(segment.log_fd, &st) == 0, "Cannot stat " + segment.path + ".log");
+    segment.log_size = std::max<size_t>(st.st_size, options_.segment_bytes);
+    check(::fstat(segment.idx_fd, &st) == 0, "Cannot stat " + segment.path + ".idx");
+    segment.idx_size = std::max<size_t>(st.st_size / sizeof(uint64_t), options_.segment_records);
+
+    // Sparse: untouched capacity costs no disk or memory.
+    check(::ftruncate(segment.log_fd, segment.log_size) == 0, "Cannot size " + segment.path + ".log");
+    check(::ftruncate(segment.idx_fd, segment.idx_size * sizeof(uint64_t)) == 0,
+          "Cannot size " + segment.path + ".idx");
+
+    void* log = ::mmap(nullptr, segment.log_size, PROT_READ | PROT_WRITE, MAP_SHARED, segment.log_fd, 0);
+    check(log != MAP_FAILED, "Cannot map " + segment.path + ".log");
+    segment.log = static_cast<char*>(log);
+    void* idx = ::mmap(nullptr, segment.idx_size * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+                       segment.idx_fd, 0);
+    check(idx != MAP_FAILED, "Cannot map " + segment.path + ".idx");
+    segment.idx = static_cast<uint64_t*>(idx);
+}
+
+// Find the end of a segment reopened after a restart: trust index entries
+// that agree with the record headers, then pick up complete records the
+// index missed, and clear everything after.
+void HistoryLog::recover(Segment& segment) {
+    uint64_t count = 0;
+    size_t end = 0;
+    while (count < segment.idx_size && segment.idx[count] > end && segment.idx[count] <= segment.log_size) {
+        uint32_t length = 0;
+        std::memcpy(&length, segment.log + end, kHeaderSize);
+        if (end + kHeaderSize + length != segment.idx[count]) break;
+        end = segment.idx[count++];
+    }
+    while (count < segment.idx_size && end + kHeaderSize <= segment.log_size) {
+        uint32_t length = 0;
+        std::memcpy(&length, segment.log + end, kHeaderSize);
+        if (length == 0 || end + kHeaderSize + length > segment.log_size) break;
+        end += kHeaderSize + length;
+        segment.idx[count++] = end;
+    }
+    for (uint64_t i = count; i < segment.idx_size && segment.idx[i] != 0; ++i) {
+        segment.idx[i] = 0;
+    }
+    if (end + kHeaderSize <= segment.log_size) {
+        std::memset(segment.log + end, 0, kHeaderSize);
+    }
+    segment.count = count;
+    segment.bytes = end;
+}
+
+// Trim a full segment to its contents and remap it read-only.
+void HistoryLog::seal(Segment& segment) {
+    ::munmap(segment.log, segment.log_size);
+    ::munmap(segment.idx, segment.idx_size * sizeof(uint64_t));
+    segment.log = nullptr;
+    segment.idx = nullptr;
+    check(::ftruncate(segment.log_fd, segment.bytes) == 0, "Cannot trim " + segment.path + ".log");
+    check(::ftruncate(segment.idx_fd, segment.count * sizeof(uint64_t)) == 0, "Cannot trim " + segment.path + ".idx");
+    segment.log_size = segment.bytes;
+    segment.idx_size = segment.count;
+    if (segment.count > 0) {
+        void* log = ::mmap(nullptr, segment.log_size, PROT_READ, MAP_SHARED, segment.log_fd, 0);
+        check(log != MAP_FAILED, "Cannot map " + segment.path + ".log");
+        segment.log = static_cast<char*>(log);
+        void* idx = ::mmap(nullptr, segment.idx_size * sizeof(uint64_t), PROT_READ, MAP_SHARED, segment.idx_fd, 0);
+        check(idx != MAP_FAILED, "Cannot map " + segment.path + ".idx");
+        segment.idx = static_cast<uint64_t*>(idx);
+    }
+    ::close(segment.log_fd);
+    ::close(segment.idx_fd);
+    segment.log_fd = segment.idx_fd = -1;
+}
+
+void HistoryLog::roll() {
+    Segment& active = segments_.back();
+    seal(active);
+    Segment next;
+    next.first_seq = active.first_seq + active.count;
+    next.path = segment_path(next.first_seq);
+    segments_.push_back(next);
+    open_active(segments_.back());
+
+    while (options_.retain_segments > 0 && segments_.size() > options_.retain_segments) {
+        Segment& oldest = segments_.front();
+        unmap(oldest);
+        fs::remove(oldest.path + ".log");
+        fs::remove(oldest.path + ".idx");
+        segments_.pop_front();
+    }
+}
+
+void HistoryLog::unmap(Segment& segment) {
+    if (segment.log) ::munmap(segment.log, segment.log_size);
+    if (segment.idx) ::munmap(segment.idx, segment.idx_size * sizeof(uint64_t));
+    if (segment.log_fd >= 0) ::close(segment.log_fd);
+    if (segment.idx_fd >= 0) ::close(segment.idx_fd);
+    segment.log = nullptr;
+    segment.idx = nullptr;
+    segment.log_fd = segment.idx_fd = -1;
+}
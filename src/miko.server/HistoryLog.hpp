@@ -0,0 +1,93 @@
+//
+// Append-only, segmented, memory-mapped message log for one room.
+//
+// Layout of a room directory:
+//   room.meta                id, name, cipher and key, one per line
+//   <first seq>.log          records: [u32 length][bytes]; length 0 ends the log
+//   <first seq>.idx          u64 end offset of each record in the .log
+//
+// Sequence numbers are per room and never reused. The active segment's two
+// files are preallocated and mapped read/write; sealed segments are truncated
+// to their contents and mapped read-only. Looking up a sequence number is a
+// binary search over the (few) segments, then one index read.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+
+class HistoryLog {
+public:
+    struct Options {
+        size_t segment_bytes = 64 * 1024 * 1024; // .log capacity
+        size_t segment_records = 65536;          // .idx capacity
+        size_t retain_segments = 0;              // oldest are deleted past this; 0 keeps all
+    };
+
+    struct RoomMeta {
+        std::string id;
+        std::string name;
+        std::string cipher;
+        std::string key;
+        std::string compression = "none"; // payload compression, see Room
+    };
+
+    // Start a log for a new room in 'dir', which is created.
+    static std::unique_ptr<HistoryLog> create(const std::string& dir, const RoomMeta& meta, Options options);
+
+    // Reopen a room's log. A record torn by a crash is dropped, and index
+    // entries missing for complete records are rebuilt.
+    static std::unique_ptr<HistoryLog> open(const std::string& dir, Options options);
+
+    ~HistoryLog();
+    HistoryLog(const HistoryLog&) = delete;
+    HistoryLog& operator=(const HistoryLog&) = delete;
+
+    const RoomMeta& meta() const { return meta_; }
+    const std::string& dir() const { return dir_; }
+    const Options& options() const { return options_; }
+
+    // Oldest retained sequence number, and the one the next append gets.
+    uint64_t first_seq() const;
+    uint64_t next_seq() const;
+
+    // Append a message and return its sequence number.
+    uint64_t append(std::string_view message);
+
+    // The message with sequence number 'seq', which must be in
+    // [first_seq(), next_seq()). The view is valid until the next append.
+    std::string_view read(uint64_t seq) const;
+
+private:
+    struct Segment {
+        uint64_t first_seq = 0;
+        uint64_t count = 0;       // records written
+        size_t bytes = 0;         // .log bytes in use
+        std::string path;         // without extension
+        int log_fd = -1;
+        int idx_fd = -1;
+        char* log = nullptr;
+        size_t log_size = 0;      // mapped bytes
+        uint64_t* idx = nullptr;
+        size_t idx_size = 0;      // mapped entries
+    };
+
+    HistoryLog(std::string dir, Options options);
+
+    void open_active(Segment& segment);
+    void recover(Segment& segment);
+    void seal(Segment& segment);
+    void roll();
+    static void unmap(Segment& segment);
+    const Segment& segment_for(uint64_t seq) const;
+    std::string segment_path(uint64_t first_seq) const;
+
+    std::string dir_;
+    Options options_;
+    RoomMeta meta_;
+    std::deque<Segment> segments_; // oldest first; the back one is active
+};
@@ -0,0 +1,118 @@
+//
+// Leveled logging that never blocks the caller.
+//
+
+#include "Logger.hpp"
+#include <chrono>
+#include <cstdio>
+
+bool parse_log_level(const std::string& name, LogLevel& level) {
+    static const std::pair<const char*, LogLevel> levels[] = {
+        {"debug", LogLevel::Debug}, {"info", LogLevel::Info}, {"warn", LogLevel::Warn},
+        {"error", LogLevel::Error}, {"off", LogLevel::Off},
+    };
+    for (const auto& [level_name, value] : levels) {
+        if (name == level_name) {
+            level = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+Logger& Logger::instance() {
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() : slots_(new Slot[capacity]) {
+    for (size_t i = 0; i < capacity; ++i)
+        slots_[i].sequence.store(i, std::memory_order_relaxed);
+    thread_ = std::thread([this] { run(); });
+}
+
+Logger::~Logger() {
+    stop_.store(true, std::memory_order_relaxed);
+    thread_.join();
+}
+
+void Logger::write(LogLevel level, std::string line) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+        Slot& slot = slots_[pos & (capacity - 1)];
+        const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        const auto diff = static_cast<std::ptrdiff_t>(sequence - pos);
+        if (diff == 0) {
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.level = level;
+                slot.line = std::move(line);
+                slot.sequence.store(pos + 1, std::memory_order_release);
+                return;
+            }
+        } else if (diff < 0) {
+            // Full: the writer is a whole queue behind.
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            dropped_total_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// Writes every line queued so far; false if there were none.
+bool Logger::write_batch() {
+    bool out = false;
+    bool err = false;
+    for (;;) {
+        Slot& slot = slots_[dequeue_pos_ & (capacity - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != dequeue_pos_ + 1)
+            break;
+        const bool to_stderr = slot.level >= LogLevel::Warn;
+        std::FILE* file = to_stderr ? stderr : stdout;
+        std::fwrite(slot.line.data(), 1, slot.line.size(), file);
+        std::fputc('\n', file);
+        (to_stderr ? err : out) = true;
+        slot.line = std::string(); // release long lines
+        slot.sequence.store(dequeue_pos_ + capacity, std::memory_order_release);
+        ++dequeue_pos_;
+    }
+    if (const uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed)) {
+        std::fprintf(stderr, "[Log] %llu lines dropped\n", static_cast<unsigned long long>(dropped));
+        err = true;
+    }
+    if (out)
+        std::fflush(stdout);
+    if (err)
+        std::fflush(stderr);
+    written_.store(dequeue_pos_, std::memory_order_release);
+    return out || err;
+}
+
+void Logger::run() {
+    while (!stop_.load(std::memory_order_relaxed)) {
+        if (!write_batch())
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    write_batch();
+}
+
+void Logger::flush() {
+    const size_t target = enqueue_pos_.load(std::memory_order_relaxed);
+    while (written_.load(std::memory_order_acquire) < target)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+bool LogRateLimit::allow(uint64_t& suppressed) {
+    using namespace std::chrono;
+    const int64_t now = duration_cast<seconds>(steady_clock::now().time_since_epoch()).count();
+    int64_t window = window_.load(std::memory_order_relaxed);
+    if (window != now && window_.compare_exchange_strong(window, now, std::memory_order_relaxed))
+        count_.store(0, std::memory_order_relaxed);
+    if (count_.fetch_add(1, std::memory_order_relaxed) < per_second_) {
+        suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+    suppressed_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
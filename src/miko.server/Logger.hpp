@@ -0,0 +1,128 @@
+//
+// Leveled logging that never blocks the caller.
+//
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+
+enum class LogLevel { Debug, Info, Warn, Error, Off };
+
+// "debug", "info", "warn", "error" or "off".
+bool parse_log_level(const std::string& name, LogLevel& level);
+
+// Lines go into a fixed-size lock-free queue and a background thread writes
+// them out, Debug and Info to stdout and Warn and Error to stderr, flushing
+// once per batch. A full queue drops the line and counts it instead of
+// waiting; the count is reported with the next batch. Lines queued when the
+// process exits are written by the destructor.
+class Logger {
+public:
+    static Logger& instance();
+
+    bool enabled(LogLevel level) const { return level >= threshold_.load(std::memory_order_relaxed); }
+    LogLevel level() const { return threshold_.load(std::memory_order_relaxed); }
+    void set_level(LogLevel level) { threshold_.store(level, std::memory_order_relaxed); }
+
+    void write(LogLevel level, std::string line);
+
+    // Blocks until every line queued before the call has been written.
+    void flush();
+
+    // Lines dropped on a full queue since startup.
+    uint64_t dropped() const { return dropped_total_.load(std::memory_order_relaxed); }
+
+    ~Logger();
+
+private:
+    Logger();
+    void run();
+    bool write_batch();
+
+    // A bounded multi-producer queue after Dmitry Vyukov's: each slot's
+    // sequence number says whether it is free for the producer at that
+    // position or holds a line for the consumer.
+    struct Slot {
+        std::atomic<size_t> sequence;
+        LogLevel level;
+        std::string line;
+    };
+    static constexpr size_t capacity = 16384; // a power of two
+
+    std::unique_ptr<Slot[]> slots_;
+    alignas(64) std::atomic<size_t> enqueue_pos_{0};
+    alignas(64) size_t dequeue_pos_ = 0; // the writer thread only
+    std::atomic<size_t> written_{0};     // lines taken off the queue
+    std::atomic<uint64_t> dropped_{0};       // not yet reported
+    std::atomic<uint64_t> dropped_total_{0};
+    std::atomic<LogLevel> threshold_{LogLevel::Info};
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
+
+// One line, built with << and queued at the end of the statement:
+//
+//     LogLine(LogLevel::Info) << "[Room Created] ID: " << room_id;
+//
+// Nothing is formatted when the level is disabled.
+class LogLine {
+public:
+    explicit LogLine(LogLevel level) : level_(level) {
+        if (Logger::instance().enabled(level))
+            stream_.emplace();
+    }
+    ~LogLine() {
+        if (stream_)
+            Logger::instance().write(level_, stream_->str());
+    }
+    LogLine(const LogLine&) = delete;
+    LogLine& operator=(const LogLine&) = delete;
+
+    template <typename T>
+    LogLine& operator<<(const T& value) {
+        if (stream_)
+            *stream_ << value;
+        return *this;
+    }
+
+private:
+    LogLevel level_;
+    std::optional<std::ostringstream> stream_;
+};
+
+// Lets at most 'per_second' lines a second through from one call site and
+// counts the rest; allow() hands the count to the next line let through.
+// Keep one as a static next to the log statement it guards.
+class LogRateLimit {
+public:
+    explicit LogRateLimit(uint32_t per_second) : per_second_(per_second) {}
+
+    bool allow(uint64_t& suppressed);
+
+private:
+    const uint32_t per_second_;
+    std::atomic<int64_t> window_{-1}; // the current second
+    std::atomic<uint32_t> count_{0};  // lines in that second
+    std::atomic<uint64_t> suppressed_{0};
+};
+
+// Appends " (N similar suppressed)" to a line when N is not 0:
+//
+//     static LogRateLimit limit(10);
+//     uint64_t suppressed = 0;
+//     if (limit.allow(suppressed))
+//         LogLine(LogLevel::Warn) << "Send error: " << message << LogSuppressed{suppressed};
+struct LogSuppressed {
+    uint64_t count;
+};
+
+inline std::ostream& operator<<(std::ostream& out, LogSuppressed s) {
+    if (s.count)
+        out << " (" << s.count << " similar suppressed)";
+    return out;
+}
@@ -0,0 +1,184 @@
+//
+// Counters, gauges and latency histograms, rendered for Prometheus.
+//
+
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Updates are single relaxed atomic operations, safe from any thread.
+class Counter {
+public:
+    void add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+// Log-linear buckets in the style of HdrHistogram: values below 8 get a
+// bucket each, and every power of two above is split into 8 buckets, so a
+// bucket is at most 12.5% wide. Recording is two relaxed atomic adds and a
+// max update; readers sum the buckets, so a snapshot taken while other
+// threads record is still consistent with itself.
+class LatencyHistogram {
+public:
+    static constexpr int sub_bits = 3;
+    static constexpr uint64_t sub_buckets = uint64_t{1} << sub_bits;
+    static constexpr size_t bucket_count = (64 - sub_bits + 1) * sub_buckets;
+
+    static size_t bucket_of(uint64_t value) {
+        if (value < sub_buckets)
+            return static_cast<size_t>(value);
+        const int shift = 63 - __builtin_clzll(value) - sub_bits;
+        return static_cast<size_t>((shift + 1) * sub_buckets + ((value >> shift) & (sub_buckets - 1)));
+    }
+
+    // One past the largest value that lands in 'bucket'.
+    static uint64_t bucket_end(size_t bucket) {
+        if (bucket < sub_buckets)
+            return bucket + 1;
+        const int shift = static_cast<int>(bucket / sub_buckets) - 1;
+        const uint64_t sub = bucket % sub_buckets;
+        return (sub_buckets + sub + 1) << shift;
+    }
+
+    void record(uint64_t value) {
+        buckets_[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (const auto& bucket : buckets_)
+            total += bucket.load(std::memory_order_relaxed);
+        return total;
+    }
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+    // Recorded values below 'limit'; exact when 'limit' is a bucket edge,
+    // such as any power of two.
+    uint64_t count_below(uint64_t limit) const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < bucket_count && bucket_end(i) <= limit; ++i)
+            total += buckets_[i].load(std::memory_order_relaxed);
+        return total;
+    }
+
+    // The upper edge of the bucket holding the p-th quantile, capped at max().
+    uint64_t percentile(double p) const {
+        const uint64_t total = count();
+        if (total == 0)
+            return 0;
+        const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucket_count; ++i) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return std::min(bucket_end(i) - 1, max());
+        }
+        return max();
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, bucket_count> buckets_{};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
+
+// Names the metrics for export. Metrics are registered once, before the
+// server runs, and the registry only holds pointers to them, so it needs no
+// lock: reading it races only with the metrics' own atomic updates. Gauges
+// are computed when read.
+class MetricsRegistry {
+public:
+    void add(std::string name, std::string help, const Counter& counter) {
+        entries_.push_back({std::move(name), std::move(help), &counter, nullptr, {}});
+    }
+    void add(std::string name, std::string help, const LatencyHistogram& histogram) {
+        entries_.push_back({std::move(name), std::move(help), nullptr, &histogram, {}});
+    }
+    void add(std::string name, std::string help, std::function<uint64_t()> gauge) {
+        entries_.push_back({std::move(name), std::move(help), nullptr, nullptr, std::move(gauge)});
+    }
+
+    // Every value as a name and a number: counters and gauges as they are,
+    // histograms as _count and, in nanoseconds, _p50_ns, _p99_ns, _p999_ns
+    // and _max_ns, with a "_seconds" suffix dropped from the name.
+    void for_each_value(const std::function<void(std::string_view, uint64_t)>& fn) const {
+        for (const Entry& entry : entries_) {
+            if (entry.counter) {
+                fn(entry.name, entry.counter->value());
+            } else if (entry.gauge) {
+                fn(entry.name, entry.gauge());
+            } else {
+                const LatencyHistogram& h = *entry.histogram;
+                std::string base = entry.name;
+                const std::string unit = "_seconds";
+                if (base.size() > unit.size() && base.compare(base.size() - unit.size(), unit.size(), unit) == 0)
+                    base.resize(base.size() - unit.size());
+                fn(base + "_count", h.count());
+                fn(base + "_p50_ns", h.percentile(0.50));
+                fn(base + "_p99_ns", h.percentile(0.99));
+                fn(base + "_p999_ns", h.percentile(0.999));
+                fn(base + "_max_ns", h.max());
+            }
+        }
+    }
+
+    // Prometheus text exposition format 0.0.4. Histograms are recorded in
+    // nanoseconds and exported in seconds, with a bucket per power of two
+    // from about 1 us to 17 s.
+    std::string render_prometheus() const {
+        std::string out;
+        for (const Entry& entry : entries_) {
+            const char* type = entry.counter ? "counter" : entry.gauge ? "gauge" : "histogram";
+            out.append("# HELP ").append(entry.name).append(" ").append(entry.help).append("\n");
+            out.append("# TYPE ").append(entry.name).append(" ").append(type).append("\n");
+            if (!entry.histogram) {
+                const uint64_t value = entry.counter ? entry.counter->value() : entry.gauge();
+                out.append(entry.name).append(" ").append(std::to_string(value)).append("\n");
+                continue;
+            }
+            const LatencyHistogram& h = *entry.histogram;
+            for (int bits = 10; bits <= 34; ++bits) {
+                const uint64_t limit = uint64_t{1} << bits;
+                out.append(entry.name).append("_bucket{le=\"").append(seconds(limit)).append("\"} ");
+                out.append(std::to_string(h.count_below(limit))).append("\n");
+            }
+            const uint64_t count = h.count();
+            out.append(entry.name).append("_bucket{le=\"+Inf\"} ").append(std::to_string(count)).append("\n");
+            out.append(entry.name).append("_sum ").append(seconds(h.sum())).append("\n");
+            out.append(entry.name).append("_count ").append(std::to_string(count)).append("\n");
+        }
+        return out;
+    }
+
+private:
+    struct Entry {
+        std::string name;
+        std::string help;
+        const Counter* counter;
+        const LatencyHistogram* histogram;
+        std::function<uint64_t()> gauge;
+    };
+
+    static std::string seconds(uint64_t ns) {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.9g", static_cast<double>(ns) / 1e9);
+        return buffer;
+    }
+
+    std::vector<Entry> entries_;
+};
@@ -0,0 +1,97 @@
+//
+// Plain-text Prometheus endpoint on a local port.
+//
+
+#include "MetricsListener.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include <boost/asio/strand.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+namespace net = boost::asio;
+namespace beast = boost::beast;
+namespace http = beast::http;
+using tcp = net::ip::tcp;
+
+namespace {
+
+// After a failed accept, such as one that ran out of file descriptors.
+constexpr auto accept_retry_delay = std::chrono::milliseconds(100);
+
+// One scrape: read the request, write the response, close.
+struct Exchange : std::enable_shared_from_this<Exchange> {
+    Exchange(tcp::socket socket, const MetricsRegistry& registry)
+        : stream(std::move(socket)), registry(registry) {}
+
+    void start() {
+        stream.expires_after(std::chrono::seconds(10));
+        http::async_read(stream, buffer, request, [self = shared_from_this()](beast::error_code ec, std::size_t) {
+            if (ec) return;
+            self->respond();
+        });
+    }
+
+    void respond() {
+        response.version(request.version());
+        response.keep_alive(false);
+        if (request.method() == http::verb::get && request.target() == "/metrics") {
+            response.result(http::status::ok);
+            response.set(http::field::content_type, "text/plain; version=0.0.4");
+            response.body() = registry.render_prometheus();
+        } else {
+            response.result(http::status::not_found);
+            response.set(http::field::content_type, "text/plain");
+            response.body() = "Not found\n";
+        }
+        response.prepare_payload();
+        http::async_write(stream, response, [self = shared_from_this()](beast::error_code, std::size_t) {
+            beast::error_code ignored;
+            self->stream.socket().shutdown(tcp::socket::shutdown_send, ignored);
+        });
+    }
+
+    beast::tcp_stream stream;
+    const MetricsRegistry& registry;
+    beast::flat_buffer buffer;
+    http::request<http::string_body> request;
+    http::response<http::string_body> response;
+};
+
+} // namespace
+
+MetricsListener::MetricsListener(net::io_context& ioc, tcp::endpoint endpoint, const MetricsRegistry& registry)
+    : ioc_(ioc), acceptor_(ioc, endpoint), retry_timer_(ioc), registry_(registry)
+{}
+
+void MetricsListener::run() {
+    do_accept();
+}
+
+tcp::endpoint MetricsListener::local_endpoint() const {
+    return acceptor_.local_endpoint();
+}
+
+// Errors that persist, like running out of file descriptors, would fail
+// every accept at once; wait a little before the next one instead of
+// spinning. A closed acceptor ends the loop.
+void MetricsListener::do_accept() {
+    acceptor_.async_accept(net::make_strand(ioc_), [self = shared_from_this()](beast::error_code ec, tcp::socket socket) {
+        if (!ec) {
+            std::make_shared<Exchange>(std::move(socket), self->registry_)->start();
+            self->do_accept();
+            return;
+        }
+        if (ec == net::error::operation_aborted)
+            return;
+        static LogRateLimit limit(10);
+        uint64_t suppressed = 0;
+        if (limit.allow(suppressed))
+            LogLine(LogLevel::Warn) << "[Metrics] Accept error: " << ec.message() << LogSuppressed{suppressed};
+        self->retry_timer_.expires_after(accept_retry_delay);
+        self->retry_timer_.async_wait([self](beast::error_code ec) {
+            if (!ec)
+                self->do_accept();
+        });
+    });
+}
@@ -0,0 +1,30 @@
+//
+// Plain-text Prometheus endpoint on a local port.
+//
+
+#pragma once
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <memory>
+
+class MetricsRegistry;
+
+// Answers GET /metrics with the registry in Prometheus text format; anything
+// else gets 404. One request per connection. Runs on the server's
+// io_context, so keep it on a loopback address.
+class MetricsListener : public std::enable_shared_from_this<MetricsListener> {
+public:
+    MetricsListener(boost::asio::io_context& ioc, boost::asio::ip::tcp::endpoint endpoint,
+                    const MetricsRegistry& registry);
+    void run();
+    boost::asio::ip::tcp::endpoint local_endpoint() const;
+
+private:
+    void do_accept();
+
+    boost::asio::io_context& ioc_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    boost::asio::steady_timer retry_timer_; // after an accept error
+    const MetricsRegistry& registry_;
+};
@@ -3,10 +3,13 @@
 //
 
 #include "MikoServer.hpp"
+#include "Logger.hpp"
 #include "Session.hpp"
-#include <iostream>
+#include <algorithm>
+#include <filesystem>
 #include <random>
 #include <sstream>
+#include <stdexcept>
 
 static std::string generate_random_string(size_t length) {
     const char charset[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
@@ -19,76 +22,509 @@ static std::string generate_random_string(size_t length) {
     return str;
 }
 
-MikoServer::MikoServer(net::io_context& ioc, tcp::endpoint endpoint)
-    : acceptor_(ioc, endpoint), socket_(ioc)
-{}
+#ifdef SO_REUSEPORT
+using reuse_port = net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+MikoServer::MikoServer(net::io_context& ioc, tcp::endpoint endpoint, ServerConfig config)
+    : config_(config)
+{
+    acceptors_.push_back(std::make_unique<Acceptor>(Acceptor{ioc, tcp::acceptor(ioc, endpoint)}));
+    init();
+}
+
+MikoServer::MikoServer(const std::vector<net::io_context*>& contexts, tcp::endpoint endpoint, ServerConfig config)
+    : config_(config)
+{
+    if (contexts.empty()) {
+        throw std::invalid_argument("MikoServer needs at least one io_context");
+    }
+#ifdef SO_REUSEPORT
+    for (net::io_context* ioc : contexts) {
+        tcp::acceptor acceptor(*ioc);
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(tcp::acceptor::reuse_address(true));
+        acceptor.set_option(reuse_port(true));
+        acceptor.bind(endpoint);
+        acceptor.listen();
+        if (endpoint.port() == 0) {
+            endpoint = acceptor.local_endpoint();
+        }
+        acceptors_.push_back(std::make_unique<Acceptor>(Acceptor{*ioc, std::move(acceptor)}));
+    }
+#else
+    (void)contexts;
+    (void)endpoint;
+    throw std::runtime_error("SO_REUSEPORT is not available on this platform");
+#endif
+    init();
+}
+
+static LogRateLimit accept_errors(10);
+static constexpr auto accept_retry_delay = std::chrono::milliseconds(100);
+
+// Room id, nickname and framing around a message in the history, beyond
+// read_message_max. A longer nickname only costs that message its place in
+// the cache; the log still gets it.
+static constexpr size_t history_frame_overhead = 4096;
+
+void MikoServer::init() {
+    if (config_.history_cache_bytes < config_.read_message_max + history_frame_overhead) {
+        throw std::invalid_argument("--history-cache-bytes must be at least --read-message-max plus " +
+                                    std::to_string(history_frame_overhead));
+    }
+    if (config_.history_cache_bytes > UINT32_MAX) {
+        throw std::invalid_argument("--history-cache-bytes must be at most 4 GiB");
+    }
+    if (!config_.cluster_nodes.empty()) {
+        std::vector<tcp::endpoint> nodes;
+        for (const std::string& node : config_.cluster_nodes) {
+            nodes.push_back(Cluster::parse_endpoint(node));
+        }
+        cluster_ = std::make_shared<Cluster>(acceptors_.front()->ioc, *this, std::move(nodes), config_.cluster_self,
+                                             config_.cluster_secret);
+    }
+    if (config_.deflate && config_.deflate_threshold > 0 && !deflate_threshold_supported()) {
+        LogLine(LogLevel::Warn) << "[Deflate] This Boost.Beast has no message size threshold; "
+                                   "every message is compressed";
+    }
+    register_metrics();
+    if (!config_.history_dir.empty()) {
+        recover_rooms();
+    }
+}
+
+void MikoServer::register_metrics() {
+    registry_.add("miko_sessions", "Open sessions.", [this] {
+        uint64_t sessions = 0;
+        for (SessionShard& shard : session_shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            sessions += shard.sessions.size();
+        }
+        return sessions;
+    });
+    registry_.add("miko_rooms", "Rooms.", [this] {
+        uint64_t rooms = 0;
+        for (const RoomShard& shard : room_shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            rooms += shard.rooms.size();
+        }
+        return rooms;
+    });
+    registry_.add("miko_history_log_failures_total", "Failed room history log appends and reopens.", [this] {
+        uint64_t failures = 0;
+        for (const RoomShard& shard : room_shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            for (const auto& [id, room] : shard.rooms)
+                failures += room->log_failures();
+        }
+        return failures;
+    });
+    registry_.add("miko_history_logs_down", "Rooms whose history log is behind after a failure.", [this] {
+        uint64_t down = 0;
+        for (const RoomShard& shard : room_shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            for (const auto& [id, room] : shard.rooms)
+                down += room->log_down();
+        }
+        return down;
+    });
+    registry_.add("miko_send_queue_bytes", "Bytes waiting in session send queues.", [this] {
+        uint64_t bytes = 0;
+        for (SessionShard& shard : session_shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (const auto& session : shard.sessions)
+                bytes += session->queued_bytes();
+        }
+        return bytes;
+    });
+    registry_.add("miko_send_queue_frames", "Frames waiting in session send queues.", [this] {
+        uint64_t frames = 0;
+        for (SessionShard& shard : session_shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (const auto& session : shard.sessions)
+                frames += session->queue_depth();
+        }
+        return frames;
+    });
+    registry_.add("miko_sessions_opened_total", "Sessions accepted.", metrics_.sessions_opened);
+    registry_.add("miko_sessions_reaped_total", "Sessions closed by a handshake or idle timeout.",
+                  metrics_.sessions_reaped);
+    registry_.add("miko_session_pool_free", "Session blocks kept for reuse.",
+                  [this] { return static_cast<uint64_t>(session_pool_->free_blocks()); });
+    registry_.add("miko_session_pool_reused_total", "Sessions allocated from a recycled block.",
+                  session_pool_->blocks_reused());
+    registry_.add("miko_read_buffers_reused_total", "Sessions given a recycled read buffer.",
+                  session_pool_->buffers_reused());
+    registry_.add("miko_room_messages_total", "Room messages received.", metrics_.room_messages);
+    registry_.add("miko_chunked_messages_total", "Chunked room messages received; each piece is a room message.",
+                  metrics_.chunked_messages);
+    registry_.add("miko_messages_too_big_total", "Messages over the size limit, whose sessions were closed.",
+                  metrics_.messages_too_big);
+    registry_.add("miko_deliveries_total", "Room messages queued to members.", metrics_.deliveries);
+    registry_.add("miko_bytes_in_total", "WebSocket message bytes read.", metrics_.bytes_in);
+    registry_.add("miko_bytes_out_total", "WebSocket message bytes written.", metrics_.bytes_out);
+    registry_.add("miko_decrypt_failures_total", "Room messages that failed to decrypt.",
+                  metrics_.decrypt_failures);
+    registry_.add("miko_frames_rate_limited_total", "Room messages refused by a room's rate limit.",
+                  metrics_.rate_limited);
+    registry_.add("miko_file_chunks_total", "File chunks received; relayed without history.", metrics_.file_chunks);
+    registry_.add("miko_file_waits_total", "Times a sender's file chunks waited for the room's members.",
+                  metrics_.file_waits);
+    registry_.add("miko_file_drops_total", "Members dropped from a file transfer for falling behind.",
+                  metrics_.file_drops);
+    registry_.add("miko_reads_paused_total", "Reads delayed by a session's rate limit.", metrics_.reads_paused);
+    registry_.add("miko_cluster_frames_in_total", "Frames read from other nodes.", metrics_.cluster_frames_in);
+    registry_.add("miko_cluster_frames_out_total", "Frames written to other nodes.", metrics_.cluster_frames_out);
+    registry_.add("miko_cluster_frames_dropped_total", "Frames dropped because a link's queue was full.",
+                  metrics_.cluster_frames_dropped);
+    registry_.add("miko_cluster_links_up", "Links to other nodes that are connected.", [this] {
+        return cluster_ ? static_cast<uint64_t>(cluster_->links_up()) : 0;
+    });
+    registry_.add("miko_send_errors_total", "Failed writes.", metrics_.send_errors);
+    registry_.add("miko_frames_dropped_total", "Frames refused by a full send queue.", metrics_.frames_dropped);
+    registry_.add("miko_deflate_sessions_total", "Closed sessions that used permessage-deflate.",
+                  metrics_.deflate_sessions);
+    registry_.add("miko_deflate_payload_bytes_total", "Message bytes written by those sessions.",
+                  metrics_.deflate_payload_bytes);
+    registry_.add("miko_deflate_wire_bytes_total", "Bytes those sessions' sockets sent.",
+                  metrics_.deflate_wire_bytes);
+    registry_.add("miko_deflate_cpu_ns_total", "CPU time those sessions spent starting writes.",
+                  metrics_.deflate_cpu_ns);
+    registry_.add("miko_log_lines_dropped", "Log lines dropped by a full log queue.",
+                  [] { return Logger::instance().dropped(); });
+    registry_.add("miko_receive_to_broadcast_seconds",
+                  "Time from reading a room message to queueing it to every member.",
+                  metrics_.receive_to_broadcast_ns);
+}
+
+HistoryLog::Options MikoServer::history_options() const {
+    HistoryLog::Options options;
+    options.segment_bytes = config_.history_segment_bytes;
+    options.retain_segments = config_.history_retain_segments;
+    return options;
+}
+
+void MikoServer::recover_rooms() {
+    namespace fs = std::filesystem;
+    if (!fs::is_directory(config_.history_dir)) {
+        return;
+    }
+    for (const auto& entry : fs::directory_iterator(config_.history_dir)) {
+        if (!entry.is_directory()) continue;
+        try {
+            auto log = HistoryLog::open(entry.path().string(), history_options());
+            HistoryLog::RoomMeta meta = log->meta();
+            CipherMode cipher;
+            if (!parse_cipher(meta.cipher, cipher)) {
+                throw std::runtime_error("Unknown cipher " + meta.cipher);
+            }
+            const uint64_t messages = log->next_seq() - log->first_seq();
+            insert_room(std::make_shared<Room>(meta.id, meta.key, meta.name, cipher, meta.compression == "deflate",
+                                               std::move(log), config_.history_cache_bytes));
+            LogLine(LogLevel::Info) << "[Room Recovered] ID: " << meta.id << " Name: " << meta.name
+                                    << " Messages: " << messages;
+        } catch (const std::exception& e) {
+            LogLine(LogLevel::Warn) << "[History] Skipping " << entry.path().string() << ": " << e.what();
+        }
+    }
+}
 
 void MikoServer::run() {
-    do_accept();
+    for (auto& acceptor : acceptors_) {
+        do_accept(*acceptor);
+    }
+    if (cluster_) {
+        cluster_->run();
+    }
+    if (config_.metrics_port != 0) {
+        tcp::endpoint endpoint{net::ip::make_address("127.0.0.1"), config_.metrics_port};
+        metrics_listener_ = std::make_shared<MetricsListener>(acceptors_.front()->ioc, endpoint, registry_);
+        metrics_listener_->run();
+        LogLine(LogLevel::Info) << "[Metrics] http://" << metrics_listener_->local_endpoint() << "/metrics";
+    }
+}
+
+tcp::endpoint MikoServer::local_endpoint() const {
+    return acceptors_.front()->acceptor.local_endpoint();
 }
 
-void MikoServer::do_accept() {
-    acceptor_.async_accept(socket_, [this](boost::system::error_code ec) {
+const char* MikoServer::io_backend() {
+#if defined(BOOST_ASIO_HAS_IO_URING_AS_DEFAULT)
+    return "io_uring";
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+    return "epoll";
+#elif defined(BOOST_ASIO_HAS_KQUEUE)
+    return "kqueue";
+#elif defined(BOOST_ASIO_HAS_IOCP)
+    return "iocp";
+#else
+    return "select";
+#endif
+}
+
+// Errors that persist, like running out of file descriptors, would fail
+// every accept at once; wait a little before the next one instead of
+// spinning. A closed acceptor, or a server that is gone, ends the loop.
+void MikoServer::do_accept(Acceptor& acceptor) {
+    // Every connection gets its own strand, so its handlers never run
+    // concurrently even when the io_context is run from several threads.
+    acceptor.acceptor.async_accept(net::make_strand(acceptor.ioc),
+                                   [weak = weak_from_this(), &acceptor](boost::system::error_code ec,
+                                                                        Session::socket_type socket) {
+        auto self = weak.lock();
+        if (!self || ec == net::error::operation_aborted)
+            return;
         if (!ec) {
-            std::make_shared<Session>(std::move(socket_), shared_from_this())->start();
+            std::allocate_shared<Session>(PoolAllocator<Session>(self->session_pool_), std::move(socket), self)
+                ->start();
+            self->do_accept(acceptor);
+            return;
         }
-        do_accept();
+        uint64_t suppressed = 0;
+        if (accept_errors.allow(suppressed))
+            LogLine(LogLevel::Warn) << "[Server] Accept error: " << ec.message() << LogSuppressed{suppressed};
+        acceptor.retry_timer.expires_after(accept_retry_delay);
+        acceptor.retry_timer.async_wait([weak, &acceptor](boost::system::error_code ec) {
+            auto self = weak.lock();
+            if (self && !ec)
+                self->do_accept(acceptor);
+        });
     });
 }
 
 std::string MikoServer::create_room(const std::string& name) {
-    std::string room_id = generate_random_string(8);
-    std::string room_key = generate_random_string(16);
+    return create_room(name, config_.default_cipher);
+}
+
+std::string MikoServer::create_room(const std::string& name, CipherMode cipher, bool compressed) {
+    // In a cluster, a node only creates rooms it owns.
+    std::string room_id;
+    do {
+        room_id = generate_random_string(8);
+    } while (cluster_ && !cluster_->owns(room_id));
+    std::string room_key = generate_random_string(cipher_key_size(cipher));
     std::string room_name = name.empty() ? room_id : name;
-    auto room = std::make_shared<Room>(room_id, room_key, room_name);
-    {
-        std::lock_guard<std::mutex> lock(mutex_);
-        rooms_.emplace(room_id, room);
+    std::unique_ptr<HistoryLog> log;
+    if (!config_.history_dir.empty()) {
+        try {
+            log = HistoryLog::create(config_.history_dir + "/" + room_id,
+                                     {room_id, room_name, cipher_name(cipher), room_key,
+                                      compressed ? "deflate" : "none"},
+                                     history_options());
+        } catch (const std::exception& e) {
+            LogLine(LogLevel::Warn) << "[History] Room " << room_id << " kept in memory only: " << e.what();
+        }
     }
-    std::cout << "[Room Created] ID: " << room_id << " Name: " << room_name << " Key: " << room_key << std::endl;
+    insert_room(std::make_shared<Room>(room_id, room_key, room_name, cipher, compressed, std::move(log),
+                                       config_.history_cache_bytes));
+    LogLine(LogLevel::Info) << "[Room Created] ID: " << room_id << " Name: " << room_name << " Key: " << room_key
+                            << " Cipher: " << cipher_name(cipher) << (compressed ? " Compressed" : "");
     return room_id;
 }
 
 bool MikoServer::join_room(const std::string& room_id, const std::string& room_key,
-                             std::shared_ptr<Session> session, const std::string& nickname) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    auto it = rooms_.find(room_id);
-    if (it == rooms_.end() || it->second->get_key() != room_key) {
+                             std::shared_ptr<Session> session, const std::string& nickname,
+                             const JoinCallback& on_joined) {
+    Room* room = find_room(room_id);
+    if (!room || room->get_key() != room_key) {
         return false;
     }
-    std::cout << "[User Joined] Room: " << room_id << " Nickname: " << nickname << std::endl;
+    // Switching rooms: drop the session from the previous room's member list.
+    const std::string& previous = session->get_room();
+    if (!previous.empty() && previous != room_id) {
+        if (Room* prev = find_room(previous)) {
+            prev->remove_member(session);
+        }
+    }
+    session->join_room(room_id);
+    // Broadcasts hold the room's lock too, so no message can slip in between
+    // the sequence number read here and the member's first live delivery.
+    room->add_member(session, [&](uint64_t first_seq, uint64_t next_seq) {
+        if (on_joined) {
+            on_joined(*room, first_seq, next_seq);
+        }
+    });
+    LogLine(LogLevel::Info) << "[User Joined] Room: " << room_id << " Nickname: " << nickname;
     return true;
 }
 
-void MikoServer::send_room_message(const std::string& room_id, const std::string& nickname, const std::string& message) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    auto it = rooms_.find(room_id);
-    if (it == rooms_.end()) return;
-    std::string full_message = "[" + nickname + "]: " + message;
-    it->second->add_message(full_message);
-    // Broadcast to sessions that are in the same room.
-    for (auto& session : sessions_) {
-        if (session->get_room() == room_id) {
-            session->send(full_message);
+void MikoServer::send_room_message(std::string_view room_id, std::string_view nickname, std::string_view message) {
+    if (Room* room = find_room(room_id)) {
+        send_room_message(*room, nickname, message);
+    }
+}
+
+void MikoServer::send_room_message(Room& room, std::string_view nickname, std::string_view message) {
+    if (cluster_) {
+        cluster_->share_message(room, nickname, message);
+        if (room.remote()) {
+            return;
         }
     }
+    deliver_room_message(room, nickname, message);
+}
+
+void MikoServer::deliver_room_message(Room& room, std::string_view nickname, std::string_view message) {
+    // Build the line once; every member's queue shares the same buffer.
+    std::string line;
+    line.reserve(nickname.size() + message.size() + 4);
+    line.append("[").append(nickname).append("]: ").append(message);
+    auto full_message = std::make_shared<const std::string>(std::move(line));
+    // Broadcast only to the room's own members.
+    uint64_t deliveries = 0;
+    room.publish(*full_message, [&](const std::shared_ptr<Session>& session, uint64_t seq) {
+        session->send_chat(full_message, seq);
+        ++deliveries;
+    });
+    metrics_.deliveries.add(deliveries);
+}
+
+void MikoServer::relay_room_message(std::string_view room_id, SharedBuffer frame) {
+    if (Room* room = find_room(room_id)) {
+        relay_room_message(*room, std::move(frame));
+    }
+}
+
+void MikoServer::relay_room_message(Room& room, SharedBuffer frame) {
+    if (cluster_) {
+        cluster_->share_frame(room, *frame);
+        if (room.remote()) {
+            return;
+        }
+    }
+    deliver_relay_frame(room, std::move(frame));
+}
+
+void MikoServer::deliver_relay_frame(Room& room, SharedBuffer frame) {
+    uint64_t deliveries = 0;
+    room.publish(*frame, [&](const std::shared_ptr<Session>& session, uint64_t) {
+        session->send_relay(frame);
+        ++deliveries;
+    });
+    metrics_.deliveries.add(deliveries);
+}
+
+size_t MikoServer::relay_file_chunk(Room& room, SharedBuffer frame, const Session* sender, std::string_view transfer,
+                                    bool last) {
+    metrics_.file_chunks.add();
+    if (cluster_)
+        cluster_->share_file_chunk(room, *frame, cluster_->self());
+    return deliver_file_chunk(room, std::move(frame), sender, transfer, last);
+}
+
+size_t MikoServer::deliver_file_chunk(Room& room, SharedBuffer frame, const Session* sender,
+                                      std::string_view transfer, bool last) {
+    uint64_t deliveries = 0;
+    size_t backlog = 0;
+    room.for_each_member([&](const std::shared_ptr<Session>& session) {
+        if (session.get() == sender || !session->send_file_chunk(frame, transfer, last))
+            return;
+        backlog = std::max(backlog, session->file_queued_bytes());
+        ++deliveries;
+    });
+    metrics_.deliveries.add(deliveries);
+    return backlog;
 }
 
-const Room* MikoServer::get_room(const std::string& room_id) const {
-    std::lock_guard<std::mutex> lock(mutex_);
-    auto it = rooms_.find(room_id);
-    if (it != rooms_.end()) {
-        return it->second.get();
+bool MikoServer::watch_file_backlog(Room& room, const std::shared_ptr<Session>& sender, std::string_view transfer) {
+    bool behind = false;
+    room.for_each_member([&](const std::shared_ptr<Session>& session) {
+        if (session != sender && session->watch_file_drain(sender, transfer))
+            behind = true;
+    });
+    return behind;
+}
+
+void MikoServer::drop_file_laggards(Room& room, const Session* sender, const std::string& frame,
+                                    std::string_view transfer) {
+    room.for_each_member([&](const std::shared_ptr<Session>& session) {
+        if (session.get() != sender && session->file_queued_bytes() > config_.file_window_bytes)
+            session->drop_file_transfer(frame, transfer);
+    });
+}
+
+Room* MikoServer::add_mirror(const Cluster::RemoteRoom& remote) {
+    if (Room* room = find_room(remote.id)) {
+        return room;
     }
-    return nullptr;
+    auto room = std::make_shared<Room>(remote.id, remote.key, remote.name, remote.cipher, remote.compressed, nullptr,
+                                       config_.history_cache_bytes);
+    room->set_owner(cluster_->owner_of(remote.id));
+    insert_room(room);
+    LogLine(LogLevel::Info) << "[Room Mirrored] ID: " << remote.id << " Name: " << remote.name << " Owner: node "
+                            << room->owner();
+    // Another session may have inserted the same room first.
+    return find_room(remote.id);
+}
+
+const Room* MikoServer::get_room(std::string_view room_id) const {
+    return find_room(room_id);
+}
+
+Room* MikoServer::get_room(std::string_view room_id) {
+    return find_room(room_id);
+}
+
+Room* MikoServer::find_room(std::string_view room_id) const {
+    const RoomShard& shard = room_shards_[std::hash<std::string_view>{}(room_id) % shard_count];
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.rooms.find(room_id);
+    return it != shard.rooms.end() ? it->second.get() : nullptr;
+}
+
+void MikoServer::insert_room(std::shared_ptr<Room> room) {
+    room->rate_limit().configure(config_.room_rate, config_.room_burst);
+    std::string_view id = room->get_id();
+    RoomShard& shard = room_shards_[std::hash<std::string_view>{}(id) % shard_count];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    shard.rooms.emplace(id, std::move(room));
+}
+
+MikoServer::SessionShard& MikoServer::session_shard(const std::shared_ptr<Session>& session) {
+    return session_shards_[std::hash<std::shared_ptr<Session>>{}(session) % shard_count];
 }
 
 void MikoServer::add_session(std::shared_ptr<Session> session) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    sessions_.insert(session);
+    metrics_.sessions_opened.add();
+    SessionShard& shard = session_shard(session);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.sessions.insert(std::move(session));
 }
 
 void MikoServer::remove_session(std::shared_ptr<Session> session) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    sessions_.erase(session);
-}
\ No newline at end of file
+    {
+        SessionShard& shard = session_shard(session);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.sessions.erase(session);
+    }
+    const std::string& room_id = session->get_room();
+    if (!room_id.empty()) {
+        if (Room* room = find_room(room_id)) {
+            room->remove_member(session);
+        }
+    }
+}
+
+void MikoServer::record_deflate(uint64_t payload_bytes, uint64_t wire_bytes, uint64_t cpu_ns) {
+    metrics_.deflate_sessions.add();
+    metrics_.deflate_payload_bytes.add(payload_bytes);
+    metrics_.deflate_wire_bytes.add(wire_bytes);
+    metrics_.deflate_cpu_ns.add(cpu_ns);
+    const uint64_t payload = metrics_.deflate_payload_bytes.value();
+    const uint64_t wire = metrics_.deflate_wire_bytes.value();
+    const uint64_t cpu = metrics_.deflate_cpu_ns.value();
+    LogLine(LogLevel::Info) << "[Deflate] Session: " << payload_bytes << " -> " << wire_bytes << " bytes, "
+                            << cpu_ns / 1000 << " us; total ratio "
+                            << (payload ? static_cast<double>(wire) / payload : 1.0) << ", "
+                            << (payload ? static_cast<double>(cpu) / payload : 0.0) << " ns/byte";
+}
+
+MikoServer::DeflateStats MikoServer::deflate_stats() const {
+    DeflateStats stats;
+    stats.sessions = metrics_.deflate_sessions.value();
+    stats.payload_bytes = metrics_.deflate_payload_bytes.value();
+    stats.wire_bytes = metrics_.deflate_wire_bytes.value();
+    stats.cpu_ns = metrics_.deflate_cpu_ns.value();
+    return stats;
+}
@@ -5,45 +5,197 @@
 #pragma once
 #include <boost/asio.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <array>
+#include <functional>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
-#include <set>
+#include <unordered_set>
+#include <vector>
 #include <mutex>
+#include <shared_mutex>
+#include "Cluster.hpp"
+#include "Metrics.hpp"
+#include "MetricsListener.hpp"
 #include "Room.hpp"
+#include "ServerConfig.hpp"
+#include "Session.hpp"
+#include "SessionPool.hpp"
 
 namespace net = boost::asio;
 using tcp = net::ip::tcp;
 
-class Session; // Forward declaration.
-
 class MikoServer : public std::enable_shared_from_this<MikoServer> {
 public:
-    MikoServer(net::io_context& ioc, tcp::endpoint endpoint);
+    MikoServer(net::io_context& ioc, tcp::endpoint endpoint, ServerConfig config = {});
+    // One SO_REUSEPORT acceptor per io_context, all bound to 'endpoint', so
+    // the kernel spreads incoming connections across them; a connection is
+    // served on the io_context that accepted it. With port 0 the first
+    // acceptor picks the port and the others join it.
+    MikoServer(const std::vector<net::io_context*>& contexts, tcp::endpoint endpoint, ServerConfig config = {});
     void run();
+    tcp::endpoint local_endpoint() const;
+    const ServerConfig& config() const { return config_; }
+
+    // The Asio backend this build waits on sockets with: "io_uring" when
+    // built with MIKO_IO_URING, otherwise "epoll" on Linux.
+    static const char* io_backend();
 
-    // Create a room; if 'name' is empty, use room_id as the name.
+    // Create a room; if 'name' is empty, use room_id as the name. The room
+    // key is sized for the cipher, which defaults to config().default_cipher.
+    // 'compressed' has clients compress message text before encryption.
     std::string create_room(const std::string& name = "");
+    std::string create_room(const std::string& name, CipherMode cipher, bool compressed = false);
 
-    // Join room: requires room_id, room_key, and updates the session's state.
+    // Join room: requires room_id, room_key, and updates the session's state
+    // (leaving its previous room's member list, if any). 'on_joined' gets the
+    // room, its oldest available and next sequence numbers, and runs under
+    // the room's lock before any broadcast can reach the new member; it must
+    // not call the room's locking members.
+    using JoinCallback = std::function<void(Room&, uint64_t first_seq, uint64_t next_seq)>;
     bool join_room(const std::string& room_id, const std::string& room_key,
-                   std::shared_ptr<Session> session, const std::string& nickname);
+                   std::shared_ptr<Session> session, const std::string& nickname,
+                   const JoinCallback& on_joined = {});
+
+    // Broadcast a room message. The Room& forms skip the lookup, for callers
+    // that resolved the room already. In a cluster the message also goes to
+    // the other nodes in the room; on a mirror, it goes to the owner, which
+    // sends it back.
+    void send_room_message(std::string_view room_id, std::string_view nickname, std::string_view message);
+    void send_room_message(Room& room, std::string_view nickname, std::string_view message);
+
+    // Relay mode: forward a still-encrypted room frame to the members as is.
+    void relay_room_message(std::string_view room_id, SharedBuffer frame);
+    void relay_room_message(Room& room, SharedBuffer frame);
 
-    // Broadcast a room message.
-    void send_room_message(const std::string& room_id, const std::string& nickname, const std::string& message);
+    // To this node's members only, for messages the cluster brings in.
+    void deliver_room_message(Room& room, std::string_view nickname, std::string_view message);
+    void deliver_relay_frame(Room& room, SharedBuffer frame);
 
-    const Room* get_room(const std::string& room_id) const;
+    // A file chunk goes to every member but its sender, here and on the other
+    // nodes in the room, and is kept out of the history. 'transfer' is its
+    // file_transfer_key. Both return the largest file backlog among the
+    // local members it was queued to (Session::file_queued_bytes); members
+    // dropped from the transfer no longer count.
+    size_t relay_file_chunk(Room& room, SharedBuffer frame, const Session* sender, std::string_view transfer,
+                            bool last);
+    size_t deliver_file_chunk(Room& room, SharedBuffer frame, const Session* sender, std::string_view transfer,
+                              bool last);
+    // Has the members over the file window tell 'sender' when they are back
+    // under it (Session::on_file_drained); false if none is over it.
+    bool watch_file_backlog(Room& room, const std::shared_ptr<Session>& sender, std::string_view transfer);
+    // Drops 'transfer' for the members still over the window. 'frame' is
+    // one of its chunks, from which their abort chunk is made.
+    void drop_file_laggards(Room& room, const Session* sender, const std::string& frame, std::string_view transfer);
+
+    // With config().cluster_nodes; null otherwise.
+    Cluster* cluster() { return cluster_.get(); }
+
+    // The local mirror of a room another node owns, created on first use.
+    Room* add_mirror(const Cluster::RemoteRoom& remote);
+
+    // Rooms are never removed, so the pointer stays valid for the server's
+    // lifetime.
+    const Room* get_room(std::string_view room_id) const;
+    Room* get_room(std::string_view room_id);
 
     void add_session(std::shared_ptr<Session> session);
     void remove_session(std::shared_ptr<Session> session);
 
+    // Operational counters, updated without locks from any thread. The
+    // registry also has gauges computed when read: sessions, rooms, and the
+    // bytes and frames waiting in send queues.
+    struct ServerMetrics {
+        Counter sessions_opened;
+        Counter sessions_reaped;   // closed by a handshake or idle timeout
+        Counter room_messages;     // room messages received
+        Counter chunked_messages;  // chunked room messages, each also counted per piece above
+        Counter file_chunks;       // file chunks received; not room messages
+        Counter file_waits;        // times a sender's file chunks waited for members to catch up
+        Counter file_drops;        // members dropped from a file transfer
+        Counter messages_too_big;  // over read_message_max; the session is closed
+        Counter deliveries;        // room messages queued to members
+        Counter bytes_in;
+        Counter bytes_out;
+        Counter decrypt_failures;
+        Counter send_errors;
+        Counter frames_dropped;    // send queue overflows
+        Counter rate_limited;      // refused by a room's rate limit
+        Counter reads_paused;      // delayed by a session's rate limit
+        Counter cluster_frames_in;
+        Counter cluster_frames_out;
+        Counter cluster_frames_dropped; // a link's queue was full
+        Counter deflate_sessions;
+        Counter deflate_payload_bytes;
+        Counter deflate_wire_bytes;
+        Counter deflate_cpu_ns;
+        // From reading a room message to queueing it to every member.
+        LatencyHistogram receive_to_broadcast_ns;
+    };
+    ServerMetrics& metrics() { return metrics_; }
+    SessionPool& session_pool() { return *session_pool_; }
+    const MetricsRegistry& metrics_registry() const { return registry_; }
+
+    // permessage-deflate totals over closed sessions that negotiated it:
+    // message bytes written, bytes that reached the socket, and CPU time
+    // spent starting writes, which is where Beast compresses.
+    struct DeflateStats {
+        uint64_t sessions = 0;
+        uint64_t payload_bytes = 0;
+        uint64_t wire_bytes = 0;
+        uint64_t cpu_ns = 0;
+    };
+    void record_deflate(uint64_t payload_bytes, uint64_t wire_bytes, uint64_t cpu_ns);
+    DeflateStats deflate_stats() const;
+
 private:
-    void do_accept();
+    struct Acceptor {
+        net::io_context& ioc;
+        tcp::acceptor acceptor;
+        net::steady_timer retry_timer{ioc}; // between failed accepts
+    };
+    void do_accept(Acceptor& acceptor);
+    void init();
+
+    // Reopen every room logged under config().history_dir.
+    void recover_rooms();
+    HistoryLog::Options history_options() const;
+    void register_metrics();
+
+    // Never resized after construction, so do_accept can hold references.
+    std::vector<std::unique_ptr<Acceptor>> acceptors_;
+    const ServerConfig config_;
+    // Shared with the sessions' allocators, which may outlive the server.
+    const std::shared_ptr<SessionPool> session_pool_ =
+        std::make_shared<SessionPool>(config_.session_pool, config_.read_buffer_bytes);
+
+    // Rooms and sessions are split into shards by hash, each with its own
+    // lock, so sessions on different threads rarely meet on one. Lookups take
+    // a shard's lock shared and only for the lookup; a broadcast then holds
+    // just its room's lock.
+    static constexpr size_t shard_count = 64;
+
+    struct alignas(64) RoomShard {
+        mutable std::shared_mutex mutex;
+        // Keys view the room's own id, so lookups need no std::string.
+        std::unordered_map<std::string_view, std::shared_ptr<Room>> rooms;
+    };
+
+    struct alignas(64) SessionShard {
+        std::mutex mutex;
+        std::unordered_set<std::shared_ptr<Session>> sessions;
+    };
+
+    Room* find_room(std::string_view room_id) const;
+    void insert_room(std::shared_ptr<Room> room);
+    SessionShard& session_shard(const std::shared_ptr<Session>& session);
 
-    tcp::acceptor acceptor_;
-    tcp::socket socket_;
+    std::array<RoomShard, shard_count> room_shards_;
+    std::array<SessionShard, shard_count> session_shards_;
 
-    mutable std::mutex mutex_;
-    std::unordered_map<std::string, std::shared_ptr<Room>> rooms_;
-    std::set<std::shared_ptr<Session>> sessions_;
+    ServerMetrics metrics_;
+    MetricsRegistry registry_;
+    std::shared_ptr<MetricsListener> metrics_listener_; // with config().metrics_port
+    std::shared_ptr<Cluster> cluster_;
 };
\ No newline at end of file
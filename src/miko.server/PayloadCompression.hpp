@@ -0,0 +1,102 @@
+//
+// Compression of room message text before encryption.
+//
+
+#pragma once
+#include <boost/beast/zlib/deflate_stream.hpp>
+#include <boost/beast/zlib/inflate_stream.hpp>
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Ciphertext does not compress, so in a relay room permessage-deflate saves
+// nothing. Rooms created with --compress have clients deflate the text before
+// encrypting it instead. The plaintext then is a flag byte, followed by the
+// text as is (payload_stored), or by the text's length as a 4-byte
+// big-endian integer and the text as raw deflate (payload_deflated). Texts
+// shorter than payload_compress_min are stored: deflate only adds to them.
+constexpr char payload_stored = 0;
+constexpr char payload_deflated = 1;
+constexpr size_t payload_compress_min = 64;
+constexpr size_t payload_inflate_max = 1024 * 1024; // refuse anything larger
+
+inline void compress_payload(std::string_view text, std::string& out) {
+    namespace zlib = boost::beast::zlib;
+    out.clear();
+    if (text.size() < payload_compress_min) {
+        out.push_back(payload_stored);
+        out.append(text);
+        return;
+    }
+    // One compressor per thread; reset keeps its buffers.
+    thread_local zlib::deflate_stream deflater;
+    deflater.reset(6, 15, 8, zlib::Strategy::normal);
+    constexpr size_t header = 5;
+    out.resize(header + deflater.upper_bound(text.size()));
+    out[0] = payload_deflated;
+    const uint32_t length = htonl(static_cast<uint32_t>(text.size()));
+    std::memcpy(&out[1], &length, 4);
+    zlib::z_params zs;
+    zs.next_in = text.data();
+    zs.avail_in = text.size();
+    zs.next_out = &out[header];
+    zs.avail_out = out.size() - header;
+    // Finishing can take more than one call; the output always has room.
+    for (;;) {
+        boost::beast::error_code ec;
+        deflater.write(zs, zlib::Flush::finish, ec);
+        if (ec == zlib::error::end_of_stream)
+            break;
+        if (ec || zs.avail_out == 0)
+            throw std::runtime_error("Payload compression failed: " + ec.message());
+    }
+    out.resize(header + zs.total_out);
+    if (out.size() > text.size() + 1) {
+        out.assign(1, payload_stored);
+        out.append(text);
+    }
+}
+
+// Throws std::runtime_error on malformed input. The length header bounds
+// the output, so a small payload cannot inflate without limit.
+inline void decompress_payload(std::string_view payload, std::string& out) {
+    namespace zlib = boost::beast::zlib;
+    out.clear();
+    if (payload.empty())
+        throw std::runtime_error("Empty compressed payload");
+    if (payload[0] == payload_stored) {
+        out.append(payload.substr(1));
+        return;
+    }
+    if (payload[0] != payload_deflated || payload.size() < 5)
+        throw std::runtime_error("Unknown payload encoding");
+    uint32_t length = 0;
+    std::memcpy(&length, payload.data() + 1, 4);
+    length = ntohl(length);
+    if (length > payload_inflate_max)
+        throw std::runtime_error("Compressed payload too large");
+    out.resize(length);
+    thread_local zlib::inflate_stream inflater;
+    inflater.reset(15);
+    zlib::z_params zs;
+    zs.next_in = payload.data() + 5;
+    zs.avail_in = payload.size() - 5;
+    zs.next_out = &out[0];
+    zs.avail_out = out.size();
+    // Stop at the announced length: the inflater does not always report the
+    // end of the stream.
+    while (zs.avail_out > 0) {
+        const size_t before = zs.total_out;
+        boost::beast::error_code ec;
+        inflater.write(zs, zlib::Flush::sync, ec);
+        if (ec && ec != zlib::error::end_of_stream && ec != zlib::error::need_buffers)
+            throw std::runtime_error("Bad compressed payload: " + ec.message());
+        if (zs.total_out == before)
+            break;
+    }
+    if (zs.total_out != length)
+        throw std::runtime_error("Truncated compressed payload");
+}
@@ -0,0 +1,75 @@
+//
+// Token-bucket rate limits for the read path.
+//
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// A token bucket of 'burst' tokens refilled at 'per_second', kept as one
+// number in the manner of the generic cell rate algorithm: the time at which
+// the bucket would be full again. Checking it is a clock read and one
+// compare-and-swap, with no lock, so a room's limiter can be shared by every
+// session that sends to it. A default-constructed limiter lets everything
+// through.
+class RateLimiter {
+public:
+    RateLimiter() = default;
+    RateLimiter(double per_second, uint32_t burst) { configure(per_second, burst); }
+
+    // Not thread-safe; call before the limiter is shared. A rate of 0
+    // removes the limit, and a burst of 0 allows one second's worth.
+    void configure(double per_second, uint32_t burst) {
+        if (per_second <= 0) {
+            interval_ns_ = 0;
+            return;
+        }
+        interval_ns_ = std::max<int64_t>(1, static_cast<int64_t>(1e9 / per_second));
+        const int64_t tokens = burst ? burst : std::max<int64_t>(1, static_cast<int64_t>(per_second));
+        tolerance_ns_ = (tokens - 1) * interval_ns_;
+    }
+
+    bool limited() const { return interval_ns_ != 0; }
+
+    static int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Takes a token if there is one.
+    bool try_acquire(int64_t now = now_ns()) {
+        if (!limited())
+            return true;
+        int64_t tat = tat_.load(std::memory_order_relaxed);
+        for (;;) {
+            const int64_t start = std::max(tat, now);
+            if (start - now > tolerance_ns_)
+                return false;
+            if (tat_.compare_exchange_weak(tat, start + interval_ns_, std::memory_order_relaxed))
+                return true;
+        }
+    }
+
+    // Takes a token whether or not there is one, for work already done, and
+    // returns how long until the next token, 0 if there is one now.
+    int64_t acquire(int64_t now = now_ns()) { return acquire_n(1, now); }
+
+    // The same for work that costs several tokens.
+    int64_t acquire_n(uint32_t tokens, int64_t now = now_ns()) {
+        if (!limited())
+            return 0;
+        int64_t tat = tat_.load(std::memory_order_relaxed);
+        int64_t next;
+        do {
+            next = std::max(tat, now) + interval_ns_ * tokens;
+        } while (!tat_.compare_exchange_weak(tat, next, std::memory_order_relaxed));
+        return std::max<int64_t>(0, next - tolerance_ns_ - now);
+    }
+
+private:
+    int64_t interval_ns_ = 0;  // between tokens; 0 when unlimited
+    int64_t tolerance_ns_ = 0; // (burst - 1) intervals
+    std::atomic<int64_t> tat_{0};
+};
@@ -4,32 +4,262 @@
 
 #pragma once
 #include <string>
-#include <deque>
+#include <string_view>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <vector>
+#include "HistoryArena.hpp"
+#include "HistoryLog.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include "RateLimiter.hpp"
+#include "aes_encryption.h"
+
+class Session; // Forward declaration.
 
 class Room {
 public:
-    Room(std::string id, std::string key, std::string name)
-        : room_id(std::move(id)), room_key(std::move(key)), room_name(std::move(name)) {}
+    static constexpr size_t max_history = 16384;
+    static constexpr size_t default_history_bytes = 1024 * 1024;
+
+    // The newest messages are kept in memory, up to max_history of them and
+    // 'history_bytes' in total. With a log, the history survives restarts and
+    // the in-memory window is only a cache in front of it. In a 'compressed'
+    // room clients compress message text before encrypting it (see
+    // PayloadCompression.hpp). A log that fails to append is reopened on a
+    // later message and caught up from memory (see write_log).
+    Room(std::string id, std::string key, std::string name, CipherMode cipher = CipherMode::AES_128_CBC,
+         bool compressed = false, std::unique_ptr<HistoryLog> log = nullptr,
+         size_t history_bytes = default_history_bytes)
+        : room_id(std::move(id)), room_key(std::move(key)), room_name(std::move(name)), cipher(cipher),
+          compressed_(compressed), history(history_bytes, max_history), log_(std::move(log)) {
+        if (log_) {
+            logged_ = true;
+            log_dir_ = log_->dir();
+            log_options_ = log_->options();
+            next_seq_ = log_->next_seq();
+            uint64_t seq = std::max(log_->first_seq(), next_seq_ - std::min<uint64_t>(next_seq_, max_history));
+            for (; seq < next_seq_; ++seq) {
+                history.push_back(log_->read(seq));
+            }
+        }
+    }
 
-    void add_message(const std::string& message) {
+    // Returns the message's sequence number.
+    uint64_t add_message(std::string_view message) {
         std::lock_guard<std::mutex> lock(mutex_);
-        if (history.size() >= max_history) {
-            history.pop_front();
+        return append(message);
+    }
+
+    // Record a message and pass every member to 'deliver', along with the
+    // message's sequence number, under one lock: a concurrent add_member
+    // either sees the message in history or gets it live, never both or
+    // neither. Returns the message's sequence number.
+    template <typename Fn>
+    uint64_t publish(std::string_view message, Fn&& deliver) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const uint64_t seq = append(message);
+        for (const auto& session : members) {
+            deliver(session, seq);
         }
-        history.push_back(message);
+        return seq;
+    }
+
+    // Messages from sequence number 'from' on, oldest first: at most 'limit'
+    // of them, and no more than 'max_bytes' in total (but always at least
+    // one). The cache serves recent ones; older ones are read from the log.
+    struct HistorySlice {
+        uint64_t first_seq = 0; // of messages[0]
+        std::vector<std::string> messages;
+    };
+
+    HistorySlice read_since(uint64_t from, size_t limit, size_t max_bytes = SIZE_MAX) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        HistorySlice slice;
+        const uint64_t cached = next_seq_ - history.size();
+        slice.first_seq = std::max(from, oldest_seq(cached));
+        const uint64_t end = std::min<uint64_t>(next_seq_, slice.first_seq + limit);
+        size_t bytes = 0;
+        for (uint64_t seq = slice.first_seq; seq < end; ++seq) {
+            std::string_view message = seq >= cached ? history[seq - cached] : log_->read(seq);
+            if (!slice.messages.empty() && bytes + message.size() > max_bytes)
+                break;
+            bytes += message.size();
+            slice.messages.emplace_back(message);
+        }
+        return slice;
+    }
+
+    // The newest 'count' messages.
+    HistorySlice read_last(size_t count) const {
+        return read_since(next_seq() - std::min<uint64_t>(next_seq(), count), count);
+    }
+
+    uint64_t next_seq() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return next_seq_;
+    }
+
+    // Oldest message still available.
+    uint64_t first_seq() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return oldest_seq(next_seq_ - history.size());
+    }
+
+    bool persistent() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return log_ != nullptr;
+    }
+
+    // Failed log appends and reopens, and whether the log is behind now
+    // because of one.
+    uint64_t log_failures() const { return log_failures_.value(); }
+    bool log_down() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return logged_ && (!log_ || log_->next_seq() != next_seq_);
+    }
+
+    // Membership index: broadcasts only visit the sessions listed here.
+    void add_member(const std::shared_ptr<Session>& session) {
+        add_member(session, [](uint64_t, uint64_t) {});
+    }
+
+    // Add a member and call 'on_added(first_seq, next_seq)' before any later
+    // message can reach it. Runs under the room lock: 'on_added' must not call
+    // back into the room's locking members.
+    template <typename Fn>
+    void add_member(const std::shared_ptr<Session>& session, Fn&& on_added) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        members.insert(session);
+        on_added(oldest_seq(next_seq_ - history.size()), next_seq_);
+    }
+
+    void remove_member(const std::shared_ptr<Session>& session) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        members.erase(session);
+    }
+
+    template <typename Fn>
+    void for_each_member(Fn&& fn) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& session : members) {
+            fn(session);
+        }
+    }
+
+    size_t member_count() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return members.size();
     }
 
-    const std::deque<std::string>& get_history() const { return history; }
     const std::string& get_key() const { return room_key; }
     const std::string& get_id() const { return room_id; }
     const std::string& get_name() const { return room_name; }
+    CipherMode get_cipher() const { return cipher; }
+    bool compressed() const { return compressed_; }
+
+    // Room messages from all members together; configured before the room
+    // is shared.
+    RateLimiter& rate_limit() { return rate_limit_; }
+
+    // In a cluster (see Cluster.hpp): a mirror of a room another node owns,
+    // set before the room is shared, and for a room owned here, the nodes
+    // mirroring it, a bit per node.
+    void set_owner(size_t node) {
+        remote_ = true;
+        owner_ = node;
+    }
+    bool remote() const { return remote_; }
+    size_t owner() const { return owner_; }
+    void add_subscriber(size_t node) { subscribers_.fetch_or(uint64_t{1} << node, std::memory_order_relaxed); }
+    uint64_t subscribers() const { return subscribers_.load(std::memory_order_relaxed); }
 
 private:
+    uint64_t append(std::string_view message) {
+        history.push_back(message);
+        const uint64_t seq = next_seq_++;
+        if (!log_dir_.empty())
+            write_log(message);
+        return seq;
+    }
+
+    // Brings the log up to next_seq_. A failed append keeps the room going
+    // from memory and drops the log, since a segment roll that failed half
+    // way can leave it unusable. A later message reopens it from disk, at
+    // most once a second, and writes the messages it missed from the cache.
+    // Once those have left the cache the log would have a hole, so it is
+    // given up for good, as it is for a message it can never hold. 'newest'
+    // is the message just appended, which the cache may have been too small
+    // to keep.
+    void write_log(std::string_view newest) {
+        if (!log_) {
+            const auto now = std::chrono::steady_clock::now();
+            if (now < log_retry_at_)
+                return;
+            log_retry_at_ = now + std::chrono::seconds(1);
+            try {
+                log_ = HistoryLog::open(log_dir_, log_options_);
+            } catch (const std::exception& e) {
+                log_failures_.add();
+                LogLine(LogLevel::Error) << "[History] Room " << room_id << ": " << e.what() << " Will retry.";
+                return;
+            }
+        }
+        const uint64_t cached = next_seq_ - history.size();
+        const uint64_t available = std::min(cached, next_seq_ - 1);
+        uint64_t seq = log_->next_seq();
+        if (seq < available || seq > next_seq_) {
+            LogLine(LogLevel::Error) << "[History] Room " << room_id << ": log is at " << seq << ", messages end at "
+                                     << next_seq_ << " and the cache starts at " << cached << ". Log disabled.";
+            give_up_log();
+            return;
+        }
+        try {
+            for (; seq < next_seq_; ++seq)
+                log_->append(seq == next_seq_ - 1 ? newest : history[seq - cached]);
+        } catch (const std::invalid_argument& e) {
+            log_failures_.add();
+            LogLine(LogLevel::Error) << "[History] Room " << room_id << ": " << e.what() << " Log disabled.";
+            give_up_log();
+        } catch (const std::exception& e) {
+            log_failures_.add();
+            LogLine(LogLevel::Error) << "[History] Room " << room_id << ": " << e.what() << " Will retry.";
+            log_.reset();
+            log_retry_at_ = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        }
+    }
+
+    void give_up_log() {
+        log_.reset();
+        log_dir_.clear();
+    }
+
+    uint64_t oldest_seq(uint64_t cached) const {
+        return log_ ? std::min(log_->first_seq(), cached) : cached;
+    }
+
     std::string room_id;
     std::string room_key;
     std::string room_name;
-    static const size_t max_history = 16384;
-    std::deque<std::string> history;
+    CipherMode cipher;
+    bool compressed_;
+    HistoryArena history;
+    uint64_t next_seq_ = 0;
+    std::unique_ptr<HistoryLog> log_;
+    bool logged_ = false; // created with a log
+    std::string log_dir_; // empty without a log, or once it is given up
+    HistoryLog::Options log_options_;
+    std::chrono::steady_clock::time_point log_retry_at_;
+    Counter log_failures_;
+    std::set<std::shared_ptr<Session>> members;
     mutable std::mutex mutex_;
+    RateLimiter rate_limit_;
+    bool remote_ = false;
+    size_t owner_ = 0;
+    std::atomic<uint64_t> subscribers_{0};
 };
@@ -0,0 +1,287 @@
+//
+// Zero-copy parsing of binary room-message frames.
+//
+
+#pragma once
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// A room frame is three fields, each a 4-byte big-endian length followed by
+// that many bytes: room id, nickname, encrypted payload. The views point into
+// the frame, so they are only valid while the read buffer is untouched.
+struct RoomMessageView {
+    std::string_view room_id;
+    std::string_view nickname;
+    std::string_view encrypted_payload;
+};
+
+inline void pack_view(std::string& out, std::string_view field) {
+    const uint32_t net_len = htonl(static_cast<uint32_t>(field.size()));
+    out.append(reinterpret_cast<const char*>(&net_len), 4);
+    out.append(field);
+}
+
+inline std::string_view unpack_view(std::string_view data, size_t& offset) {
+    if (data.size() - offset < 4)
+        throw std::runtime_error("Invalid packet: unable to read field length");
+    uint32_t net_len = 0;
+    std::memcpy(&net_len, data.data() + offset, 4);
+    uint32_t field_len = ntohl(net_len);
+    offset += 4;
+    if (field_len > data.size() - offset)
+        throw std::runtime_error("Invalid packet: field length exceeds packet size");
+    std::string_view field = data.substr(offset, field_len);
+    offset += field_len;
+    return field;
+}
+
+inline RoomMessageView unpack_room_message(std::string_view frame) {
+    RoomMessageView rm;
+    size_t offset = 0;
+    rm.room_id = unpack_view(frame, offset);
+    rm.nickname = unpack_view(frame, offset);
+    rm.encrypted_payload = unpack_view(frame, offset);
+    return rm;
+}
+
+// The compact form names the room and sender by the numbers join-success
+// handed out on this connection instead of by strings: a tag byte, the room
+// handle and sender id as 4-byte big-endian integers, then the encrypted
+// payload as a length-prefixed field. The tag is never the first byte of a
+// full frame, whose room id length starts with 0.
+constexpr uint8_t compact_room_tag = 0xD1;
+
+struct CompactRoomMessageView {
+    uint32_t room_handle = 0;
+    uint32_t sender_id = 0;
+    std::string_view encrypted_payload;
+};
+
+inline bool is_compact_room_frame(std::string_view frame) {
+    return !frame.empty() && static_cast<uint8_t>(frame[0]) == compact_room_tag;
+}
+
+inline void pack_compact_room_message(std::string& out, uint32_t room_handle, uint32_t sender_id,
+                                      std::string_view encrypted_payload) {
+    out.push_back(static_cast<char>(compact_room_tag));
+    const uint32_t net_handle = htonl(room_handle);
+    const uint32_t net_sender = htonl(sender_id);
+    out.append(reinterpret_cast<const char*>(&net_handle), 4);
+    out.append(reinterpret_cast<const char*>(&net_sender), 4);
+    pack_view(out, encrypted_payload);
+}
+
+inline CompactRoomMessageView unpack_compact_room_message(std::string_view frame) {
+    if (frame.size() < 9 || !is_compact_room_frame(frame))
+        throw std::runtime_error("Invalid packet: truncated compact frame");
+    CompactRoomMessageView rm;
+    uint32_t net = 0;
+    std::memcpy(&net, frame.data() + 1, 4);
+    rm.room_handle = ntohl(net);
+    std::memcpy(&net, frame.data() + 5, 4);
+    rm.sender_id = ntohl(net);
+    size_t offset = 9;
+    rm.encrypted_payload = unpack_view(frame, offset);
+    return rm;
+}
+
+// A chunked room message carries a payload too long for one frame, such as
+// a pasted log, as one WebSocket message that the sender writes a piece at a
+// time. It starts with a tag byte and the room handle, as in the compact
+// form. Any number of pieces follow, each a separately encrypted part of
+// the text as a length-prefixed field. The server reads the message as it
+// arrives and broadcasts each piece as an ordinary room message once the
+// piece is whole, so it holds one piece at a time, however long the message.
+constexpr uint8_t chunked_room_tag = 0xD2;
+constexpr size_t chunked_header_size = 5;
+
+inline bool is_chunked_room_frame(std::string_view frame) {
+    return !frame.empty() && static_cast<uint8_t>(frame[0]) == chunked_room_tag;
+}
+
+inline void pack_chunked_room_header(std::string& out, uint32_t room_handle) {
+    out.push_back(static_cast<char>(chunked_room_tag));
+    const uint32_t net_handle = htonl(room_handle);
+    out.append(reinterpret_cast<const char*>(&net_handle), 4);
+}
+
+inline uint32_t unpack_chunked_room_header(std::string_view header) {
+    if (header.size() < chunked_header_size || !is_chunked_room_frame(header))
+        throw std::runtime_error("Invalid packet: truncated chunked frame");
+    uint32_t net = 0;
+    std::memcpy(&net, header.data() + 1, 4);
+    return ntohl(net);
+}
+
+// Looks for a whole piece at the front of 'data'. 'size' is set from the
+// length field as soon as that has arrived, so a reader can refuse a piece
+// too long to wait for before it comes in.
+inline bool peek_chunked_piece(std::string_view data, uint32_t& size, std::string_view& piece) {
+    if (data.size() < 4)
+        return false;
+    uint32_t net_len = 0;
+    std::memcpy(&net_len, data.data(), 4);
+    size = ntohl(net_len);
+    if (data.size() - 4 < size)
+        return false;
+    piece = data.substr(4, size);
+    return true;
+}
+
+// miko.cli's /send-file sends a file as file chunk frames. The server relays
+// them to the other members of the room and keeps none in its history. A
+// transfer has an id its sender picks and goes in order. Chunk 0 carries the
+// file's name and size, and later chunks carry its contents, each encrypted
+// with the room key on its own. The last chunk has file_chunk_last set. A
+// member that falls too far behind is dropped from the transfer and sent a
+// chunk with file_chunk_aborted set and no payload in place of the rest;
+// when the sender disconnects mid-transfer, every member is sent one with
+// file_chunk_last set as well. A
+// client names the room by its handle, as in compact frames; members are
+// sent the room id and the sender's nickname instead:
+//   client: tag, room handle, transfer id, seq, flags, payload field
+//   member: tag, room id field, nickname field, transfer id, seq, flags,
+//           payload field
+// with the ids and seq as 4-byte big-endian integers and flags one byte.
+constexpr uint8_t file_chunk_tag = 0xD3;
+constexpr uint8_t file_relay_tag = 0xD4;
+constexpr uint8_t file_chunk_last = 0x01;
+constexpr uint8_t file_chunk_aborted = 0x02;
+
+struct FileChunkView {
+    uint32_t room_handle = 0;  // client form only
+    std::string_view room_id;  // member form only
+    std::string_view nickname; // member form only
+    uint32_t transfer_id = 0;
+    uint32_t seq = 0;
+    uint8_t flags = 0;
+    std::string_view encrypted_payload;
+};
+
+inline bool is_file_chunk_frame(std::string_view frame) {
+    return !frame.empty() && static_cast<uint8_t>(frame[0]) == file_chunk_tag;
+}
+
+inline bool is_file_relay_frame(std::string_view frame) {
+    return !frame.empty() && static_cast<uint8_t>(frame[0]) == file_relay_tag;
+}
+
+inline void pack_u32(std::string& out, uint32_t value) {
+    const uint32_t net = htonl(value);
+    out.append(reinterpret_cast<const char*>(&net), 4);
+}
+
+inline uint32_t unpack_u32(std::string_view data, size_t& offset) {
+    if (data.size() - offset < 4)
+        throw std::runtime_error("Invalid packet: truncated file chunk");
+    uint32_t net = 0;
+    std::memcpy(&net, data.data() + offset, 4);
+    offset += 4;
+    return ntohl(net);
+}
+
+inline void pack_file_chunk(std::string& out, uint32_t room_handle, uint32_t transfer_id, uint32_t seq,
+                            uint8_t flags, std::string_view encrypted_payload) {
+    out.push_back(static_cast<char>(file_chunk_tag));
+    pack_u32(out, room_handle);
+    pack_u32(out, transfer_id);
+    pack_u32(out, seq);
+    out.push_back(static_cast<char>(flags));
+    pack_view(out, encrypted_payload);
+}
+
+// The transfer fields and payload, shared by both forms.
+inline void unpack_file_fields(std::string_view frame, size_t& offset, FileChunkView& chunk) {
+    chunk.transfer_id = unpack_u32(frame, offset);
+    chunk.seq = unpack_u32(frame, offset);
+    if (offset >= frame.size())
+        throw std::runtime_error("Invalid packet: truncated file chunk");
+    chunk.flags = static_cast<uint8_t>(frame[offset++]);
+    chunk.encrypted_payload = unpack_view(frame, offset);
+}
+
+inline FileChunkView unpack_file_chunk(std::string_view frame) {
+    if (!is_file_chunk_frame(frame))
+        throw std::runtime_error("Invalid packet: not a file chunk");
+    FileChunkView chunk;
+    size_t offset = 1;
+    chunk.room_handle = unpack_u32(frame, offset);
+    unpack_file_fields(frame, offset, chunk);
+    return chunk;
+}
+
+inline void pack_file_relay(std::string& out, std::string_view room_id, std::string_view nickname,
+                            const FileChunkView& chunk) {
+    out.reserve(out.size() + 22 + room_id.size() + nickname.size() + chunk.encrypted_payload.size());
+    out.push_back(static_cast<char>(file_relay_tag));
+    pack_view(out, room_id);
+    pack_view(out, nickname);
+    pack_u32(out, chunk.transfer_id);
+    pack_u32(out, chunk.seq);
+    out.push_back(static_cast<char>(chunk.flags));
+    pack_view(out, chunk.encrypted_payload);
+}
+
+inline FileChunkView unpack_file_relay(std::string_view frame) {
+    if (!is_file_relay_frame(frame))
+        throw std::runtime_error("Invalid packet: not a file chunk");
+    FileChunkView chunk;
+    size_t offset = 1;
+    chunk.room_id = unpack_view(frame, offset);
+    chunk.nickname = unpack_view(frame, offset);
+    unpack_file_fields(frame, offset, chunk);
+    return chunk;
+}
+
+// Names a transfer across the whole server: transfer ids are only unique
+// per sender.
+inline std::string file_transfer_key(std::string_view room_id, std::string_view nickname, uint32_t transfer_id) {
+    std::string key;
+    pack_view(key, room_id);
+    pack_view(key, nickname);
+    pack_u32(key, transfer_id);
+    return key;
+}
+
+// Sessions that negotiated binary control get decrypted chat as a chat batch
+// frame rather than a text frame, so a client can tell where a rejoin should
+// resume without counting lines, which a message may itself contain: a tag
+// byte, the sequence number of the first message as an 8-byte big-endian
+// integer, the number of messages as a 4-byte one, then the "[nick]: text"
+// lines joined with newlines, as in a text frame. The messages of one batch
+// have consecutive sequence numbers.
+constexpr uint8_t chat_batch_tag = 0xD5;
+constexpr size_t chat_batch_header_size = 13;
+
+struct ChatBatchView {
+    uint64_t first_seq = 0;
+    uint32_t count = 0;
+    std::string_view lines;
+};
+
+inline bool is_chat_batch_frame(std::string_view frame) {
+    return !frame.empty() && static_cast<uint8_t>(frame[0]) == chat_batch_tag;
+}
+
+inline void pack_chat_batch_header(std::string& out, uint64_t first_seq, uint32_t count) {
+    out.push_back(static_cast<char>(chat_batch_tag));
+    pack_u32(out, static_cast<uint32_t>(first_seq >> 32));
+    pack_u32(out, static_cast<uint32_t>(first_seq));
+    pack_u32(out, count);
+}
+
+inline ChatBatchView unpack_chat_batch(std::string_view frame) {
+    if (frame.size() < chat_batch_header_size || !is_chat_batch_frame(frame))
+        throw std::runtime_error("Invalid packet: truncated chat batch");
+    ChatBatchView batch;
+    size_t offset = 1;
+    batch.first_seq = static_cast<uint64_t>(unpack_u32(frame, offset)) << 32;
+    batch.first_seq |= unpack_u32(frame, offset);
+    batch.count = unpack_u32(frame, offset);
+    batch.lines = frame.substr(offset);
+    return batch;
+}
@@ -0,0 +1,109 @@
+//
+// Runtime settings for miko.service, filled in from the command line.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "aes_encryption.h"
+
+// What a session does when its outbound queue passes the high-water mark.
+enum class OverflowPolicy {
+    Drop,       // discard the new frame and keep the connection
+    Disconnect  // close the connection; the reader is too slow
+};
+
+struct ServerConfig {
+    // Relay room frames still encrypted instead of decrypting them; clients
+    // decrypt with the room key they already hold.
+    bool relay = false;
+
+    // Cipher for rooms created without an explicit --cipher.
+    CipherMode default_cipher = CipherMode::AES_128_CBC;
+
+    // Outbound queue per session.
+    size_t send_queue_high_water = 4 * 1024 * 1024; // bytes queued before overflow
+    size_t send_coalesce_max = 64 * 1024;           // max bytes merged into one write
+    OverflowPolicy send_overflow = OverflowPolicy::Disconnect;
+
+    // permessage-deflate (RFC 7692), used with clients that offer it. The
+    // window bits (9..15) and memory level (1..9) set the per-connection
+    // compressor state, about 2^(bits+2) + 2^(level+9) bytes; messages
+    // under the threshold go out uncompressed (needs Boost 1.77 or later).
+    bool deflate = false;
+    int deflate_window_bits = 15;
+    int deflate_mem_level = 4;
+    size_t deflate_threshold = 0;
+
+    // WebSocket timeouts in seconds, 0 for none. The handshake must finish
+    // within handshake_timeout. A session that sends nothing for half of
+    // idle_timeout is pinged (with keep_alive_pings), and one silent for all
+    // of it, pongs included, is closed and counted as reaped.
+    unsigned handshake_timeout = 30;
+    unsigned idle_timeout = 60;
+    bool keep_alive_pings = true;
+
+    // Largest message a client may send, in bytes; a larger one closes the
+    // connection with 1009 (message too big). A chunked room message may be
+    // any length, but each of its pieces is held the same way and has the
+    // same limit.
+    size_t read_message_max = 1024 * 1024;
+
+    // File chunks (miko.cli's /send-file) a member may have queued from the
+    // room before the sender's chunks wait for it to catch up, in bytes. A
+    // member still over the window after file_stall_timeout seconds, or over
+    // twice the window at any time, is dropped from the transfer instead.
+    // Chat is written ahead of file chunks either way.
+    size_t file_window_bytes = 1024 * 1024;
+    unsigned file_stall_timeout = 10;
+
+    // Closed sessions' memory and read buffers kept for new connections (see
+    // SessionPool.hpp), 0 to allocate each afresh. A read buffer that grows
+    // past read_buffer_bytes for a large message is shrunk once the message
+    // is handled, and is not kept.
+    size_t session_pool = 1024;
+    size_t read_buffer_bytes = 64 * 1024;
+
+    // Room messages per second, 0 for no limit. A session over its rate has
+    // its reads paused until it is back under; a room over its rate, across
+    // all its members, refuses messages with room-message-failure. A burst
+    // of 0 allows one second's worth.
+    double session_rate = 0;
+    uint32_t session_burst = 0;
+    double room_rate = 0;
+    uint32_t room_burst = 0;
+
+    // Cluster mode (see Cluster.hpp): every node's "address:port" for links
+    // between nodes, the same list on every node, and this node's index in
+    // it. Empty runs a single server.
+    std::vector<std::string> cluster_nodes;
+    size_t cluster_self = 0;
+    // Shared by every node; when set, a node must prove it knows it before
+    // its link is accepted. Empty accepts any configured node's address.
+    std::string cluster_secret;
+
+    // Prometheus text endpoint at http://127.0.0.1:<metrics_port>/metrics;
+    // 0 disables it.
+    unsigned short metrics_port = 0;
+
+    // Token for the admin "/CMD stats <token>" command; empty disables it.
+    std::string admin_token;
+
+    // In-memory history per room, in bytes (at most 16384 messages too).
+    // It has to hold the largest message, read_message_max plus the room id
+    // and nickname around it (history_frame_overhead), and at most 4 GiB.
+    // Its pages are only touched as messages fill them.
+    size_t history_cache_bytes = 2 * 1024 * 1024;
+
+    // Persistent room history: one directory per room under history_dir,
+    // recovered at startup. Empty keeps history in memory only.
+    std::string history_dir;
+    size_t history_segment_bytes = 64 * 1024 * 1024;
+    size_t history_retain_segments = 0; // 0 keeps every segment
+
+    // Messages replayed to a member on join, unless it asks for more
+    // ("--last N") or resumes ("--since SEQ").
+    size_t history_replay = 100;
+};
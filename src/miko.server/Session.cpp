@@ -4,57 +4,169 @@
 
 #include "Session.hpp"
 #include "MikoServer.hpp"
-#include <iostream>
+#include <algorithm>
+#include <chrono>
 #include <sstream>
+#include <type_traits>
+#include <time.h>
 #include <boost/asio.hpp>
 #include <boost/asio/buffer.hpp>
+#include <openssl/crypto.h>
 #include "Base64.h"
 #include "aes_encryption.h"
+#include "ControlFrame.hpp"
+#include "Logger.hpp"
+#include "PayloadCompression.hpp"
+#include "Room.hpp"
+#include "RoomFrame.hpp"
+#include "SocketStats.hpp"
 
-static std::string unpack_string(const unsigned char* data, size_t& offset, size_t total_size) {
-    if (offset + 4 > total_size)
-        throw std::runtime_error("Invalid packet: unable to read field length");
-    uint32_t net_len = 0;
-    std::memcpy(&net_len, data + offset, 4);
-    uint32_t field_len = ntohl(net_len);
-    offset += 4;
-    if (offset + field_len > total_size)
-        throw std::runtime_error("Invalid packet: field length exceeds packet size");
-    std::string field(reinterpret_cast<const char*>(data + offset), field_len);
-    offset += field_len;
-    return field;
-}
-
-struct RoomMessage {
-    std::string room_id;
-    std::string nickname;
-    std::string encrypted_payload;
-};
-
-static RoomMessage unpack_room_message(const std::vector<unsigned char>& packet) {
-    RoomMessage rm;
-    size_t offset = 0;
-    size_t total_size = packet.size();
-    rm.room_id = unpack_string(packet.data(), offset, total_size);
-    rm.nickname = unpack_string(packet.data(), offset, total_size);
-    rm.encrypted_payload = unpack_string(packet.data(), offset, total_size);
-    return rm;
-}
-
-
-Session::Session(tcp::socket socket, std::shared_ptr<MikoServer> server)
-    : ws_(std::move(socket)), server_(server)
-{}
+// Whether a Sec-WebSocket-Protocol header value lists 'protocol'.
+static bool offers_subprotocol(beast::string_view offered, beast::string_view protocol) {
+    while (!offered.empty()) {
+        const size_t comma = offered.find(',');
+        beast::string_view token = offered.substr(0, comma);
+        while (!token.empty() && token.front() == ' ') token.remove_prefix(1);
+        while (!token.empty() && token.back() == ' ') token.remove_suffix(1);
+        if (token == protocol)
+            return true;
+        if (comma == beast::string_view::npos)
+            break;
+        offered.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+// Beast 1.77 added permessage_deflate::msg_size_threshold; older versions
+// compress every message.
+template <typename Options, typename = void>
+struct has_msg_size_threshold : std::false_type {};
+template <typename Options>
+struct has_msg_size_threshold<Options, std::void_t<decltype(std::declval<Options&>().msg_size_threshold)>>
+    : std::true_type {};
+
+template <typename Options>
+static void set_deflate_threshold(Options& options, size_t threshold) {
+    if constexpr (has_msg_size_threshold<Options>::value)
+        options.msg_size_threshold = threshold;
+}
+
+bool deflate_threshold_supported() {
+    return has_msg_size_threshold<ws::permessage_deflate>::value;
+}
+
+static uint64_t thread_cpu_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+static std::atomic<uint32_t> next_sender_id{1};
+
+// Peers can trigger these errors as often as they like, so each kind is
+// logged at most ten times a second.
+static LogRateLimit accept_errors(10);
+static LogRateLimit command_errors(10);
+static LogRateLimit overflow_errors(10);
+static LogRateLimit send_errors(10);
+static LogRateLimit size_errors(10);
+
+// A file chunk costs the rate limits one message per this many bytes, the
+// size of the pieces of a chunked room message, which cost one each.
+static constexpr size_t file_token_bytes = 16 * 1024;
+
+// The chunk that takes the place of the rest of 'frame's transfer.
+static SharedBuffer file_abort_frame(const std::string& frame, uint8_t flags = 0) {
+    FileChunkView chunk = unpack_file_relay(frame);
+    chunk.flags = static_cast<uint8_t>(file_chunk_aborted | flags);
+    chunk.encrypted_payload = {};
+    std::string abort;
+    pack_file_relay(abort, chunk.room_id, chunk.nickname, chunk);
+    return std::make_shared<const std::string>(std::move(abort));
+}
+
+template <typename... Parts>
+static void warn_limited(LogRateLimit& limit, const Parts&... parts) {
+    uint64_t suppressed = 0;
+    if (limit.allow(suppressed)) {
+        LogLine line(LogLevel::Warn);
+        (line << ... << parts) << LogSuppressed{suppressed};
+    }
+}
+
+Session::Session(socket_type socket, std::shared_ptr<MikoServer> server)
+    : ws_(std::move(socket)), timer_(ws_.get_executor()), file_timer_(ws_.get_executor()),
+      buffer_(server->session_pool().take_buffer()),
+      server_(server), sender_id_(next_sender_id.fetch_add(1, std::memory_order_relaxed))
+{
+    const ServerConfig& config = server_->config();
+    read_limit_.configure(config.session_rate, config.session_burst);
+}
+
+Session::~Session() {
+    server_->session_pool().give_buffer(std::move(buffer_));
+}
 
 void Session::start() {
     server_->add_session(shared_from_this());
-    ws_.async_accept([self = shared_from_this()](beast::error_code ec) {
-        if (!ec) {
-            self->ws_.binary(true);
-            self->do_read();
-        } else {
-            std::cerr << "Accept error: " << ec.message() << std::endl;
+    // Run the handshake on this session's strand. The upgrade request is read
+    // here rather than by async_accept so the offered subprotocols can be
+    // checked for binary control frames.
+    net::dispatch(ws_.get_executor(), [self = shared_from_this()]() {
+        if (const unsigned timeout = self->server_->config().handshake_timeout) {
+            self->timer_.expires_after(std::chrono::seconds(timeout));
+            self->timer_.async_wait([self](beast::error_code ec) {
+                if (!ec) {
+                    self->timed_out_ = true;
+                    beast::get_lowest_layer(self->ws_).close(ec);
+                }
+            });
         }
+        auto request = std::make_shared<http::request<http::string_body>>();
+        http::async_read(self->ws_.next_layer(), self->buffer_, *request,
+            [self, request](beast::error_code ec, std::size_t) {
+                self->timer_.cancel();
+                if (ec) {
+                    if (!self->timed_out_)
+                        warn_limited(accept_errors, "Accept error: ", ec.message());
+                    self->closed(ec);
+                    return;
+                }
+                self->binary_control_ = offers_subprotocol((*request)[http::field::sec_websocket_protocol],
+                                                           control_subprotocol);
+                if (self->binary_control_) {
+                    self->ws_.set_option(ws::stream_base::decorator([](ws::response_type& res) {
+                        res.set(http::field::sec_websocket_protocol, control_subprotocol);
+                    }));
+                }
+                const ServerConfig& config = self->server_->config();
+                if (config.deflate &&
+                    (*request)[http::field::sec_websocket_extensions].find("permessage-deflate") !=
+                        beast::string_view::npos) {
+                    ws::permessage_deflate pmd;
+                    pmd.server_enable = true;
+                    pmd.server_max_window_bits = config.deflate_window_bits;
+                    pmd.client_max_window_bits = config.deflate_window_bits;
+                    pmd.memLevel = config.deflate_mem_level;
+                    set_deflate_threshold(pmd, config.deflate_threshold);
+                    self->ws_.set_option(pmd);
+                    self->deflate_ = true;
+                }
+                self->set_timeouts();
+                // Message sizes are checked by on_read instead, which can
+                // let a chunked message run past read_message_max.
+                self->ws_.read_message_max(0);
+                self->ws_.async_accept(*request, [self, request](beast::error_code ec) {
+                    if (!ec) {
+                        self->ws_.binary(true);
+                        self->do_read();
+                    } else {
+                        if (ec != beast::error::timeout)
+                            warn_limited(accept_errors, "Accept error: ", ec.message());
+                        self->closed(ec);
+                    }
+                });
+            });
     });
 }
 
@@ -66,126 +178,911 @@ void Session::client_start(const std::string& host) {
                 self->ws_.binary(true);
                 self->do_read();
             } else {
-                std::cerr << "Handshake error: " << ec.message() << std::endl;
+                warn_limited(accept_errors, "Handshake error: ", ec.message());
             }
         }
     );
 }
 
 void Session::do_read() {
-    ws_.async_read(buffer_,
-        [self = shared_from_this()](beast::error_code ec, std::size_t) {
+    ws_.async_read_some(buffer_, server_->session_pool().buffer_capacity(), bind_handler_memory(read_memory_,
+        [self = shared_from_this()](beast::error_code ec, std::size_t bytes_transferred) {
             if (!ec) {
-                if (self->ws_.got_text()) {
-                    std::string msg = beast::buffers_to_string(self->buffer_.data());
-                    self->buffer_.consume(self->buffer_.size());
-                    std::cout << "[command received] " << msg << std::endl;
-                    self->process_command(msg);
-                } else {
-                    // Binary message: pass the raw data to a binary processor.
-                    auto data = self->buffer_.data();
-                    std::size_t size = boost::asio::buffer_size(data);
-                    std::vector<unsigned char> bin_msg(size);
-                    std::memcpy(bin_msg.data(), boost::asio::buffer_cast<const void*>(data), size);
-                    self->buffer_.consume(size);
-                    self->process_binary_room_message(bin_msg);
-                }
-                self->do_read();
+                self->server_->metrics().bytes_in.add(bytes_transferred);
+                self->on_read();
             } else {
-                self->server_->remove_session(self);
+                self->closed(ec);
             }
+        }));
+}
+
+// buffer_ holds what has been read of the current message and not handled
+// yet; a read returns at most one buffer's worth.
+void Session::on_read() {
+    const bool done = ws_.is_message_done();
+    if (read_state_ == ReadState::Start) {
+        auto data = buffer_.data();
+        const bool chunked = ws_.got_binary() &&
+            is_chunked_room_frame(std::string_view(static_cast<const char*>(data.data()), data.size()));
+        if (!chunked) {
+            read_state_ = ReadState::Whole;
+        } else if (data.size() >= chunked_header_size || done) {
+            start_chunked();
+        } else {
+            do_read(); // the rest of the header
+            return;
+        }
+    }
+
+    switch (read_state_) {
+    case ReadState::Whole:
+        if (buffer_.size() > server_->config().read_message_max) {
+            refuse_too_big();
+            return;
+        }
+        if (!done) {
+            do_read();
+            return;
+        }
+        if (ws_.got_text()) {
+            std::string msg = beast::buffers_to_string(buffer_.data());
+            buffer_.consume(buffer_.size());
+            LogLine(LogLevel::Debug) << "[command received] " << msg;
+            process_command(msg);
+        } else {
+            // Binary message: parse it in place, then release the buffer.
+            auto data = buffer_.data();
+            process_binary_message(std::string_view(static_cast<const char*>(data.data()), data.size()));
+            buffer_.consume(data.size());
+        }
+        break;
+    case ReadState::Chunked:
+        if (!process_chunked_pieces(done)) {
+            refuse_too_big();
+            return;
+        }
+        break;
+    case ReadState::Discard:
+    case ReadState::Start:
+        buffer_.consume(buffer_.size());
+        break;
+    }
+
+    if (done) {
+        read_state_ = ReadState::Start;
+        chunked_room_ = nullptr;
+        // One large message should not pin its buffer for the life of the
+        // connection.
+        if (buffer_.capacity() > server_->session_pool().buffer_capacity())
+            buffer_.shrink_to_fit();
+    }
+    // A chunked message pauses between pieces, too, when over its rate.
+    read_next();
+}
+
+// The header names the room by this connection's handle, as compact frames
+// do, so it must be the room the session is in now.
+void Session::start_chunked() {
+    auto data = buffer_.data();
+    try {
+        const uint32_t handle = unpack_chunked_room_header(
+            std::string_view(static_cast<const char*>(data.data()), data.size()));
+        if (handle != current_handle_ || handle >= room_handles_.size())
+            throw std::runtime_error("Not joined to this room");
+        chunked_room_ = room_handles_[handle];
+    } catch (const std::exception& e) {
+        send(control(ControlOp::RoomMessageFailure).add(e.what()));
+        read_state_ = ReadState::Discard;
+        return;
+    }
+    buffer_.consume(chunked_header_size);
+    read_state_ = ReadState::Chunked;
+    server_->metrics().chunked_messages.add();
+}
+
+// Handles every whole piece in buffer_. Returns false for a piece longer
+// than read_message_max, which would have to be held whole.
+bool Session::process_chunked_pieces(bool message_done) {
+    const size_t piece_max = server_->config().read_message_max;
+    for (;;) {
+        auto data = buffer_.data();
+        std::string_view pending(static_cast<const char*>(data.data()), data.size());
+        uint32_t size = 0;
+        std::string_view piece;
+        const bool whole = peek_chunked_piece(pending, size, piece);
+        if (pending.size() >= 4 && size > piece_max)
+            return false;
+        if (!whole)
+            break;
+        process_chunked_piece(piece);
+        buffer_.consume(4 + piece.size());
+    }
+    if (message_done && buffer_.size() != 0) {
+        send(control(ControlOp::RoomMessageFailure).add("Invalid packet: truncated chunked frame"));
+        buffer_.consume(buffer_.size());
+    }
+    return true;
+}
+
+// Closes with 1009, as Beast does when its own limit is hit. The rest of the
+// message is never read.
+void Session::refuse_too_big() {
+    server_->metrics().messages_too_big.add();
+    warn_limited(size_errors, "Message over ", server_->config().read_message_max, " bytes, closing");
+    buffer_.consume(buffer_.size());
+    read_state_ = ReadState::Start;
+    ws_.async_close(ws::close_code::too_big, [self = shared_from_this()](beast::error_code ec) {
+        self->closed(ec);
+    });
+}
+
+// Over its rate, a session is not refused: its next read waits for a token,
+// so the excess backs up in the socket and, through TCP, in the sender. So
+// does a session holding more than the file window of its own file chunks,
+// until flush_file_chunks relays them.
+void Session::read_next() {
+    if (held_file_bytes_ > server_->config().file_window_bytes) {
+        reads_held_ = true;
+        return;
+    }
+    if (read_pause_ns_ == 0) {
+        do_read();
+        return;
+    }
+    server_->metrics().reads_paused.add();
+    timer_.expires_after(std::chrono::nanoseconds(read_pause_ns_));
+    read_pause_ns_ = 0;
+    timer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+        if (!ec)
+            self->do_read();
+    });
+}
+
+// Relays held file chunks until one leaves a member more than the window
+// behind; the rest wait until that member catches up (on_file_drained) or
+// the stall timeout drops it (on_file_stall). A last chunk never waits.
+void Session::flush_file_chunks() {
+    const ServerConfig& config = server_->config();
+    while (!file_wait_room_ && !held_files_.empty()) {
+        HeldFileChunk held = std::move(held_files_.front());
+        held_files_.pop_front();
+        held_file_bytes_ -= held.frame->size();
+        const size_t backlog = server_->relay_file_chunk(*held.room, held.frame, this, held.transfer, held.last);
+        if (held.last)
+            open_files_.erase(held.transfer);
+        else if (open_files_.find(held.transfer) == open_files_.end())
+            open_files_.emplace(held.transfer, OpenFile{held.room, file_abort_frame(*held.frame, file_chunk_last)});
+        if (held.last || backlog <= config.file_window_bytes ||
+            !server_->watch_file_backlog(*held.room, shared_from_this(), held.transfer))
+            continue;
+        server_->metrics().file_waits.add();
+        file_wait_room_ = held.room;
+        file_wait_transfer_ = std::move(held.transfer);
+        file_wait_frame_ = std::move(held.frame);
+        file_wait_deadline_ = std::chrono::steady_clock::now() + std::chrono::seconds(config.file_stall_timeout);
+        file_timer_.expires_at(file_wait_deadline_);
+        file_timer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+            if (!ec)
+                self->on_file_stall();
         });
+    }
+    if (reads_held_ && held_file_bytes_ <= config.file_window_bytes) {
+        reads_held_ = false;
+        read_next();
+    }
+}
+
+// A member this session waits on caught up, or left. Others may still be
+// behind, in which case this waits on them instead.
+void Session::on_file_drained() {
+    if (!file_wait_room_ || server_->watch_file_backlog(*file_wait_room_, shared_from_this(), file_wait_transfer_))
+        return;
+    file_wait_room_ = nullptr;
+    file_wait_frame_.reset();
+    file_timer_.cancel();
+    flush_file_chunks();
+}
+
+// The deadline check catches a timer that fired just as its wait ended.
+void Session::on_file_stall() {
+    if (!file_wait_room_ || std::chrono::steady_clock::now() < file_wait_deadline_)
+        return;
+    server_->drop_file_laggards(*file_wait_room_, this, *file_wait_frame_, file_wait_transfer_);
+    file_wait_room_ = nullptr;
+    file_wait_frame_.reset();
+    flush_file_chunks();
+}
+
+// A room over its rate refuses the frame before it is decrypted or fanned out.
+bool Session::admit(Room& room) {
+    if (room.rate_limit().try_acquire())
+        return true;
+    server_->metrics().rate_limited.add();
+    send(control(ControlOp::RoomMessageFailure).add("Rate limited"));
+    return false;
+}
+
+void Session::set_timeouts() {
+    const ServerConfig& config = server_->config();
+    ws::stream_base::timeout timeout;
+    timeout.handshake_timeout = config.handshake_timeout ? std::chrono::seconds(config.handshake_timeout)
+                                                         : ws::stream_base::none();
+    timeout.idle_timeout = config.idle_timeout ? std::chrono::seconds(config.idle_timeout)
+                                               : ws::stream_base::none();
+    timeout.keep_alive_pings = config.keep_alive_pings;
+    ws_.set_option(timeout);
+}
+
+// A half-open connection never completes a read with an error of its own;
+// the timeouts above are what end it, and those count as reaped.
+void Session::closed(beast::error_code ec) {
+    if (ec == beast::error::timeout || timed_out_) {
+        server_->metrics().sessions_reaped.add();
+        LogLine(LogLevel::Debug) << "[Reaped] " << (current_room_.empty() ? "no room" : current_room_) << " "
+                                 << nickname_;
+    }
+    if (deflate_)
+        record_deflate_stats();
+    // Chunks still held are dropped; members partway through a transfer are
+    // told it ended rather than left waiting for the rest.
+    held_files_.clear();
+    for (auto& [transfer, open] : open_files_)
+        server_->relay_file_chunk(*open.room, std::move(open.abort), this, transfer, true);
+    open_files_.clear();
+    server_->remove_session(shared_from_this());
+    std::vector<std::weak_ptr<Session>> waiters;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        waiters.swap(file_waiters_);
+    }
+    notify_file_waiters(std::move(waiters));
+}
+
+// Compares the payload bytes written with what reached the socket; the
+// kernel's count includes the handshake and frame headers, so the ratio is
+// slightly pessimistic for short sessions.
+void Session::record_deflate_stats() {
+    if (deflate_wire_bytes_ == 0)
+        return;
+    server_->record_deflate(deflate_payload_bytes_, deflate_wire_bytes_, deflate_cpu_ns_);
+}
+
+// Taken after every completed write: by the time a session is closed, its
+// socket usually is too, and the kernel's count is gone with it.
+void Session::sample_deflate_stats() {
+    const uint64_t wire_bytes = socket_bytes_sent(beast::get_lowest_layer(ws_).native_handle());
+    if (wire_bytes == 0)
+        return;
+    deflate_wire_bytes_ = wire_bytes;
+    deflate_payload_bytes_ = bytes_sent_.load(std::memory_order_relaxed);
+}
+
+void Session::process_binary_message(std::string_view frame) {
+    if (is_control_frame(frame)) {
+        process_control_frame(frame);
+        return;
+    }
+    if (is_file_chunk_frame(frame)) {
+        process_file_chunk(frame);
+        return;
+    }
+    const auto received = std::chrono::steady_clock::now();
+    if (is_compact_room_frame(frame))
+        process_compact_room_message(frame);
+    else
+        process_binary_room_message(frame);
+    record_room_message(received);
+}
+
+void Session::record_room_message(std::chrono::steady_clock::time_point received) {
+    MikoServer::ServerMetrics& metrics = server_->metrics();
+    metrics.room_messages.add();
+    metrics.receive_to_broadcast_ns.record(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - received).count()));
 }
 
-void Session::process_binary_room_message(const std::vector<unsigned char>& bin_msg) {
+void Session::process_binary_room_message(std::string_view frame) {
+    read_pause_ns_ = read_limit_.acquire();
     try {
-        RoomMessage rm = unpack_room_message(bin_msg);
-        const Room* room = server_->get_room(rm.room_id);
+        RoomMessageView rm = unpack_room_message(frame);
+        if (server_->config().relay) {
+            // Relay mode: the server never sees plaintext. Check the header
+            // against this session's state and forward the frame unchanged.
+            if (rm.room_id != current_room_ || rm.nickname != nickname_) {
+                send(control(ControlOp::RoomMessageFailure).add("Not joined to this room"));
+                return;
+            }
+            Room* room = server_->get_room(rm.room_id);
+            if (!room || !admit(*room))
+                return;
+            // The one copy: the read buffer is reused, the broadcast outlives it.
+            server_->relay_room_message(*room, std::make_shared<const std::string>(frame));
+            return;
+        }
+        Room* room = server_->get_room(rm.room_id);
         if (!room) {
-            send("/CMD room-message-failure Room not found");
+            send(control(ControlOp::RoomMessageFailure).add("Room not found"));
+            return;
+        }
+        if (!admit(*room))
+            return;
+        broadcast_decrypted(*room, rm.nickname, rm.encrypted_payload);
+    } catch (const std::exception& e) {
+        send(control(ControlOp::RoomMessageFailure).add(e.what()));
+    }
+}
+
+// Decrypt into this session's scratch buffers, whose capacity is reused, and
+// broadcast the text.
+void Session::broadcast_decrypted(Room& room, std::string_view nickname, std::string_view encrypted_payload) {
+    AESHelper aes(room.get_key(), room.get_cipher());
+    try {
+        aes.decrypt(encrypted_payload, plaintext_);
+    } catch (const std::exception&) {
+        server_->metrics().decrypt_failures.add();
+        throw;
+    }
+    if (room.compressed()) {
+        decompress_payload(plaintext_, inflated_);
+        server_->send_room_message(room, nickname, inflated_);
+        return;
+    }
+    server_->send_room_message(room, nickname, plaintext_);
+}
+
+// The room and sender are checked by number: the handle must be the room
+// this session is in now, so frames sent before a switch are refused.
+void Session::process_compact_room_message(std::string_view frame) {
+    read_pause_ns_ = read_limit_.acquire();
+    try {
+        CompactRoomMessageView rm = unpack_compact_room_message(frame);
+        if (rm.room_handle != current_handle_ || rm.room_handle >= room_handles_.size() ||
+            rm.sender_id != sender_id_) {
+            send(control(ControlOp::RoomMessageFailure).add("Not joined to this room"));
             return;
         }
-        AESHelper aes(room->get_key());
-        std::string plaintext = aes.decrypt(rm.encrypted_payload);
-        server_->send_room_message(rm.room_id, rm.nickname, plaintext);
+        Room& room = *room_handles_[rm.room_handle];
+        if (!admit(room))
+            return;
+        forward_room_payload(room, rm.encrypted_payload);
     } catch (const std::exception& e) {
-        send(std::string("/CMD room-message-failure ") + e.what());
+        send(control(ControlOp::RoomMessageFailure).add(e.what()));
     }
 }
 
+// Each piece counts as a room message of its own, for rate limits, history
+// and metrics alike.
+void Session::process_chunked_piece(std::string_view piece) {
+    const auto received = std::chrono::steady_clock::now();
+    read_pause_ns_ = read_limit_.acquire();
+    try {
+        if (admit(*chunked_room_))
+            forward_room_payload(*chunked_room_, piece);
+    } catch (const std::exception& e) {
+        send(control(ControlOp::RoomMessageFailure).add(e.what()));
+    }
+    record_room_message(received);
+}
+
+// File chunks are not room messages and skip the history, but they count
+// against the session's and the room's rate limits, as one message per
+// file_token_bytes. A chunk is never refused, which would break the
+// transfer: as for a session over its rate, the sender's next read waits
+// for the tokens it took, from whichever limit is further behind. The
+// members set the pace as well: while one has more than file_window_bytes
+// of the transfer queued, this session's chunks are held here rather than
+// relayed. Its reads go on, so chat behind the chunks still gets through,
+// until it holds a window's worth itself. The wait is bounded: a member
+// still behind after file_stall_timeout is dropped from the transfer, so
+// one that stops reading cannot stall the sender.
+void Session::process_file_chunk(std::string_view frame) {
+    try {
+        FileChunkView chunk = unpack_file_chunk(frame);
+        if (chunk.room_handle != current_handle_ || chunk.room_handle >= room_handles_.size()) {
+            send(control(ControlOp::RoomMessageFailure).add("Not joined to this room"));
+            return;
+        }
+        Room& room = *room_handles_[chunk.room_handle];
+        const uint32_t tokens = static_cast<uint32_t>((frame.size() + file_token_bytes - 1) / file_token_bytes);
+        read_pause_ns_ = std::max(read_limit_.acquire_n(tokens), room.rate_limit().acquire_n(tokens));
+        std::string out;
+        pack_file_relay(out, room.get_id(), nickname_, chunk);
+        held_file_bytes_ += out.size();
+        held_files_.push_back({&room, std::make_shared<const std::string>(std::move(out)),
+                               file_transfer_key(room.get_id(), nickname_, chunk.transfer_id),
+                               (chunk.flags & file_chunk_last) != 0});
+        flush_file_chunks();
+    } catch (const std::exception& e) {
+        send(control(ControlOp::RoomMessageFailure).add(e.what()));
+    }
+}
+
+void Session::forward_room_payload(Room& room, std::string_view encrypted_payload) {
+    if (server_->config().relay) {
+        // Members get the full frame, which they can read without this
+        // connection's numbers.
+        std::string out;
+        out.reserve(12 + room.get_id().size() + nickname_.size() + encrypted_payload.size());
+        pack_view(out, room.get_id());
+        pack_view(out, nickname_);
+        pack_view(out, encrypted_payload);
+        server_->relay_room_message(room, std::make_shared<const std::string>(std::move(out)));
+        return;
+    }
+    broadcast_decrypted(room, nickname_, encrypted_payload);
+}
+
 void Session::process_command(const std::string& cmd) {
     std::istringstream iss(cmd);
     std::string prefix, subcmd;
     iss >> prefix >> subcmd;
     if (subcmd == "create-room") {
-        // Optionally, the command may include a room name.
+        // Optionally, "--cipher <name>" and "--compress" before the room name.
+        std::string cipher;
+        std::string compression;
         std::string room_name;
-        std::getline(iss, room_name);
-        // Trim whitespace.
-        room_name.erase(room_name.begin(), std::find_if(room_name.begin(), room_name.end(), [](unsigned char ch){ return !std::isspace(ch); }));
-        std::string room_id = server_->create_room(room_name);
-        // Retrieve the room name from the created room.
-        const Room* room = server_->get_room(room_id);
-        std::string rname = room ? room->get_name() : room_id;
-        send("/CMD room-created " + room_id + " " + rname);
+        std::string word;
+        while (iss >> word) {
+            if (word == "--cipher") {
+                iss >> cipher;
+            } else if (word == "--compress") {
+                compression = "deflate";
+            } else {
+                std::getline(iss, room_name);
+                room_name.insert(0, word);
+                break;
+            }
+        }
+        handle_create_room(room_name, cipher, compression);
     } else if (subcmd == "join-room") {
-        std::string room_id, room_key, nick;
+        std::string room_id, room_key, nick, option;
         iss >> room_id >> room_key >> nick;
-        if (room_id.empty() || room_key.empty() || nick.empty()) {
-            send("/CMD join-failure Invalid parameters");
-            return;
-        }
-        bool success = server_->join_room(room_id, room_key, shared_from_this(), nick);
-        if (success) {
-            set_nickname(nick);
-            join_room(room_id);
-            // Retrieve room name.
-            const Room* room = server_->get_room(room_id);
-            std::string rname = room ? room->get_name() : room_id;
-            send("/CMD join-success " + room_id + " " + rname);
-        } else {
-            send("/CMD join-failure Invalid room or key");
+        // Optional history selection: "--last N" or "--since SEQ".
+        uint64_t value = 0;
+        if (iss >> option) {
+            if ((option != "--last" && option != "--since") || !(iss >> value)) {
+                send(control(ControlOp::JoinFailure).add("Invalid parameters"));
+                return;
+            }
+            option.erase(0, 2);
         }
+        handle_join_room(room_id, room_key, nick, option, value);
     } else if (subcmd == "nick") {
         std::string newnick;
         iss >> newnick;
-        if (newnick.empty()) {
-            send("/CMD nick-failure Missing nickname");
-            return;
-        }
-        set_nickname(newnick);
-        send("/CMD nick-changed " + newnick);
+        handle_nick(newnick);
+    } else if (subcmd == "stats") {
+        std::string token;
+        iss >> token;
+        handle_stats(token);
     } else if (subcmd == "room-message") {
         // Process binary room-message as before.
         // (Assuming binary message handling remains the same as previously described.)
         const std::string text_prefix = "/CMD room-message ";
         if (cmd.compare(0, text_prefix.size(), text_prefix) == 0) {
-            std::string binary_payload = cmd.substr(text_prefix.size());
-            std::vector<unsigned char> packet(binary_payload.begin(), binary_payload.end());
-            try {
-                RoomMessage rm = unpack_room_message(packet);
-                const Room* room = server_->get_room(rm.room_id);
-                if (!room) {
-                    send("/CMD room-message-failure Room not found");
-                    return;
-                }
-                AESHelper aes(room->get_key());
-                std::string plaintext = aes.decrypt(rm.encrypted_payload);
-                server_->send_room_message(rm.room_id, rm.nickname, plaintext);
-            } catch (const std::exception& e) {
-                send(std::string("/CMD room-message-failure ") + e.what());
-            }
+            process_binary_room_message(std::string_view(cmd).substr(text_prefix.size()));
         }
     } else {
-        std::cerr << "Unknown command: " << subcmd << std::endl;
+        warn_limited(command_errors, "Unknown command: ", subcmd);
+    }
+}
+
+void Session::process_control_frame(std::string_view frame) {
+    try {
+        ControlReader reader(frame);
+        switch (reader.op()) {
+        case ControlOp::CreateRoom: {
+            std::string_view name = reader.text();
+            std::string_view cipher = reader.text();
+            std::string_view compression = reader.more() ? reader.text() : std::string_view();
+            handle_create_room(name, cipher, compression);
+            break;
+        }
+        case ControlOp::JoinRoom: {
+            std::string_view room_id = reader.text();
+            std::string_view room_key = reader.text();
+            std::string_view nick = reader.text();
+            std::string_view history;
+            uint64_t count = 0;
+            if (reader.more()) {
+                history = reader.text();
+                count = reader.number();
+            }
+            handle_join_room(room_id, room_key, nick, history, count);
+            break;
+        }
+        case ControlOp::Nick:
+            handle_nick(reader.text());
+            break;
+        case ControlOp::Stats:
+            handle_stats(reader.text());
+            break;
+        default:
+            warn_limited(command_errors, "Unknown control op: ", static_cast<int>(reader.op()));
+        }
+    } catch (const std::exception& e) {
+        warn_limited(command_errors, "Bad control frame: ", e.what());
+    }
+}
+
+// 'compression' is "deflate", or "none" or empty for none.
+void Session::handle_create_room(std::string_view name, std::string_view requested_cipher,
+                                 std::string_view compression) {
+    CipherMode cipher = server_->config().default_cipher;
+    if (!requested_cipher.empty() && !parse_cipher(std::string(requested_cipher), cipher)) {
+        send(control(ControlOp::RoomFailure).add("Unknown cipher").add(requested_cipher));
+        return;
+    }
+    if (!compression.empty() && compression != "none" && compression != "deflate") {
+        send(control(ControlOp::RoomFailure).add("Unknown compression").add(compression));
+        return;
+    }
+    // Names are stored one per line in room.meta and echoed to terminals.
+    if (std::any_of(name.begin(), name.end(), [](unsigned char c) { return c < 0x20 || c == 0x7f; })) {
+        send(control(ControlOp::RoomFailure).add("Invalid room name"));
+        return;
+    }
+    std::string room_id = server_->create_room(std::string(name), cipher, compression == "deflate");
+    // Retrieve the room name from the created room.
+    const Room* room = server_->get_room(room_id);
+    send(control(ControlOp::RoomCreated).add(room_id).add(room ? room->get_name() : room_id));
+}
+
+// 'history' is "last" or "since" with 'count', or empty for the configured
+// default replay.
+void Session::handle_join_room(std::string_view room_id, std::string_view room_key, std::string_view nick,
+                               std::string_view history, uint64_t count) {
+    if (room_id.empty() || room_key.empty() || nick.empty() ||
+        (!history.empty() && history != "last" && history != "since")) {
+        send(control(ControlOp::JoinFailure).add("Invalid parameters"));
+        return;
+    }
+    const bool since = history == "since";
+    if (history.empty())
+        count = server_->config().history_replay;
+    const std::string id(room_id);
+    Cluster* cluster = server_->cluster();
+    if (cluster && !cluster->owns(id) && !server_->get_room(id)) {
+        // Owned by another node: have it check the key, then join the local
+        // mirror it leaves behind.
+        cluster->join(id, std::string(room_key),
+            [self = shared_from_this(), id, key = std::string(room_key), nick = std::string(nick),
+             history = std::string(history), count](std::optional<Cluster::RemoteRoom> remote) {
+                net::post(self->ws_.get_executor(), [self, remote = std::move(remote), id, key, nick, history, count] {
+                    if (!remote) {
+                        self->send(self->control(ControlOp::JoinFailure).add("Invalid room or key"));
+                        return;
+                    }
+                    self->server_->add_mirror(*remote);
+                    self->handle_join_room(id, key, nick, history, count);
+                });
+            });
+        return;
+    }
+    bool success = server_->join_room(id, std::string(room_key), shared_from_this(), std::string(nick),
+        [&](Room& room, uint64_t first_seq, uint64_t next_seq) {
+            set_nickname(std::string(nick));
+            auto known = std::find(room_handles_.begin(), room_handles_.end(), &room);
+            if (known == room_handles_.end())
+                known = room_handles_.insert(known, &room);
+            current_handle_ = static_cast<uint32_t>(known - room_handles_.begin());
+            uint64_t from = since ? std::min(count, next_seq) : next_seq - std::min(count, next_seq);
+            from = std::max(from, first_seq);
+            // The replay covers [replay, seq); live messages continue at seq.
+            send(control(ControlOp::JoinSuccess)
+                     .add(id)
+                     .add(room.get_name())
+                     .add("cipher", cipher_name(room.get_cipher()))
+                     .add("seq", next_seq)
+                     .add("replay", from)
+                     .add("handle", current_handle_)
+                     .add("sender", sender_id_)
+                     .add("compress", room.compressed() ? "deflate" : "none"));
+            send_history(&room, from, next_seq);
+        });
+    if (!success) {
+        send(control(ControlOp::JoinFailure).add("Invalid room or key"));
+    }
+}
+
+void Session::handle_nick(std::string_view nick) {
+    if (nick.empty()) {
+        send(control(ControlOp::NickFailure).add("Missing nickname"));
+        return;
+    }
+    set_nickname(std::string(nick));
+    send(control(ControlOp::NickChanged).add(nick));
+}
+
+// Admin only: the reply carries every registered metric by name.
+void Session::handle_stats(std::string_view token) {
+    const std::string& expected = server_->config().admin_token;
+    if (expected.empty() || token.size() != expected.size() ||
+        CRYPTO_memcmp(token.data(), expected.data(), expected.size()) != 0) {
+        send(control(ControlOp::StatsFailure).add(expected.empty() ? "Stats disabled" : "Bad admin token"));
+        return;
     }
+    ControlWriter reply = control(ControlOp::StatsResult);
+    server_->metrics_registry().for_each_value([&](std::string_view name, uint64_t value) {
+        reply.add_named(name, value);
+    });
+    send(reply);
 }
 
 void Session::send(const std::string& msg) {
-    ws_.async_write(net::buffer(msg),
-        [self = shared_from_this()](beast::error_code ec, std::size_t) {
-            if (ec)
-                std::cerr << "Send error: " << ec.message() << std::endl;
+    enqueue({std::make_shared<const std::string>(msg), FrameKind::Control});
+}
+
+void Session::send(ControlWriter& message) {
+    enqueue({std::make_shared<const std::string>(message.take()), FrameKind::Control});
+}
+
+ControlWriter Session::control(ControlOp op) const {
+    return ControlWriter(op, binary_control_);
+}
+
+void Session::send_chat(SharedBuffer line, uint64_t seq) {
+    enqueue({std::move(line), FrameKind::Chat, nullptr, seq, seq + 1});
+}
+
+void Session::send_relay(SharedBuffer frame) {
+    enqueue({std::move(frame), FrameKind::Relay});
+}
+
+bool Session::send_file_chunk(SharedBuffer frame, std::string_view transfer, bool last) {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        auto dropped = dropped_transfers_.find(transfer);
+        if (dropped != dropped_transfers_.end()) {
+            if (last)
+                dropped_transfers_.erase(dropped);
+            return false;
         }
-    );
-}
\ No newline at end of file
+    }
+    if (file_queued_bytes() + frame->size() > 2 * server_->config().file_window_bytes) {
+        drop_file_transfer(*frame, transfer);
+        return false;
+    }
+    enqueue({std::move(frame), FrameKind::File});
+    return true;
+}
+
+void Session::drop_file_transfer(const std::string& frame, std::string_view transfer) {
+    FileChunkView chunk = unpack_file_relay(frame);
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        // Nothing follows a last chunk, so there is nothing left to skip.
+        if (chunk.flags & file_chunk_last ? dropped_transfers_.count(transfer) != 0
+                                          : !dropped_transfers_.emplace(transfer).second)
+            return;
+    }
+    server_->metrics().file_drops.add();
+    LogLine(LogLevel::Debug) << "[File] Member dropped from " << chunk.nickname << "'s transfer in " << chunk.room_id;
+    enqueue({file_abort_frame(frame), FrameKind::File});
+}
+
+bool Session::watch_file_drain(const std::shared_ptr<Session>& sender, std::string_view transfer) {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    if (file_queued_bytes() <= server_->config().file_window_bytes || dropped_transfers_.count(transfer) != 0)
+        return false;
+    for (const auto& waiter : file_waiters_) {
+        if (waiter.lock() == sender)
+            return true;
+    }
+    file_waiters_.push_back(sender);
+    return true;
+}
+
+void Session::notify_file_waiters(std::vector<std::weak_ptr<Session>> waiters) {
+    for (const auto& waiter : waiters) {
+        if (auto sender = waiter.lock())
+            net::post(sender->ws_.get_executor(), [sender]() { sender->on_file_drained(); });
+    }
+}
+
+void Session::send_history(const Room* room, uint64_t from, uint64_t end) {
+    if (from < end)
+        enqueue({nullptr, FrameKind::Replay, room, from, end});
+}
+
+void Session::enqueue(Outbound entry) {
+    const ServerConfig& config = server_->config();
+    const size_t size = entry.data ? entry.data->size() : 0;
+    bool start_write = false;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        if (closing_)
+            return;
+        size_t queued = queued_bytes_.load(std::memory_order_relaxed);
+        if (queued + size > config.send_queue_high_water) {
+            frames_dropped_.fetch_add(1, std::memory_order_relaxed);
+            server_->metrics().frames_dropped.add();
+            if (config.send_overflow == OverflowPolicy::Disconnect) {
+                warn_limited(overflow_errors, "Send queue overflow (", queued, " bytes), disconnecting");
+                closing_ = true;
+                net::post(ws_.get_executor(), [self = shared_from_this()]() {
+                    beast::error_code ignored;
+                    self->ws_.next_layer().close(ignored);
+                });
+            }
+            return;
+        }
+        queued_bytes_.store(queued + size, std::memory_order_relaxed);
+        if (entry.kind == FrameKind::File) {
+            file_queued_bytes_.fetch_add(size, std::memory_order_relaxed);
+            file_queue_.push_back(std::move(entry));
+        } else {
+            queue_.push_back(std::move(entry));
+        }
+        queue_depth_.store(queue_.size() + file_queue_.size(), std::memory_order_relaxed);
+        start_write = !writing_;
+        writing_ = true;
+    }
+    // Only an idle session needs a hop onto its strand; a busy one picks the
+    // frame up when its current write completes.
+    if (start_write)
+        net::post(ws_.get_executor(), [self = shared_from_this()]() { self->do_write(); });
+}
+
+// While a replay marker is at the head of the queue, put the next history
+// chunk in front of it, or drop it once the replay is done. The room is read
+// without queue_mutex_ held: broadcasts take the room lock first. Only the
+// strand touches the head of the queue, so the marker stays put meanwhile.
+// Returns false if the queue ran empty. Once it is empty, the next file
+// chunk moves up into it.
+bool Session::expand_replay() {
+    const bool relay = server_->config().relay;
+    const size_t chunk_max = server_->config().send_coalesce_max;
+    for (;;) {
+        Outbound marker;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            if (queue_.empty() && !file_queue_.empty()) {
+                queue_.push_back(std::move(file_queue_.front()));
+                file_queue_.pop_front();
+            }
+            if (queue_.empty()) {
+                writing_ = false;
+                return false;
+            }
+            if (queue_.front().kind != FrameKind::Replay)
+                return true;
+            marker = queue_.front();
+        }
+        Room::HistorySlice slice = marker.replay_room->read_since(
+            marker.seq, marker.seq_end - marker.seq, chunk_max);
+
+        // Relayed history entries are self-delimiting frames; chat lines are
+        // joined with newlines, as live ones are when coalesced.
+        std::string chunk;
+        for (const auto& message : slice.messages) {
+            if (!relay && !chunk.empty())
+                chunk += '\n';
+            chunk += message;
+        }
+
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        const uint64_t next = slice.first_seq + slice.messages.size();
+        if (slice.messages.empty() || next >= marker.seq_end) {
+            queue_.pop_front();
+        } else {
+            queue_.front().seq = next;
+        }
+        if (!chunk.empty()) {
+            queued_bytes_.fetch_add(chunk.size(), std::memory_order_relaxed);
+            queue_.push_front({std::make_shared<const std::string>(std::move(chunk)),
+                               relay ? FrameKind::Relay : FrameKind::Chat, nullptr, slice.first_seq, next});
+        }
+        queue_depth_.store(queue_.size() + file_queue_.size(), std::memory_order_relaxed);
+    }
+}
+
+void Session::do_write() {
+    static const char newline = '\n';
+    const size_t coalesce_max = server_->config().send_coalesce_max;
+
+    if (!expand_replay())
+        return;
+
+    // One write in flight at a time: take the front frame, plus any frames
+    // of the same kind queued directly behind it while the previous write
+    // was pending. Chat lines are joined with newlines; relay frames are
+    // self-delimiting and simply concatenated. Binary control sessions get
+    // chat as a chat batch, which only covers consecutive messages.
+    FrameKind kind;
+    bool batch = false;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        write_buffers_.clear();
+        const Outbound& front = queue_.front();
+        kind = front.kind;
+        batch = kind == FrameKind::Chat && binary_control_;
+        if (batch)
+            write_buffers_.emplace_back(); // the header, once the batch is known
+        write_buffers_.push_back(net::buffer(*front.data));
+        size_t bytes = front.data->size();
+        uint64_t seq_end = front.seq_end;
+        in_flight_ = 1;
+        const size_t separator = kind == FrameKind::Chat ? 1 : 0;
+        if (kind == FrameKind::Chat || kind == FrameKind::Relay) {
+            while (in_flight_ < queue_.size()) {
+                const Outbound& next = queue_[in_flight_];
+                if (next.kind != kind || bytes + separator + next.data->size() > coalesce_max ||
+                    (batch && next.seq != seq_end))
+                    break;
+                if (separator)
+                    write_buffers_.push_back(net::buffer(&newline, 1));
+                write_buffers_.push_back(net::buffer(*next.data));
+                bytes += separator + next.data->size();
+                seq_end = next.seq_end;
+                ++in_flight_;
+            }
+        }
+        if (batch) {
+            chat_header_.clear();
+            pack_chat_batch_header(chat_header_, front.seq, static_cast<uint32_t>(seq_end - front.seq));
+            write_buffers_.front() = net::buffer(chat_header_);
+        }
+    }
+    // The strings stay put while other threads append to queue_, so the
+    // buffers remain valid without holding the lock during the write.
+    BufferView view{write_buffers_.data(), write_buffers_.data() + write_buffers_.size()};
+    ws_.binary(batch || kind == FrameKind::Relay || kind == FrameKind::File ||
+               (kind == FrameKind::Control && binary_control_));
+    // Starting the write compresses the message, or its first part for
+    // messages larger than the stream's write buffer, so timing it here
+    // approximates the deflate CPU cost.
+    const uint64_t cpu_start = deflate_ ? thread_cpu_ns() : 0;
+    ws_.async_write(view, bind_handler_memory(write_memory_,
+        [self = shared_from_this()](beast::error_code ec, std::size_t bytes_transferred) {
+            self->bytes_sent_.fetch_add(bytes_transferred, std::memory_order_relaxed);
+            self->server_->metrics().bytes_out.add(bytes_transferred);
+            self->on_write(ec);
+        }));
+    if (deflate_)
+        deflate_cpu_ns_ += thread_cpu_ns() - cpu_start;
+}
+
+void Session::on_write(beast::error_code ec) {
+    bool more = false;
+    std::vector<std::weak_ptr<Session>> drained;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        if (ec) {
+            // The read side sees the same failure and removes the session.
+            closing_ = true;
+            writing_ = false;
+            queue_.clear();
+            file_queue_.clear();
+            in_flight_ = 0;
+            queue_depth_.store(0, std::memory_order_relaxed);
+            queued_bytes_.store(0, std::memory_order_relaxed);
+            file_queued_bytes_.store(0, std::memory_order_relaxed);
+            drained.swap(file_waiters_);
+        } else {
+            size_t released = 0;
+            for (size_t i = 0; i < in_flight_; ++i) {
+                released += queue_.front().data->size();
+                if (queue_.front().kind == FrameKind::File)
+                    file_queued_bytes_.fetch_sub(queue_.front().data->size(), std::memory_order_relaxed);
+                queue_.pop_front();
+            }
+            in_flight_ = 0;
+            queued_bytes_.fetch_sub(released, std::memory_order_relaxed);
+            queue_depth_.store(queue_.size() + file_queue_.size(), std::memory_order_relaxed);
+            more = writing_ = !queue_.empty() || !file_queue_.empty();
+            if (!file_waiters_.empty() && file_queued_bytes() <= server_->config().file_window_bytes)
+                drained.swap(file_waiters_);
+        }
+    }
+    notify_file_waiters(std::move(drained));
+    if (ec) {
+        server_->metrics().send_errors.add();
+        warn_limited(send_errors, "Send error: ", ec.message());
+        return;
+    }
+    if (deflate_)
+        sample_deflate_stats();
+    if (more)
+        do_write();
+}
@@ -5,28 +5,110 @@
 #pragma once
 #include <boost/beast/websocket.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
 #include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <string_view>
+#include <vector>
+#include "HandlerMemory.hpp"
+#include "RateLimiter.hpp"
 
 namespace beast = boost::beast;
 namespace ws = boost::beast::websocket;
+namespace http = boost::beast::http;
 using tcp = boost::asio::ip::tcp;
 
+// An immutable frame body, shared by every recipient of a broadcast.
+using SharedBuffer = std::shared_ptr<const std::string>;
+
 // Forward declaration of ChatServer
 class MikoServer;
+class Room;
+class ControlWriter;
+
+// Whether this Beast can leave messages under ServerConfig::deflate_threshold
+// uncompressed.
+bool deflate_threshold_supported();
+enum class ControlOp : uint8_t;
 
 class Session : public std::enable_shared_from_this<Session> {
 public:
-    Session(tcp::socket socket, std::shared_ptr<MikoServer> server);
+    // The socket carries its strand as a concrete executor type. Going through
+    // the type-erased any_io_executor allocates on every post and completion.
+    using strand_type = boost::asio::strand<boost::asio::io_context::executor_type>;
+    using socket_type = boost::asio::basic_stream_socket<tcp, strand_type>;
+    using timer_type = boost::asio::basic_waitable_timer<std::chrono::steady_clock,
+                                                         boost::asio::wait_traits<std::chrono::steady_clock>,
+                                                         strand_type>;
+
+    // The read buffer comes from, and goes back to, the server's
+    // SessionPool; the server also allocates the Session itself from it.
+    Session(socket_type socket, std::shared_ptr<MikoServer> server);
+    ~Session();
     void start();
     void client_start(const std::string& host);
     void do_read();
 
-    void process_binary_room_message(const std::vector<unsigned char> &bin_msg);
+    // Handles one binary message: a control frame, or a room frame in the
+    // full or compact form. 'frame' may point straight into the read buffer
+    // and is not used after this returns.
+    void process_binary_message(std::string_view frame);
+    void process_binary_room_message(std::string_view frame);
+    void process_compact_room_message(std::string_view frame);
+    // One piece of a chunked room message (see RoomFrame.hpp).
+    void process_chunked_piece(std::string_view piece);
+    void process_file_chunk(std::string_view frame);
 
+    // Text "/CMD" commands, and their binary form (see ControlFrame.hpp).
     void process_command(const std::string& cmd);
+    void process_control_frame(std::string_view frame);
+
+    // Queue a frame for this session; safe to call from any thread. Control
+    // replies go out as their own text message. Chat lines queued behind a
+    // pending write are coalesced into one newline-separated text message,
+    // relayed room frames into one binary message. The queue holds the shared
+    // buffer itself, so a broadcast costs no copy per recipient.
     void send(const std::string& msg);
+    void send(ControlWriter& message); // takes the message's contents
+    void send_chat(SharedBuffer line, uint64_t seq);
+    void send_relay(SharedBuffer frame);
+    // File chunks wait in a queue of their own, written only when nothing
+    // else is queued, so a transfer never holds up chat on this connection.
+    // 'transfer' is the chunk's file_transfer_key. Returns false, queueing
+    // nothing, once this member has been dropped from the transfer; one
+    // with more than twice the file window queued is dropped now.
+    bool send_file_chunk(SharedBuffer frame, std::string_view transfer, bool last);
+    // Queues an abort chunk, made from the transfer's chunk 'frame', and
+    // skips the rest of the transfer.
+    void drop_file_transfer(const std::string& frame, std::string_view transfer);
+    // Has 'sender' told (on_file_drained) once this member's file backlog is
+    // back within the window. False if it already is, or the member has been
+    // dropped from 'transfer'.
+    bool watch_file_drain(const std::shared_ptr<Session>& sender, std::string_view transfer);
+    void on_file_drained();
+
+    // Stream the room's messages [from, end) to this session, in chunks of
+    // up to send_coalesce_max bytes read one at a time as earlier ones are
+    // written. Frames queued after this call go out after the replay.
+    void send_history(const Room* room, uint64_t from, uint64_t end);
+
+    // Outbound queue counters, readable from any thread.
+    size_t queue_depth() const { return queue_depth_.load(std::memory_order_relaxed); }
+    size_t queued_bytes() const { return queued_bytes_.load(std::memory_order_relaxed); }
+    uint64_t bytes_sent() const { return bytes_sent_.load(std::memory_order_relaxed); }
+    uint64_t frames_dropped() const { return frames_dropped_.load(std::memory_order_relaxed); }
+    size_t file_queued_bytes() const { return file_queued_bytes_.load(std::memory_order_relaxed); }
 
     // Setters for per-session state.
     void set_nickname(const std::string& nick) { nickname_ = nick; }
@@ -34,10 +116,144 @@ public:
     const std::string& get_nickname() const { return nickname_; }
     const std::string& get_room() const { return current_room_; }
 
+    // Compact room frames name the sender by this id and the room by a
+    // handle into this connection's table; join-success hands out both.
+    uint32_t sender_id() const { return sender_id_; }
+
 private:
-    ws::stream<tcp::socket> ws_;
-    beast::flat_buffer buffer_;
+    // Replay marks a history replay still in progress; it has no data and
+    // stays at the head of the queue while its chunks go out ahead of it.
+    // File chunks are queued apart, in file_queue_.
+    enum class FrameKind { Control, Chat, Relay, Replay, File };
+
+    // Where the read path is in the current message. Messages are read a
+    // buffer at a time: most are gathered whole, up to read_message_max,
+    // and handled once complete, while a chunked room message is handled a
+    // piece at a time as it arrives. A chunked message that cannot be
+    // accepted is read to its end and discarded.
+    enum class ReadState { Start, Whole, Chunked, Discard };
+
+    // A file chunk this session sent, read but not yet relayed.
+    struct HeldFileChunk {
+        Room* room;
+        SharedBuffer frame;
+        std::string transfer;
+        bool last;
+    };
+
+    // A transfer of this session's that members have started on, and the
+    // chunk that ends it for them should this session close first.
+    struct OpenFile {
+        Room* room;
+        SharedBuffer abort;
+    };
+
+    // [seq, seq_end) are the sequence numbers of the messages a chat entry
+    // carries, or of those a replay marker has still to send.
+    struct Outbound {
+        SharedBuffer data;
+        FrameKind kind;
+        const Room* replay_room = nullptr;
+        uint64_t seq = 0;
+        uint64_t seq_end = 0;
+    };
+
+    // Non-owning view over write_buffers_. Beast copies the buffer sequence
+    // into every write operation; copying this view does not allocate.
+    struct BufferView {
+        using value_type = boost::asio::const_buffer;
+        using const_iterator = const boost::asio::const_buffer*;
+        const_iterator first;
+        const_iterator last;
+        const_iterator begin() const { return first; }
+        const_iterator end() const { return last; }
+    };
+
+    void handle_create_room(std::string_view name, std::string_view requested_cipher,
+                            std::string_view compression);
+    void handle_join_room(std::string_view room_id, std::string_view room_key, std::string_view nick,
+                          std::string_view history, uint64_t count);
+    void handle_nick(std::string_view nick);
+    void handle_stats(std::string_view token);
+
+    void broadcast_decrypted(Room& room, std::string_view nickname, std::string_view encrypted_payload);
+    // Relays or decrypts a payload this session sent to 'room'.
+    void forward_room_payload(Room& room, std::string_view encrypted_payload);
+    void record_room_message(std::chrono::steady_clock::time_point received);
+
+    // A reply in whichever form this session negotiated.
+    ControlWriter control(ControlOp op) const;
+
+    void enqueue(Outbound entry);
+    bool expand_replay();
+    void do_write();
+    void on_write(beast::error_code ec);
+    void record_deflate_stats();
+    void sample_deflate_stats();
+    // The connection is gone: leave the server's sets and rooms.
+    void closed(beast::error_code ec);
+    void set_timeouts();
+    void read_next();
+    void flush_file_chunks();
+    void on_file_stall();
+    static void notify_file_waiters(std::vector<std::weak_ptr<Session>> waiters);
+    void on_read();
+    void start_chunked();
+    bool process_chunked_pieces(bool message_done);
+    void refuse_too_big();
+    bool admit(Room& room);
+
+    ws::stream<socket_type> ws_;
+    timer_type timer_; // the upgrade request's deadline, then pauses between reads
+    bool timed_out_ = false;
+    RateLimiter read_limit_;    // room messages from this session
+    int64_t read_pause_ns_ = 0; // before the next read; strand only
+
+    // This session's file chunks, while they wait for the members of
+    // file_wait_room_ to catch up on the transfer. Strand only.
+    std::deque<HeldFileChunk> held_files_;
+    size_t held_file_bytes_ = 0;
+    bool reads_held_ = false; // until held_files_ is back within the window
+    Room* file_wait_room_ = nullptr;
+    std::string file_wait_transfer_;
+    SharedBuffer file_wait_frame_; // the chunk last relayed
+    std::chrono::steady_clock::time_point file_wait_deadline_;
+    timer_type file_timer_;
+    std::map<std::string, OpenFile> open_files_; // by file_transfer_key; strand only
+    beast::flat_buffer buffer_; // emptied after each message, capacity bounded by the pool
+    ReadState read_state_ = ReadState::Start;
+    Room* chunked_room_ = nullptr; // with ReadState::Chunked
+    HandlerMemory read_memory_;  // do_read's operations
+    HandlerMemory write_memory_; // do_write's operations
     std::shared_ptr<MikoServer> server_;
     std::string nickname_ = "Anonymous";
     std::string current_room_; // empty if not in any room.
+    std::string plaintext_;    // decrypt scratch buffer
+    std::string inflated_;     // decompress scratch buffer
+    bool binary_control_ = false; // negotiated at the handshake
+    bool deflate_ = false;          // permessage-deflate negotiated
+    uint64_t deflate_cpu_ns_ = 0;   // strand only
+    uint64_t deflate_payload_bytes_ = 0; // as of the last sample, strand only
+    uint64_t deflate_wire_bytes_ = 0;    // as of the last sample, strand only
+    const uint32_t sender_id_;
+    std::vector<Room*> room_handles_;  // rooms joined on this connection, by handle
+    uint32_t current_handle_ = UINT32_MAX;
+
+    // Outbound queue. Any thread may append under queue_mutex_; writes are
+    // started and completed on this session's strand.
+    std::mutex queue_mutex_;
+    std::deque<Outbound> queue_;
+    std::deque<Outbound> file_queue_;
+    std::set<std::string, std::less<>> dropped_transfers_; // by file_transfer_key
+    std::vector<std::weak_ptr<Session>> file_waiters_;     // see watch_file_drain
+    size_t in_flight_ = 0; // queue_ entries covered by the pending write
+    bool writing_ = false; // a write is in flight or about to be started
+    bool closing_ = false;
+    std::vector<boost::asio::const_buffer> write_buffers_; // strand only
+    std::string chat_header_;                               // strand only
+    std::atomic<size_t> queue_depth_{0};
+    std::atomic<size_t> queued_bytes_{0}; // file chunks included
+    std::atomic<size_t> file_queued_bytes_{0};
+    std::atomic<uint64_t> bytes_sent_{0};
+    std::atomic<uint64_t> frames_dropped_{0};
 };
\ No newline at end of file
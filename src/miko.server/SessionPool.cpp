@@ -0,0 +1,70 @@
+//
+// Recycled memory for sessions and their read buffers.
+//
+
+#include "SessionPool.hpp"
+#include <new>
+
+SessionPool::SessionPool(size_t max_free, size_t buffer_capacity)
+    : max_free_(max_free), buffer_capacity_(buffer_capacity) {
+    // Reserved up front, so returning a block or buffer never allocates.
+    blocks_.reserve(max_free_);
+    buffers_.reserve(max_free_);
+}
+
+SessionPool::~SessionPool() {
+    for (void* block : blocks_)
+        ::operator delete(block);
+}
+
+void* SessionPool::allocate(size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (block_size_ == 0)
+            block_size_ = bytes;
+        if (bytes == block_size_ && !blocks_.empty()) {
+            void* block = blocks_.back();
+            blocks_.pop_back();
+            blocks_reused_.add();
+            return block;
+        }
+    }
+    return ::operator new(bytes);
+}
+
+void SessionPool::deallocate(void* p, size_t bytes) noexcept {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (bytes == block_size_ && blocks_.size() < max_free_) {
+            blocks_.push_back(p);
+            return;
+        }
+    }
+    ::operator delete(p);
+}
+
+boost::beast::flat_buffer SessionPool::take_buffer() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (buffers_.empty())
+        return {};
+    boost::beast::flat_buffer buffer = std::move(buffers_.back());
+    buffers_.pop_back();
+    buffers_reused_.add();
+    return buffer;
+}
+
+// A session's last read may have left data or a large buffer behind; only
+// empty buffers within the capacity are kept.
+void SessionPool::give_buffer(boost::beast::flat_buffer&& buffer) noexcept {
+    if (buffer.capacity() == 0 || buffer.capacity() > buffer_capacity_)
+        return;
+    buffer.clear();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (buffers_.size() < max_free_)
+        buffers_.push_back(std::move(buffer));
+}
+
+size_t SessionPool::free_blocks() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return blocks_.size();
+}
@@ -0,0 +1,77 @@
+//
+// Recycled memory for sessions and their read buffers.
+//
+
+#pragma once
+#include <boost/beast/core/flat_buffer.hpp>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "Metrics.hpp"
+
+// Keeps what closed sessions leave behind for the next connections: the
+// block holding a Session and its shared_ptr control block, and its read
+// buffer. Under a reconnect storm new sessions reuse these instead of going
+// back to the allocator. Sessions are allocated with PoolAllocator, which
+// keeps the pool alive until the last of them is freed. Safe to use from
+// any thread.
+class SessionPool {
+public:
+    // Keeps at most 'max_free' blocks and as many buffers, 0 disabling the
+    // pool. A buffer that grew past 'buffer_capacity' is released rather
+    // than kept, and sessions shrink theirs back to it between messages.
+    SessionPool(size_t max_free, size_t buffer_capacity);
+    ~SessionPool();
+    SessionPool(const SessionPool&) = delete;
+    SessionPool& operator=(const SessionPool&) = delete;
+
+    // Blocks all have the size of the first one; other sizes go straight to
+    // the heap.
+    void* allocate(size_t bytes);
+    void deallocate(void* p, size_t bytes) noexcept;
+
+    boost::beast::flat_buffer take_buffer();
+    void give_buffer(boost::beast::flat_buffer&& buffer) noexcept;
+
+    size_t buffer_capacity() const { return buffer_capacity_; }
+    size_t free_blocks() const;
+    const Counter& blocks_reused() const { return blocks_reused_; }
+    const Counter& buffers_reused() const { return buffers_reused_; }
+
+private:
+    const size_t max_free_;
+    const size_t buffer_capacity_;
+    mutable std::mutex mutex_;
+    size_t block_size_ = 0;
+    std::vector<void*> blocks_;
+    std::vector<boost::beast::flat_buffer> buffers_;
+    Counter blocks_reused_;
+    Counter buffers_reused_;
+};
+
+// For std::allocate_shared, which allocates one block of an internal type
+// holding the object and its reference counts.
+template <typename T>
+class PoolAllocator {
+public:
+    static_assert(alignof(T) <= alignof(std::max_align_t), "pool blocks come from operator new");
+    using value_type = T;
+
+    explicit PoolAllocator(std::shared_ptr<SessionPool> pool) noexcept : pool_(std::move(pool)) {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>& other) noexcept : pool_(other.pool_) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(pool_->allocate(n * sizeof(T))); }
+    void deallocate(T* p, size_t n) noexcept { pool_->deallocate(p, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>& other) const noexcept { return pool_ == other.pool_; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>& other) const noexcept { return pool_ != other.pool_; }
+
+private:
+    template <typename U>
+    friend class PoolAllocator;
+    std::shared_ptr<SessionPool> pool_;
+};
@@ -0,0 +1,12 @@
+//
+// Kernel socket counters.
+//
+
+#pragma once
+#include <cstdint>
+
+// Bytes the kernel has sent on a TCP socket, headers of the protocols above
+// TCP included; 0 if unavailable. Kept in its own file: <linux/tcp.h>, which
+// has the counter, clashes with the <netinet/tcp.h> Asio includes. Linux
+// only; elsewhere this always returns 0.
+uint64_t socket_bytes_sent(int fd);
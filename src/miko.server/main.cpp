@@ -1,21 +1,161 @@
 //
 // Created by cv2 on 3/23/25.
 //
+#include "Logger.hpp"
 #include "MikoServer.hpp"
 #include <boost/asio.hpp>
+#include <algorithm>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 using tcp = boost::asio::ip::tcp;
 
 int main(int argc, char* argv[]) {
     try {
-        boost::asio::io_context ioc;
-        tcp::endpoint endpoint{boost::asio::ip::make_address("127.0.0.1"), 19774};
-        auto server = std::make_shared<MikoServer>(ioc, endpoint);
+        int threads = 1;
+        std::string address = "127.0.0.1";
+        unsigned short port = 19774;
+        bool reuse_port = false;
+        ServerConfig config;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg(argv[i]);
+            if (arg == "--threads" && i + 1 < argc) {
+                threads = std::stoi(argv[++i]);
+            } else if (arg == "--bind" && i + 1 < argc) {
+                address = argv[++i];
+            } else if (arg == "--port" && i + 1 < argc) {
+                port = static_cast<unsigned short>(std::stoul(argv[++i]));
+            } else if (arg == "--reuseport") {
+                reuse_port = true;
+            } else if (arg == "--relay") {
+                config.relay = true;
+            } else if (arg == "--cipher" && i + 1 < argc) {
+                if (!parse_cipher(argv[++i], config.default_cipher)) {
+                    std::cerr << "Unknown cipher: " << argv[i] << std::endl;
+                    return EXIT_FAILURE;
+                }
+            } else if (arg == "--send-queue-hwm" && i + 1 < argc) {
+                config.send_queue_high_water = std::stoul(argv[++i]);
+            } else if (arg == "--send-coalesce-max" && i + 1 < argc) {
+                config.send_coalesce_max = std::stoul(argv[++i]);
+            } else if (arg == "--send-overflow" && i + 1 < argc) {
+                const std::string policy(argv[++i]);
+                if (policy == "drop") {
+                    config.send_overflow = OverflowPolicy::Drop;
+                } else if (policy == "disconnect") {
+                    config.send_overflow = OverflowPolicy::Disconnect;
+                } else {
+                    std::cerr << "Unknown send overflow policy: " << policy << std::endl;
+                    return EXIT_FAILURE;
+                }
+            } else if (arg == "--handshake-timeout" && i + 1 < argc) {
+                config.handshake_timeout = std::stoul(argv[++i]);
+            } else if (arg == "--idle-timeout" && i + 1 < argc) {
+                config.idle_timeout = std::stoul(argv[++i]);
+            } else if (arg == "--no-keepalive") {
+                config.keep_alive_pings = false;
+            } else if (arg == "--read-message-max" && i + 1 < argc) {
+                config.read_message_max = std::stoul(argv[++i]);
+            } else if (arg == "--file-window" && i + 1 < argc) {
+                config.file_window_bytes = std::stoul(argv[++i]);
+            } else if (arg == "--file-stall-timeout" && i + 1 < argc) {
+                config.file_stall_timeout = std::stoul(argv[++i]);
+            } else if (arg == "--session-pool" && i + 1 < argc) {
+                config.session_pool = std::stoul(argv[++i]);
+            } else if (arg == "--read-buffer-bytes" && i + 1 < argc) {
+                config.read_buffer_bytes = std::stoul(argv[++i]);
+            } else if (arg == "--session-rate" && i + 1 < argc) {
+                config.session_rate = std::stod(argv[++i]);
+            } else if (arg == "--session-burst" && i + 1 < argc) {
+                config.session_burst = std::stoul(argv[++i]);
+            } else if (arg == "--room-rate" && i + 1 < argc) {
+                config.room_rate = std::stod(argv[++i]);
+            } else if (arg == "--room-burst" && i + 1 < argc) {
+                config.room_burst = std::stoul(argv[++i]);
+            } else if (arg == "--cluster" && i + 1 < argc) {
+                std::istringstream nodes(argv[++i]);
+                std::string node;
+                while (std::getline(nodes, node, ',')) {
+                    config.cluster_nodes.push_back(node);
+                }
+            } else if (arg == "--node" && i + 1 < argc) {
+                config.cluster_self = std::stoul(argv[++i]);
+            } else if (arg == "--cluster-secret" && i + 1 < argc) {
+                config.cluster_secret = argv[++i];
+            } else if (arg == "--deflate") {
+                config.deflate = true;
+            } else if (arg == "--deflate-window-bits" && i + 1 < argc) {
+                config.deflate_window_bits = std::clamp(std::stoi(argv[++i]), 9, 15);
+            } else if (arg == "--deflate-mem-level" && i + 1 < argc) {
+                config.deflate_mem_level = std::clamp(std::stoi(argv[++i]), 1, 9);
+            } else if (arg == "--deflate-threshold" && i + 1 < argc) {
+                config.deflate_threshold = std::stoul(argv[++i]);
+            } else if (arg == "--metrics-port" && i + 1 < argc) {
+                config.metrics_port = static_cast<unsigned short>(std::stoul(argv[++i]));
+            } else if (arg == "--admin-token" && i + 1 < argc) {
+                config.admin_token = argv[++i];
+            } else if (arg == "--log-level" && i + 1 < argc) {
+                LogLevel level;
+                if (!parse_log_level(argv[++i], level)) {
+                    std::cerr << "Unknown log level: " << argv[i] << std::endl;
+                    return EXIT_FAILURE;
+                }
+                Logger::instance().set_level(level);
+            } else if (arg == "--history-cache-bytes" && i + 1 < argc) {
+                config.history_cache_bytes = std::stoul(argv[++i]);
+            } else if (arg == "--history-dir" && i + 1 < argc) {
+                config.history_dir = argv[++i];
+            } else if (arg == "--history-segment-bytes" && i + 1 < argc) {
+                config.history_segment_bytes = std::stoul(argv[++i]);
+            } else if (arg == "--history-retain-segments" && i + 1 < argc) {
+                config.history_retain_segments = std::stoul(argv[++i]);
+            } else if (arg == "--history-replay" && i + 1 < argc) {
+                config.history_replay = std::stoul(argv[++i]);
+            }
+        }
+        // --threads 0 means one worker per core.
+        if (threads <= 0) {
+            threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        }
+
+        tcp::endpoint endpoint{boost::asio::ip::make_address(address), port};
+
+        // --reuseport gives every worker its own io_context and acceptor;
+        // otherwise the workers share one io_context and one acceptor.
+        std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+        std::shared_ptr<MikoServer> server;
+        if (reuse_port) {
+            std::vector<boost::asio::io_context*> pointers;
+            for (int i = 0; i < threads; ++i) {
+                contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+                pointers.push_back(contexts.back().get());
+            }
+            server = std::make_shared<MikoServer>(pointers, endpoint, config);
+        } else {
+            contexts.push_back(std::make_unique<boost::asio::io_context>(threads));
+            server = std::make_shared<MikoServer>(*contexts.front(), endpoint, config);
+        }
         server->run();
-        ioc.run();
+        LogLine(LogLevel::Info) << "[Listening] " << server->local_endpoint() << " " << MikoServer::io_backend()
+                                << (reuse_port ? " acceptors: " + std::to_string(threads) : "");
+
+        std::vector<std::thread> workers;
+        workers.reserve(threads - 1);
+        for (int i = 1; i < threads; ++i) {
+            auto& ioc = *contexts[reuse_port ? i : 0];
+            workers.emplace_back([&ioc] { ioc.run(); });
+        }
+        contexts.front()->run();
+        for (auto& worker : workers) {
+            worker.join();
+        }
     } catch (std::exception& e) {
-        std::cerr << "Error: " << e.what() << std::endl;
+        LogLine(LogLevel::Error) << "Error: " << e.what();
+        return EXIT_FAILURE;
     }
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}